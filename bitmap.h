@@ -0,0 +1,375 @@
+#pragma once
+// Compressed bitmap of 32-bit image ids, laid out like a Roaring bitmap:
+// the id space is cut into chunks of 2^16 ids and every non-empty chunk is
+// stored either as a sorted array of 16-bit offsets (sparse chunks) or as a
+// 65536-bit bitset (dense chunks). Word loops over bitsets go through the
+// runtime-selected kernels in simd_kernels.h.
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "column.h"
+#include "simd_kernels.h"
+
+class Bitmap {
+public:
+    // Chunks holding more ids than this are stored as bitsets
+    static constexpr uint32_t array_max_cardinality = 4096;
+    static constexpr size_t bitset_words = 65536 / 64;
+
+    struct Container {
+        uint16_t key = 0;              // High 16 bits of the ids in this chunk
+        uint32_t cardinality = 0;
+        Column<uint16_t> array;        // Sorted low 16 bits, used when sparse
+        Column<uint64_t> words;        // bitset_words words, used when dense
+
+        bool is_bitset() const { return !words.empty(); }
+
+        bool contains(uint16_t low) const {
+            if (is_bitset()) {
+                return (words[low >> 6] >> (low & 63)) & 1;
+            }
+            return std::binary_search(array.begin(), array.end(), low);
+        }
+
+        void to_bitset() {
+            words.assign(bitset_words, 0);
+            for (uint16_t v : array) {
+                words[v >> 6] |= uint64_t(1) << (v & 63);
+            }
+            array.clear();
+            array.shrink_to_fit();
+        }
+
+        void to_array() {
+            array.clear();
+            array.reserve(cardinality);
+            for (size_t w = 0; w < bitset_words; ++w) {
+                uint64_t bits = words[w];
+                while (bits) {
+                    array.push_back(static_cast<uint16_t>(w * 64 + __builtin_ctzll(bits)));
+                    bits &= bits - 1;
+                }
+            }
+            words.clear();
+            words.shrink_to_fit();
+        }
+
+        // Pick the cheaper representation for the current cardinality
+        void normalize() {
+            if (is_bitset() && cardinality <= array_max_cardinality) {
+                to_array();
+            } else if (!is_bitset() && cardinality > array_max_cardinality) {
+                to_bitset();
+            }
+        }
+
+        template <typename F>
+        void for_each(uint32_t base, F&& f) const {
+            if (is_bitset()) {
+                for (size_t w = 0; w < bitset_words; ++w) {
+                    uint64_t bits = words[w];
+                    while (bits) {
+                        f(base | static_cast<uint32_t>(w * 64 + __builtin_ctzll(bits)));
+                        bits &= bits - 1;
+                    }
+                }
+            } else {
+                for (uint16_t v : array) f(base | v);
+            }
+        }
+    };
+
+    Bitmap() = default;
+
+    // Build from strictly ascending ids
+    static Bitmap from_sorted(const uint32_t* ids, size_t n) {
+        Bitmap b;
+        for (size_t i = 0; i < n; ++i) b.add(ids[i]);
+        return b;
+    }
+
+    // Build from ids in any order, duplicates allowed
+    static Bitmap from_unsorted(const uint32_t* ids, size_t n) {
+        Bitmap b;
+        for (size_t i = 0; i < n; ++i) {
+            Container& c = b.container_for(static_cast<uint16_t>(ids[i] >> 16));
+            if (!c.is_bitset()) c.to_bitset();
+            uint16_t low = static_cast<uint16_t>(ids[i]);
+            c.words[low >> 6] |= uint64_t(1) << (low & 63);
+        }
+        for (auto& c : b.containers_) {
+            c.cardinality = static_cast<uint32_t>(simd_kernels().popcount(c.words.data(), bitset_words));
+            c.normalize();
+        }
+        return b;
+    }
+
+    // Build from a flat bitset where bit i of words stands for id i
+    static Bitmap from_words(const uint64_t* words, size_t word_count) {
+        Bitmap b;
+        const SimdKernels& kernels = simd_kernels();
+        for (size_t first = 0; first < word_count; first += bitset_words) {
+            size_t n = std::min(bitset_words, word_count - first);
+            uint32_t cardinality = static_cast<uint32_t>(kernels.popcount(words + first, n));
+            if (cardinality == 0) continue;
+            Container c;
+            c.key = static_cast<uint16_t>(first / bitset_words);
+            c.cardinality = cardinality;
+            c.words.assign(bitset_words, 0);
+            std::copy(words + first, words + first + n, c.words.begin());
+            c.normalize();
+            b.containers_.push_back(std::move(c));
+        }
+        return b;
+    }
+
+    // All ids in [0, n)
+    static Bitmap full(uint32_t n) {
+        Bitmap b;
+        for (uint32_t base = 0; base < n; base += 65536) {
+            Container c;
+            c.key = static_cast<uint16_t>(base >> 16);
+            c.cardinality = std::min<uint32_t>(65536, n - base);
+            c.words.assign(bitset_words, 0);
+            for (uint32_t v = 0; v < c.cardinality; v += 64) {
+                uint32_t bits = std::min<uint32_t>(64, c.cardinality - v);
+                c.words[v >> 6] = bits == 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1;
+            }
+            c.normalize();
+            b.containers_.push_back(std::move(c));
+        }
+        return b;
+    }
+
+    // Cheap when ids arrive in ascending order, which is how the index is built
+    void add(uint32_t id) {
+        Container& c = container_for(static_cast<uint16_t>(id >> 16));
+        uint16_t low = static_cast<uint16_t>(id);
+        if (c.is_bitset()) {
+            uint64_t& w = c.words[low >> 6];
+            uint64_t mask = uint64_t(1) << (low & 63);
+            if (!(w & mask)) {
+                w |= mask;
+                ++c.cardinality;
+            }
+            return;
+        }
+        if (c.array.empty() || c.array.back() < low) {
+            c.array.push_back(low);
+        } else {
+            auto it = std::lower_bound(c.array.begin(), c.array.end(), low);
+            if (*it == low) return;
+            c.array.insert(it, low);
+        }
+        ++c.cardinality;
+        if (c.cardinality > array_max_cardinality) c.to_bitset();
+    }
+
+    bool contains(uint32_t id) const {
+        const Container* c = find_container(static_cast<uint16_t>(id >> 16));
+        return c && c->contains(static_cast<uint16_t>(id));
+    }
+
+    bool empty() const { return containers_.empty(); }
+
+    size_t cardinality() const {
+        size_t n = 0;
+        for (const auto& c : containers_) n += c.cardinality;
+        return n;
+    }
+
+    size_t size_in_bytes() const {
+        size_t n = sizeof(Bitmap) + containers_.capacity() * sizeof(Container);
+        for (const auto& c : containers_) {
+            n += c.array.capacity() * sizeof(uint16_t) + c.words.capacity() * sizeof(uint64_t);
+        }
+        return n;
+    }
+
+    void shrink_to_fit() {
+        containers_.shrink_to_fit();
+        for (auto& c : containers_) c.array.shrink_to_fit();
+    }
+
+    // Visit every id in ascending order
+    template <typename F>
+    void for_each(F&& f) const {
+        for (const auto& c : containers_) c.for_each(uint32_t(c.key) << 16, f);
+    }
+
+    std::vector<uint32_t> to_vector() const {
+        std::vector<uint32_t> ids;
+        ids.reserve(cardinality());
+        for_each([&](uint32_t id) { ids.push_back(id); });
+        return ids;
+    }
+
+    // The limit smallest ids, without visiting the containers past them
+    std::vector<uint32_t> to_vector(size_t limit) const {
+        std::vector<uint32_t> ids;
+        ids.reserve(std::min(limit, cardinality()));
+        for (const auto& c : containers_) {
+            if (ids.size() >= limit) break;
+            c.for_each(uint32_t(c.key) << 16, [&](uint32_t id) {
+                if (ids.size() < limit) ids.push_back(id);
+            });
+        }
+        return ids;
+    }
+
+    const std::vector<Container>& containers() const { return containers_; }
+
+    // Visit the (data, bytes) of every container's values, e.g. to page them in
+    template <typename F>
+    void for_each_column(F&& f) const {
+        for (const auto& c : containers_) {
+            if (!c.array.empty()) f(c.array.data(), c.array.size_in_bytes());
+            if (!c.words.empty()) f(c.words.data(), c.words.size_in_bytes());
+        }
+    }
+
+    // Snapshot section, see snapshot.h
+    template <typename Writer>
+    void save(Writer& out) const {
+        out.template write_pod<uint64_t>(containers_.size());
+        for (const auto& c : containers_) {
+            out.write_pod(c.key);
+            out.write_pod(c.cardinality);
+            out.write_column(c.array);
+            out.write_column(c.words);
+        }
+    }
+
+    template <typename Reader>
+    static Bitmap load(Reader& in) {
+        Bitmap b;
+        b.containers_.resize(in.template read_pod<uint64_t>());
+        for (auto& c : b.containers_) {
+            c.key = in.template read_pod<uint16_t>();
+            c.cardinality = in.template read_pod<uint32_t>();
+            in.read_column(c.array);
+            in.read_column(c.words);
+        }
+        return b;
+    }
+
+    friend Bitmap operator&(const Bitmap& a, const Bitmap& b) { return combine(a, b, Op::And); }
+    friend Bitmap operator|(const Bitmap& a, const Bitmap& b) { return combine(a, b, Op::Or); }
+    friend Bitmap operator-(const Bitmap& a, const Bitmap& b) { return combine(a, b, Op::AndNot); }
+
+private:
+    enum class Op { And, Or, AndNot };
+
+    std::vector<Container> containers_; // Sorted by key
+
+    Container& container_for(uint16_t key) {
+        if (containers_.empty() || containers_.back().key < key) {
+            containers_.emplace_back();
+            containers_.back().key = key;
+            return containers_.back();
+        }
+        auto it = std::lower_bound(containers_.begin(), containers_.end(), key,
+            [](const Container& c, uint16_t k) { return c.key < k; });
+        if (it == containers_.end() || it->key != key) {
+            it = containers_.insert(it, Container());
+            it->key = key;
+        }
+        return *it;
+    }
+
+    const Container* find_container(uint16_t key) const {
+        auto it = std::lower_bound(containers_.begin(), containers_.end(), key,
+            [](const Container& c, uint16_t k) { return c.key < k; });
+        return it != containers_.end() && it->key == key ? &*it : nullptr;
+    }
+
+    static Container combine(const Container& a, const Container& b, Op op) {
+        Container out;
+        out.key = a.key;
+        if (a.is_bitset() && b.is_bitset()) {
+            const SimdKernels& kernels = simd_kernels();
+            auto kernel = op == Op::And ? kernels.and_words : op == Op::Or ? kernels.or_words : kernels.andnot_words;
+            out.words.resize(bitset_words);
+            out.cardinality = static_cast<uint32_t>(kernel(a.words.data(), b.words.data(), out.words.data(), bitset_words));
+        } else if (!a.is_bitset() && !b.is_bitset()) {
+            out.array.reserve(op == Op::Or ? a.array.size() + b.array.size() : a.array.size());
+            auto dst = std::back_inserter(out.array);
+            if (op == Op::And) {
+                std::set_intersection(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), dst);
+            } else if (op == Op::Or) {
+                std::set_union(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), dst);
+            } else {
+                std::set_difference(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), dst);
+            }
+            out.cardinality = static_cast<uint32_t>(out.array.size());
+        } else if (op == Op::Or) {
+            const Container& bits = a.is_bitset() ? a : b;
+            const Container& arr = a.is_bitset() ? b : a;
+            out.words = bits.words;
+            out.cardinality = bits.cardinality;
+            for (uint16_t v : arr.array) {
+                uint64_t& w = out.words[v >> 6];
+                uint64_t mask = uint64_t(1) << (v & 63);
+                if (!(w & mask)) {
+                    w |= mask;
+                    ++out.cardinality;
+                }
+            }
+        } else if (!a.is_bitset()) {
+            // Sparse left side: keep the values the bitset does (or does not) contain
+            bool keep_if_present = op == Op::And;
+            for (uint16_t v : a.array) {
+                if (b.contains(v) == keep_if_present) out.array.push_back(v);
+            }
+            out.cardinality = static_cast<uint32_t>(out.array.size());
+        } else if (op == Op::And) {
+            for (uint16_t v : b.array) {
+                if (a.contains(v)) out.array.push_back(v);
+            }
+            out.cardinality = static_cast<uint32_t>(out.array.size());
+        } else {
+            out.words = a.words;
+            out.cardinality = a.cardinality;
+            for (uint16_t v : b.array) {
+                uint64_t& w = out.words[v >> 6];
+                uint64_t mask = uint64_t(1) << (v & 63);
+                if (w & mask) {
+                    w &= ~mask;
+                    --out.cardinality;
+                }
+            }
+        }
+        out.normalize();
+        return out;
+    }
+
+    static Bitmap combine(const Bitmap& a, const Bitmap& b, Op op) {
+        Bitmap out;
+        size_t i = 0, j = 0;
+        const auto& ca = a.containers_;
+        const auto& cb = b.containers_;
+        while (i < ca.size() && j < cb.size()) {
+            if (ca[i].key < cb[j].key) {
+                if (op != Op::And) out.containers_.push_back(ca[i]);
+                ++i;
+            } else if (cb[j].key < ca[i].key) {
+                if (op == Op::Or) out.containers_.push_back(cb[j]);
+                ++j;
+            } else {
+                Container c = combine(ca[i], cb[j], op);
+                if (c.cardinality > 0) out.containers_.push_back(std::move(c));
+                ++i;
+                ++j;
+            }
+        }
+        if (op != Op::And) {
+            for (; i < ca.size(); ++i) out.containers_.push_back(ca[i]);
+        }
+        if (op == Op::Or) {
+            for (; j < cb.size(); ++j) out.containers_.push_back(cb[j]);
+        }
+        return out;
+    }
+};
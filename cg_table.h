@@ -0,0 +1,257 @@
+#pragma once
+// Columnar copy of the CG list keeping only what the server uses: per row the
+// CG and the image number as integers, per CG its id string and title. Every
+// distinct CG id gets a dense index in order of first appearance; CG ids and
+// titles are kept in two string arenas indexed by it, and the rows of each CG
+// are one contiguous range. Image paths are formatted from (CG, image number)
+// only when they are sent. The rare rows whose image is not written as a
+// canonical number (zero-padded, or not a number at all) keep that text in a
+// side column, so their file names come out exactly as the CG list has them.
+// Lookups go through an open-addressing table of CG
+// indexes, so once built they neither allocate nor lock and are safe for
+// concurrent use.
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "pack_file.h"
+
+// Image number as written in file names: digits without leading zeros
+inline bool parse_canonical_image_number(std::string_view text, uint32_t& number) {
+    return (text.size() == 1 || (!text.empty() && text[0] != '0')) && parse_image_number(text, number);
+}
+
+class CgTable {
+public:
+    // Image number of rows whose image text is not a number
+    static constexpr uint32_t non_numeric_image = UINT32_MAX;
+
+    // Append a CG list row with the image as written in the CG list. A CG
+    // keeps the first non-empty title among its rows, rows without CG id have
+    // no title. Image text other than a canonical number is kept verbatim; a
+    // zero-padded number still finds the row's image in packs, which are
+    // keyed by its value.
+    void add_row(std::string_view cg_id, std::string_view image, std::string_view title) {
+        uint32_t number;
+        if (parse_canonical_image_number(image, number)) {
+            add_row(cg_id, number, title);
+            return;
+        }
+        if (!parse_image_number(image, number)) number = non_numeric_image;
+        verbatim_rows_.push_back(static_cast<uint32_t>(size()));
+        append(verbatim_arena_, verbatim_offsets_, image);
+        add_row(cg_id, number, title);
+    }
+
+    void add_row(std::string_view cg_id, uint32_t number, std::string_view title) {
+        auto [it, added] = building_.emplace(std::string(cg_id), static_cast<uint32_t>(cg_count()));
+        if (added) {
+            append(id_arena_, id_offsets_, cg_id);
+            building_titles_.emplace_back();
+        }
+        if (building_titles_[it->second].empty() && !cg_id.empty()) building_titles_[it->second] = title;
+        row_cgs_.push_back(it->second);
+        row_images_.push_back(number);
+    }
+
+    // Build the lookup structures once every row is added
+    void finish() {
+        for (const auto& title : building_titles_) append(title_arena_, title_offsets_, title);
+        building_.clear();
+        building_titles_.clear();
+        id_arena_.shrink_to_fit();
+        title_arena_.shrink_to_fit();
+        build_index();
+    }
+
+    // Number of CG list rows
+    size_t size() const { return row_cgs_.size(); }
+
+    // Number of distinct CG ids
+    size_t cg_count() const { return id_offsets_.size() - 1; }
+
+    // Number of CGs with a title
+    size_t title_count() const {
+        size_t count = 0;
+        for (size_t cg = 0; cg < cg_count(); ++cg) count += title_offsets_[cg + 1] != title_offsets_[cg];
+        return count;
+    }
+
+    // CG index of a CG id, -1 when unknown
+    int32_t find(std::string_view cg_id) const {
+        if (table_.empty()) return -1;
+        const size_t mask = table_.size() - 1;
+        for (size_t s = std::hash<std::string_view>{}(cg_id) & mask;; s = (s + 1) & mask) {
+            uint32_t cg = table_[s];
+            if (cg == empty_slot) return -1;
+            if (cg_id == this->cg_id(cg)) return static_cast<int32_t>(cg);
+        }
+    }
+
+    // Row of image number image of a CG id, -1 when the CG list has none
+    int64_t find_row(std::string_view cg_id, uint32_t image) const {
+        int32_t cg = find(cg_id);
+        if (cg < 0) return -1;
+        for (uint32_t k = row_offsets_[cg]; k < row_offsets_[cg + 1]; ++k) {
+            uint32_t row = cg_rows_[k];
+            if (row_images_[row] == image && verbatim_index(row) < 0) return row;
+        }
+        return -1;
+    }
+
+    // Row of "image_<image>" of a CG id, image as written in a file name; -1 when the CG list has none
+    int64_t find_row(std::string_view cg_id, std::string_view image) const {
+        uint32_t number;
+        if (parse_canonical_image_number(image, number)) return find_row(cg_id, number);
+        int32_t cg = find(cg_id);
+        if (cg < 0) return -1;
+        for (uint32_t k = row_offsets_[cg]; k < row_offsets_[cg + 1]; ++k) {
+            uint32_t row = cg_rows_[k];
+            int64_t v = verbatim_index(row);
+            if (v >= 0 && view(verbatim_arena_, verbatim_offsets_, static_cast<uint32_t>(v)) == image) return row;
+        }
+        return -1;
+    }
+
+    std::string_view cg_id(uint32_t cg) const { return view(id_arena_, id_offsets_, cg); }
+
+    // Empty when none of the CG's rows has a title
+    std::string_view title(uint32_t cg) const { return view(title_arena_, title_offsets_, cg); }
+
+    uint32_t row_cg(uint32_t row) const { return row_cgs_[row]; }
+
+    // Value of a row's image number; non_numeric_image when it is not a number
+    uint32_t row_image(uint32_t row) const { return row_images_[row]; }
+
+    // The n of a row's image_<n> file names
+    std::string image_name(uint32_t row) const {
+        int64_t v = verbatim_index(row);
+        if (v < 0) return std::to_string(row_images_[row]);
+        return std::string(view(verbatim_arena_, verbatim_offsets_, static_cast<uint32_t>(v)));
+    }
+
+    // "<cg_id>/image_<n><extension>" of a row
+    std::string image_path(uint32_t row, std::string_view extension = ".webp") const {
+        std::string path(cg_id(row_cgs_[row]));
+        path += "/image_";
+        path += image_name(row);
+        path += extension;
+        return path;
+    }
+
+    size_t size_in_bytes() const {
+        return id_arena_.capacity() + title_arena_.capacity() + verbatim_arena_.capacity() +
+               (id_offsets_.capacity() + title_offsets_.capacity() + row_cgs_.capacity() + row_images_.capacity() +
+                verbatim_rows_.capacity() + verbatim_offsets_.capacity() + row_offsets_.capacity() + cg_rows_.capacity() +
+                table_.capacity()) * sizeof(uint32_t);
+    }
+
+    // Snapshot section, see snapshot.h; the lookup structures are rebuilt on load
+    template <typename Writer>
+    void save(Writer& out) const {
+        out.write_string(id_arena_);
+        out.write_vector(id_offsets_);
+        out.write_string(title_arena_);
+        out.write_vector(title_offsets_);
+        out.write_vector(row_cgs_);
+        out.write_vector(row_images_);
+        out.write_vector(verbatim_rows_);
+        out.write_string(verbatim_arena_);
+        out.write_vector(verbatim_offsets_);
+    }
+
+    template <typename Reader>
+    static CgTable load(Reader& in) {
+        CgTable t;
+        t.id_arena_ = in.read_string();
+        in.read_vector(t.id_offsets_);
+        t.title_arena_ = in.read_string();
+        in.read_vector(t.title_offsets_);
+        in.read_vector(t.row_cgs_);
+        in.read_vector(t.row_images_);
+        in.read_vector(t.verbatim_rows_);
+        t.verbatim_arena_ = in.read_string();
+        in.read_vector(t.verbatim_offsets_);
+        if (!valid_offsets(t.id_offsets_, t.id_arena_) || !valid_offsets(t.title_offsets_, t.title_arena_) ||
+            t.id_offsets_.size() != t.title_offsets_.size() || t.row_cgs_.size() != t.row_images_.size() ||
+            !valid_offsets(t.verbatim_offsets_, t.verbatim_arena_) || t.verbatim_offsets_.size() != t.verbatim_rows_.size() + 1 ||
+            !std::is_sorted(t.verbatim_rows_.begin(), t.verbatim_rows_.end()) ||
+            (!t.verbatim_rows_.empty() && t.verbatim_rows_.back() >= t.size())) {
+            throw std::runtime_error("snapshot CG table is corrupt");
+        }
+        for (uint32_t cg : t.row_cgs_) {
+            if (cg >= t.cg_count()) throw std::runtime_error("snapshot CG table is corrupt");
+        }
+        t.build_index();
+        return t;
+    }
+
+private:
+    static constexpr uint32_t empty_slot = UINT32_MAX;
+
+    std::string id_arena_;
+    std::vector<uint32_t> id_offsets_{0};
+    std::string title_arena_;
+    std::vector<uint32_t> title_offsets_{0};
+    std::vector<uint32_t> row_cgs_;    // Row -> CG index
+    std::vector<uint32_t> row_images_; // Row -> image number
+    std::vector<uint32_t> verbatim_rows_;    // Ascending rows whose image is not a canonical number
+    std::string verbatim_arena_;             // Their image text
+    std::vector<uint32_t> verbatim_offsets_{0};
+    std::vector<uint32_t> row_offsets_; // CG index -> its range of cg_rows_
+    std::vector<uint32_t> cg_rows_;     // Rows grouped by CG, each group ascending
+    std::vector<uint32_t> table_;       // Hash slot -> CG index, at most half full
+    std::unordered_map<std::string, uint32_t> building_; // CG id -> index while rows are added
+    std::vector<std::string> building_titles_;
+
+    // Position of row in verbatim_rows_, -1 when its image is a canonical number
+    int64_t verbatim_index(uint32_t row) const {
+        if (verbatim_rows_.empty()) return -1;
+        auto it = std::lower_bound(verbatim_rows_.begin(), verbatim_rows_.end(), row);
+        return it != verbatim_rows_.end() && *it == row ? it - verbatim_rows_.begin() : -1;
+    }
+
+    static void append(std::string& arena, std::vector<uint32_t>& offsets, std::string_view value) {
+        arena += value;
+        offsets.push_back(static_cast<uint32_t>(arena.size()));
+    }
+
+    static std::string_view view(const std::string& arena, const std::vector<uint32_t>& offsets, uint32_t index) {
+        return std::string_view(arena).substr(offsets[index], offsets[index + 1] - offsets[index]);
+    }
+
+    static bool valid_offsets(const std::vector<uint32_t>& offsets, const std::string& arena) {
+        if (offsets.empty() || offsets[0] != 0 || offsets.back() != arena.size()) return false;
+        for (size_t i = 1; i < offsets.size(); ++i) {
+            if (offsets[i] < offsets[i - 1]) return false;
+        }
+        return true;
+    }
+
+    void build_index() {
+        row_offsets_.assign(cg_count() + 1, 0);
+        for (uint32_t cg : row_cgs_) row_offsets_[cg + 1]++;
+        for (size_t cg = 0; cg < cg_count(); ++cg) row_offsets_[cg + 1] += row_offsets_[cg];
+        cg_rows_.resize(size());
+        std::vector<uint32_t> next(row_offsets_.begin(), row_offsets_.end() - 1);
+        for (uint32_t row = 0; row < size(); ++row) cg_rows_[next[row_cgs_[row]]++] = row;
+
+        table_.clear();
+        if (cg_count() == 0) return;
+        size_t slots = 2;
+        while (slots < 2 * cg_count()) slots *= 2;
+        table_.assign(slots, empty_slot);
+        const size_t mask = slots - 1;
+        for (uint32_t cg = 0; cg < cg_count(); ++cg) {
+            size_t s = std::hash<std::string_view>{}(cg_id(cg)) & mask;
+            while (table_[s] != empty_slot) s = (s + 1) & mask;
+            table_[s] = cg;
+        }
+    }
+};
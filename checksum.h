@@ -0,0 +1,57 @@
+#pragma once
+// Fast 64-bit checksum over 8-byte words, fed in arbitrary pieces. Used to
+// verify snapshots and to fingerprint packed images; not cryptographic.
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+class Checksum64 {
+public:
+    void update(const void* data, size_t n) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        length_ += n;
+        if (pending_size_ > 0) {
+            size_t take = std::min(n, 8 - pending_size_);
+            std::memcpy(pending_ + pending_size_, p, take);
+            pending_size_ += take;
+            p += take;
+            n -= take;
+            if (pending_size_ == 8) {
+                mix_word(pending_);
+                pending_size_ = 0;
+            }
+        }
+        for (; n >= 8; n -= 8, p += 8) mix_word(p);
+        std::memcpy(pending_ + pending_size_, p, n);
+        pending_size_ += n;
+    }
+
+    uint64_t value() const {
+        uint64_t h = hash_;
+        for (size_t i = 0; i < pending_size_; ++i) h = (h ^ pending_[i]) * 0x100000001b3ULL;
+        h ^= length_;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        return h ^ (h >> 33);
+    }
+
+private:
+    void mix_word(const unsigned char* p) {
+        uint64_t w;
+        std::memcpy(&w, p, 8);
+        hash_ ^= w * 0x87c37b91114253d5ULL;
+        hash_ = ((hash_ << 31) | (hash_ >> 33)) * 0x4cf5ad432745937fULL;
+    }
+
+    uint64_t hash_ = 0x9e3779b97f4a7c15ULL;
+    uint64_t length_ = 0;
+    unsigned char pending_[8];
+    size_t pending_size_ = 0;
+};
+
+inline uint64_t checksum64(const void* data, size_t n) {
+    Checksum64 checksum;
+    checksum.update(data, n);
+    return checksum.value();
+}
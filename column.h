@@ -0,0 +1,158 @@
+#pragma once
+// Array of plain values that either owns its memory like a std::vector or is a
+// read-only view of values inside a mapped file. Out-of-core mode loads the
+// tag store and the index as views into their segment file, so they live in
+// the page cache instead of the heap and the kernel pages them in and out;
+// otherwise the same data is owned. Reads cost the same either way: data()
+// and size() always describe the current values. Any change to a view first
+// copies its values into owned memory, and copying a column always makes an
+// owned copy, so a view never outlives the mapping through a copy; the
+// mapping has to outlive the column itself.
+#include <algorithm>
+#include <cstddef>
+#include <initializer_list>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <typename T>
+class Column {
+    static_assert(std::is_trivially_copyable<T>::value, "columns hold plain values");
+
+public:
+    using value_type = T;
+    using iterator = T*;
+    using const_iterator = const T*;
+
+    Column() = default;
+    Column(std::initializer_list<T> values) : owned_(values) { sync(); }
+
+    Column(const Column& other) : owned_(other.begin(), other.end()) { sync(); }
+
+    Column(Column&& other) noexcept { *this = std::move(other); }
+
+    Column& operator=(const Column& other) {
+        if (this != &other) {
+            owned_.assign(other.begin(), other.end());
+            sync();
+        }
+        return *this;
+    }
+
+    Column& operator=(Column&& other) noexcept {
+        if (this != &other) {
+            owned_ = std::move(other.owned_);
+            if (other.viewed_) {
+                data_ = other.data_;
+                size_ = other.size_;
+                viewed_ = true;
+            } else {
+                sync();
+            }
+            other.owned_.clear();
+            other.sync();
+        }
+        return *this;
+    }
+
+    // The n values at data, which must stay mapped while the column refers to them
+    static Column view(const T* data, size_t n) {
+        Column c;
+        c.data_ = data;
+        c.size_ = n;
+        c.viewed_ = true;
+        return c;
+    }
+
+    // Whether the values are in a mapped file rather than owned
+    bool is_view() const { return viewed_; }
+
+    const T* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    // Heap memory held; views hold none
+    size_t capacity() const { return owned_.capacity(); }
+    size_t size_in_bytes() const { return size_ * sizeof(T); }
+
+    const T& operator[](size_t i) const { return data_[i]; }
+    const T& back() const { return data_[size_ - 1]; }
+    const T* begin() const { return data_; }
+    const T* end() const { return data_ + size_; }
+
+    T* data() { return own().data(); }
+    T& operator[](size_t i) { return own()[i]; }
+    T* begin() { return own().data(); }
+    T* end() { return own().data() + size_; }
+
+    void push_back(const T& value) {
+        own().push_back(value);
+        sync();
+    }
+
+    T* insert(T* position, const T& value) {
+        size_t at = static_cast<size_t>(position - own().data());
+        owned_.insert(owned_.begin() + static_cast<std::ptrdiff_t>(at), value);
+        sync();
+        return owned_.data() + at;
+    }
+
+    template <typename Iterator>
+    void insert(T* position, Iterator first, Iterator last) {
+        size_t at = static_cast<size_t>(position - own().data());
+        owned_.insert(owned_.begin() + static_cast<std::ptrdiff_t>(at), first, last);
+        sync();
+    }
+
+    void assign(size_t n, const T& value) {
+        owned_.assign(n, value);
+        sync();
+    }
+
+    template <typename Iterator>
+    void assign(Iterator first, Iterator last) {
+        owned_.assign(first, last);
+        sync();
+    }
+
+    void resize(size_t n) {
+        own().resize(n);
+        sync();
+    }
+
+    void reserve(size_t n) {
+        own().reserve(n);
+        sync();
+    }
+
+    void clear() {
+        owned_.clear();
+        sync();
+    }
+
+    void shrink_to_fit() {
+        if (viewed_) return;
+        owned_.shrink_to_fit();
+        sync();
+    }
+
+private:
+    // The owned values, copied out of the mapping first when viewed
+    std::vector<T>& own() {
+        if (viewed_) {
+            owned_.assign(data_, data_ + size_);
+            sync();
+        }
+        return owned_;
+    }
+
+    void sync() {
+        data_ = owned_.data();
+        size_ = owned_.size();
+        viewed_ = false;
+    }
+
+    std::vector<T> owned_;
+    const T* data_ = nullptr;
+    size_t size_ = 0;
+    bool viewed_ = false;
+};
@@ -0,0 +1,54 @@
+#pragma once
+// Minimal streaming CSV reader for the data files: comma separated fields,
+// optionally wrapped in double quotes with "" standing for a literal quote.
+// Records do not span lines.
+#include <fstream>
+#include <string>
+#include <vector>
+
+inline void parse_csv_line(const std::string& line, std::vector<std::string>& fields) {
+    fields.clear();
+    std::string field;
+    bool quoted = false;
+    for (size_t i = 0; i < line.size(); ++i) {
+        char c = line[i];
+        if (quoted) {
+            if (c == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+                field += '"';
+                ++i;
+            } else if (c == '"') {
+                quoted = false;
+            } else {
+                field += c;
+            }
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == ',') {
+            fields.push_back(field);
+            field.clear();
+        } else if (c != '\r' || i + 1 != line.size()) {
+            field += c;
+        }
+    }
+    fields.push_back(field);
+}
+
+// Calls on_row(fields) for every line; returns false if the file cannot be opened
+template <typename OnRow>
+bool read_csv(const std::string& filepath, OnRow&& on_row) {
+    std::ifstream fin(filepath);
+    if (!fin) {
+        return false;
+    }
+    std::string line;
+    std::vector<std::string> fields;
+    bool first = true;
+    while (std::getline(fin, line)) {
+        if (first && line.compare(0, 3, "\xEF\xBB\xBF") == 0) line.erase(0, 3); // UTF-8 BOM
+        first = false;
+        if (line.empty() || line == "\r") continue;
+        parse_csv_line(line, fields);
+        on_row(fields);
+    }
+    return true;
+}
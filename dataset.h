@@ -0,0 +1,236 @@
+#pragma once
+// Everything requests read as one immutable value: the tag dictionary, the
+// mapped packs, the base segment (CG list rows, their tags and the inverted
+// index) loaded at startup or written by the last compaction, the delta
+// segment of images ingested since, and which rows have an image.
+// Request threads take the current dataset with std::atomic_load and keep
+// using it for as long as they need; search results paged through later keep
+// only its CG list and delta. Every change publishes a new dataset sharing the
+// parts it did not touch, and a dataset is freed once nothing holds it any more. A reload
+// builds a whole new one from the sources next to the live one and swaps it
+// in the same way, so tag ids, rows and packs always come from one load.
+//
+// Compaction folds the delta into a new base: rows without tombstone are
+// copied in order (base rows first, then delta rows), the index is rebuilt
+// and the images of delta rows no image scan has covered yet are checked. It
+// runs on a background thread at a bounded share of one core, so searches
+// running at the same time keep their latency; rows are renumbered, which is
+// safe because every search result holds the CG list and delta its rows refer to.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "cg_table.h"
+#include "delta_segment.h"
+#include "image_availability.h"
+#include "image_pack.h"
+#include "mapped_file.h"
+#include "residency.h"
+#include "tag_dictionary.h"
+#include "tag_index.h"
+#include "tag_pack.h"
+#include "tag_segment.h"
+#include "tag_store.h"
+
+struct BaseSegment {
+    std::shared_ptr<const CgTable> cg_table = std::make_shared<const CgTable>(); // Shared with the search results paging through its rows
+    TagStore tags; // One image per CG list row
+    TagIndex index; // Empty when searches scan instead
+    std::shared_ptr<const MappedFile> mapping; // Segment file tags and index are views into (out-of-core mode), else null
+};
+
+struct Dataset {
+    uint64_t generation = 0; // Increases with every load from the sources
+    std::shared_ptr<const TagDictionary> dictionary; // Tag ids of base, delta and index
+    std::shared_ptr<const ImagePack> image_pack; // Closed when there is none
+    std::shared_ptr<const TagPack> tag_pack;     // Closed when there is none
+    std::shared_ptr<TagHeat> heat; // Queries per tag id, deciding which postings stay in memory
+    std::shared_ptr<const BaseSegment> base;
+    std::shared_ptr<const DeltaSegment> delta;
+    std::shared_ptr<const ImageAvailability> availability; // Of the base rows and the delta rows the last scan saw
+    uint64_t version = 0; // Increases with every published dataset of a generation
+    uint64_t compactions = 0; // Increases with every base a compaction publishes
+
+    // Changes whenever the base rows change: at reloads and compactions, not at ingests
+    uint64_t base_generation() const { return generation << 32 | compactions; }
+
+    // Increases with every published dataset, across reloads too
+    uint64_t live_generation() const { return generation << 32 | version; }
+
+    // Live row of an image of a CG, -1 when it has none
+    int64_t find_row(std::string_view cg_id, uint32_t image) const {
+        int64_t row = delta->find(cg_id, image);
+        if (row >= 0) return row;
+        row = base->cg_table->find_row(cg_id, image);
+        return row >= 0 && delta->deleted().contains(static_cast<uint32_t>(row)) ? -1 : row;
+    }
+
+    // Live CG list row of image_<image> of a CG, image as written in its file name; -1 when it has none
+    int64_t find_base_row(std::string_view cg_id, std::string_view image) const {
+        int64_t row = base->cg_table->find_row(cg_id, image);
+        return row >= 0 && delta->deleted().contains(static_cast<uint32_t>(row)) ? -1 : row;
+    }
+
+    // Store and index holding a row's tags
+    std::pair<const TagStore*, uint32_t> tags_of(uint32_t row) const {
+        if (row < base->cg_table->size()) return {&base->tags, row};
+        auto [chunk, i] = delta->locate(row);
+        return {&chunk->tags, i};
+    }
+
+    // "<cg_id>/image_<n>.webp" of a row
+    std::string image_path(uint32_t row) const {
+        return row < base->cg_table->size() ? base->cg_table->image_path(row) : delta->image_path(row);
+    }
+
+    // CG title from the CG list, else one sent with an ingested image
+    std::string_view title(std::string_view cg_id) const {
+        int32_t cg = base->cg_table->find(cg_id);
+        std::string_view title = cg >= 0 ? base->cg_table->title(static_cast<uint32_t>(cg)) : std::string_view();
+        return title.empty() ? delta->title(cg_id) : title;
+    }
+};
+
+// Keeps a background job to a share of one core: every check_every calls of
+// pace() it sleeps long enough for the time worked since the last sleep to be
+// at most share of the time passed
+class Throttle {
+public:
+    explicit Throttle(double share) : share_(share), resumed_(std::chrono::steady_clock::now()) {}
+
+    void pace() {
+        if (share_ >= 1.0 || ++calls_ % check_every != 0) return;
+        auto worked = std::chrono::steady_clock::now() - resumed_;
+        std::this_thread::sleep_for(worked * ((1.0 - share_) / share_));
+        resumed_ = std::chrono::steady_clock::now();
+    }
+
+private:
+    static constexpr uint64_t check_every = 1024;
+
+    double share_;
+    std::chrono::steady_clock::time_point resumed_;
+    uint64_t calls_ = 0;
+};
+
+// Let every other thread run first; on Linux the nice value is per thread
+inline void lower_thread_priority() {
+#ifdef __linux__
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+#endif
+}
+
+struct Compaction {
+    std::shared_ptr<BaseSegment> base;
+    std::shared_ptr<const ImageAvailability> availability;
+    std::vector<int64_t> remap; // Row of the compacted dataset -> row of the new base, -1 when dropped
+};
+
+// Fold set's delta into a new base. stat_image(filename, size, mtime) tells
+// whether a moved delta row's image exists; rows set's availability
+// covers keep what it says. Given a segment, the new base's tags go to it
+// instead and its tag store and index are left empty (out-of-core mode).
+template <typename StatImage>
+Compaction compact_segments(const Dataset& set, size_t tag_count, bool with_index, StatImage&& stat_image,
+    Throttle& throttle, TagSegmentWriter* segment = nullptr) {
+    const BaseSegment& base = *set.base;
+    const DeltaSegment& delta = *set.delta;
+    const uint32_t base_rows = static_cast<uint32_t>(base.cg_table->size());
+    auto next = std::make_shared<BaseSegment>();
+    CgTable cg_table;
+    Compaction result;
+    result.remap.assign(base_rows + delta.size(), -1);
+    std::vector<uint32_t> sources; // New row -> compacted row
+
+    for (uint32_t row = 0; row < base_rows + delta.size(); ++row) {
+        throttle.pace();
+        if (delta.deleted().contains(row)) continue;
+        if (row < base_rows) {
+            uint32_t cg = base.cg_table->row_cg(row);
+            cg_table.add_row(base.cg_table->cg_id(cg), base.cg_table->image_name(row), base.cg_table->title(cg));
+            if (segment) {
+                segment->append_image(base.tags, row);
+            } else {
+                next->tags.append_image(base.tags, row);
+            }
+        } else {
+            // The CG list's title comes first, so it keeps priority over titles sent with images
+            auto [chunk, i] = delta.locate(row);
+            cg_table.add_row(chunk->cg_ids[i], chunk->images[i], chunk->titles[i]);
+            if (segment) {
+                segment->append_image(chunk->tags, i);
+            } else {
+                next->tags.append_image(chunk->tags, i);
+            }
+        }
+        result.remap[row] = static_cast<int64_t>(sources.size());
+        sources.push_back(row);
+    }
+    cg_table.finish();
+    next->cg_table = std::make_shared<const CgTable>(std::move(cg_table));
+    next->tags.shrink_to_fit();
+    if (with_index && !segment) next->index = build_tag_index(next->tags, tag_count, [&] { throttle.pace(); });
+
+    auto availability = std::make_shared<ImageAvailability>(scan_image_availability(sources.size(),
+        [&](size_t i, uint64_t& size, int64_t& mtime) {
+            throttle.pace();
+            uint32_t row = sources[i];
+            if (row < set.availability->size()) {
+                size = set.availability->sizes[row];
+                mtime = set.availability->mtimes[row];
+                return set.availability->available.contains(row);
+            }
+            return stat_image(delta.image_path(row), size, mtime);
+        }, 1));
+    availability->version = set.availability->version + 1;
+    result.availability = std::move(availability);
+    result.base = std::move(next);
+    return result;
+}
+
+// The availability to publish with a compaction: current's, which a rescan
+// may have replaced while compacting, moved to the new rows like the
+// tombstones. Rows it does not cover keep what the compaction checked; the
+// delta rows after the compacted ones that it covers follow the new base.
+inline std::shared_ptr<const ImageAvailability> remap_availability(const ImageAvailability& current,
+    const Compaction& compacted) {
+    const ImageAvailability& checked = *compacted.availability;
+    const size_t folded = compacted.remap.size();
+    const size_t base_rows = checked.size();
+    const size_t carried = current.size() > folded ? current.size() - folded : 0;
+    auto result = std::make_shared<ImageAvailability>();
+    result->sizes = checked.sizes;
+    result->mtimes = checked.mtimes;
+    result->sizes.resize(base_rows + carried, 0);
+    result->mtimes.resize(base_rows + carried, -1);
+    std::vector<char> available(base_rows + carried, 0);
+    checked.available.for_each([&](uint32_t row) { available[row] = 1; });
+    auto take = [&](size_t from, size_t to) {
+        result->sizes[to] = current.sizes[from];
+        result->mtimes[to] = current.mtimes[from];
+        available[to] = current.available.contains(static_cast<uint32_t>(from));
+    };
+    for (size_t row = 0; row < std::min(current.size(), folded); ++row) {
+        if (compacted.remap[row] >= 0) take(row, static_cast<size_t>(compacted.remap[row]));
+    }
+    for (size_t k = 0; k < carried; ++k) take(folded + k, base_rows + k);
+    std::vector<uint32_t> rows;
+    for (size_t row = 0; row < available.size(); ++row) {
+        if (available[row]) rows.push_back(static_cast<uint32_t>(row));
+    }
+    result->available = Bitmap::from_sorted(rows.data(), rows.size());
+    result->version = current.version + 1;
+    return result;
+}
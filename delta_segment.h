@@ -0,0 +1,163 @@
+#pragma once
+// Images tagged while the server runs, searched together with the base data
+// loaded at startup. The delta continues the base row numbering: its k-th
+// image is row base_rows + k, so search results stay bitmaps of rows and a
+// row handed out once keeps naming the same image. Ingestion appends a batch
+// as a new chunk and publishes a new segment that shares every older chunk;
+// a published segment is never modified, so searches read whatever segment
+// they loaded without locking, and chunks are freed once the last search
+// holding an older segment lets go of it. Publishing copies the table of
+// delta image names, which stays small because compaction (dataset.h)
+// folds the delta into a new base now and then.
+//
+// Re-tagging an image appends it again and leaves a tombstone on its old row;
+// removing it only leaves the tombstone. Searches mask the tombstoned rows out
+// with one AND-NOT of the deleted bitmap until compaction drops them.
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "bitmap.h"
+#include "tag_store.h"
+
+// One ingested batch
+struct DeltaChunk {
+    uint32_t first_row = 0; // Row of the first image, set when published
+    std::vector<std::string> cg_ids;
+    std::vector<uint32_t> images; // Image numbers
+    std::vector<std::string> titles; // Title sent with the image, may be empty
+    std::vector<char> available; // Whether the image existed when it was ingested, until an image scan covers it
+    TagStore tags;
+
+    size_t size() const { return images.size(); }
+
+    void add(std::string_view cg_id, uint32_t image, std::string_view title, bool image_available,
+        const std::vector<TagEntry>& entries, const std::vector<uint8_t>& categories) {
+        cg_ids.emplace_back(cg_id);
+        images.push_back(image);
+        titles.emplace_back(title);
+        available.push_back(image_available);
+        tags.add_image(entries, categories);
+    }
+};
+
+class DeltaSegment {
+public:
+    explicit DeltaSegment(uint32_t base_rows = 0) : base_rows_(base_rows) {}
+
+    // Rows before the delta
+    uint32_t base_rows() const { return base_rows_; }
+
+    // Images in the delta
+    size_t size() const { return size_; }
+    size_t chunk_count() const { return chunks_.size(); }
+    const std::vector<std::shared_ptr<const DeltaChunk>>& chunks() const { return chunks_; }
+
+    // Rows of the base and the delta that were replaced or removed
+    const Bitmap& deleted() const { return deleted_; }
+
+    bool contains(uint32_t row) const { return row >= base_rows_ && row - base_rows_ < size_; }
+
+    // A segment with chunk appended and tombstones on the removed rows; this
+    // one stays valid and unchanged. A removed row may be one of chunk's.
+    std::shared_ptr<const DeltaSegment> with(DeltaChunk chunk, std::vector<uint32_t> removed = {}) const {
+        auto next = std::make_shared<DeltaSegment>(*this);
+        chunk.first_row = static_cast<uint32_t>(base_rows_ + size_);
+        for (uint32_t i = 0; i < chunk.size(); ++i) {
+            next->rows_.insert_or_assign(key(chunk.cg_ids[i], chunk.images[i]), chunk.first_row + i);
+        }
+        next->size_ += chunk.size();
+        if (chunk.size() > 0) next->chunks_.push_back(std::make_shared<const DeltaChunk>(std::move(chunk)));
+        if (!removed.empty()) {
+            std::sort(removed.begin(), removed.end());
+            removed.erase(std::unique(removed.begin(), removed.end()), removed.end());
+            for (uint32_t row : removed) {
+                if (!next->contains(row)) continue;
+                auto [c, i] = next->locate(row);
+                auto it = next->rows_.find(key(c->cg_ids[i], c->images[i]));
+                if (it != next->rows_.end() && it->second == row) next->rows_.erase(it);
+            }
+            next->deleted_ = deleted_ | Bitmap::from_sorted(removed.data(), removed.size());
+        }
+        return next;
+    }
+
+    // Latest live row of an image of a CG, -1 when the delta has none
+    int64_t find(std::string_view cg_id, uint32_t image) const {
+        auto it = rows_.find(key(cg_id, image));
+        return it == rows_.end() ? -1 : static_cast<int64_t>(it->second);
+    }
+
+    // Chunk holding a delta row and the row's index in it
+    std::pair<const DeltaChunk*, uint32_t> locate(uint32_t row) const {
+        auto it = std::upper_bound(chunks_.begin(), chunks_.end(), row,
+            [](uint32_t r, const std::shared_ptr<const DeltaChunk>& chunk) { return r < chunk->first_row; });
+        const DeltaChunk* chunk = std::prev(it)->get();
+        return {chunk, row - chunk->first_row};
+    }
+
+    // "<cg_id>/image_<n><extension>" of a delta row
+    std::string image_path(uint32_t row, std::string_view extension = ".webp") const {
+        auto [chunk, i] = locate(row);
+        std::string path = chunk->cg_ids[i];
+        path += "/image_";
+        path += std::to_string(chunk->images[i]);
+        path += extension;
+        return path;
+    }
+
+    // First non-empty title sent with an image of the CG
+    std::string_view title(std::string_view cg_id) const {
+        for (const auto& chunk : chunks_) {
+            for (size_t i = 0; i < chunk->size(); ++i) {
+                if (chunk->cg_ids[i] == cg_id && !chunk->titles[i].empty()) return chunk->titles[i];
+            }
+        }
+        return {};
+    }
+
+    // Ascending rows of available, live delta images for which match(tags, index)
+    // holds. Rows below scanned_rows are available when in available (the last
+    // image scan), later ones when their image existed at ingest.
+    template <typename Match>
+    std::vector<uint32_t> matching_rows(const Bitmap& available, size_t scanned_rows, Match&& match) const {
+        std::vector<uint32_t> rows;
+        for (const auto& chunk : chunks_) {
+            for (uint32_t i = 0; i < chunk->size(); ++i) {
+                uint32_t row = chunk->first_row + i;
+                bool has_image = row < scanned_rows ? available.contains(row) : static_cast<bool>(chunk->available[i]);
+                if (has_image && chunk->tags.has_tags(i) && !deleted_.contains(row) && match(chunk->tags, i)) {
+                    rows.push_back(row);
+                }
+            }
+        }
+        return rows;
+    }
+
+    size_t size_in_bytes() const {
+        size_t bytes = rows_.size() * (sizeof(uint32_t) + 32) + deleted_.size_in_bytes();
+        for (const auto& chunk : chunks_) {
+            bytes += chunk->tags.size_in_bytes() + chunk->size() * (sizeof(uint32_t) + 1 + 2 * sizeof(std::string));
+        }
+        return bytes;
+    }
+
+private:
+    static std::string key(std::string_view cg_id, uint32_t image) {
+        std::string k(cg_id);
+        k += '/';
+        k += std::to_string(image);
+        return k;
+    }
+
+    uint32_t base_rows_;
+    size_t size_ = 0;
+    std::vector<std::shared_ptr<const DeltaChunk>> chunks_;
+    std::unordered_map<std::string, uint32_t> rows_; // "<cg_id>/<image>" -> latest live row
+    Bitmap deleted_;
+};
@@ -0,0 +1,118 @@
+#pragma once
+// HTTP validators for the image and image info handlers: strong ETags,
+// Last-Modified, Cache-Control, and the conditional request headers that turn
+// a repeat download into an empty 304 (If-None-Match, If-Modified-Since) or
+// keep a resumed range request consistent (If-Range). Byte ranges themselves
+// are served by httplib from the response's content.
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+#include "httplib.h"
+
+struct HttpValidators {
+    std::string etag;              // Quoted strong entity tag
+    std::time_t last_modified = 0; // 0 when unknown
+    std::string cache_control;
+};
+
+inline std::string quoted_etag(uint64_t a, uint64_t b = 0, uint64_t c = 0) {
+    char buffer[64];
+    if (b == 0 && c == 0) {
+        std::snprintf(buffer, sizeof(buffer), "\"%016llx\"", static_cast<unsigned long long>(a));
+    } else {
+        std::snprintf(buffer, sizeof(buffer), "\"%llx-%llx-%llx\"", static_cast<unsigned long long>(a),
+            static_cast<unsigned long long>(b), static_cast<unsigned long long>(c));
+    }
+    return buffer;
+}
+
+// IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+inline std::string http_date(std::time_t t) {
+    std::tm tm{};
+#ifdef _WIN32
+    gmtime_s(&tm, &t);
+#else
+    gmtime_r(&t, &tm);
+#endif
+    char buffer[64];
+    std::strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buffer;
+}
+
+// Inverse of http_date; 0 when the text is not an IMF-fixdate
+inline std::time_t parse_http_date(const std::string& text) {
+    static const char* months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    char month_name[4] = {};
+    int day, year, hour, minute, second;
+    if (std::sscanf(text.c_str(), "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &day, month_name, &year, &hour, &minute, &second) != 6) {
+        return 0;
+    }
+    int month = 0;
+    while (month < 12 && std::strcmp(months[month], month_name) != 0) ++month;
+    if (month == 12) return 0;
+    // Days since 1970-01-01 of a proleptic Gregorian date (civil_from_days inverted)
+    int y = year - (month < 2);
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (month + (month < 2 ? 10 : -2)) + 2) / 5 + day - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t days = int64_t(era) * 146097 + doe - 719468;
+    return static_cast<std::time_t>(days * 86400 + hour * 3600 + minute * 60 + second);
+}
+
+// Whether an If-None-Match list ("*" or comma separated tags, possibly weak) names etag
+inline bool etag_listed(const std::string& header, const std::string& etag) {
+    size_t pos = 0;
+    while (pos < header.size()) {
+        size_t end = header.find(',', pos);
+        if (end == std::string::npos) end = header.size();
+        size_t first = header.find_first_not_of(" \t", pos);
+        size_t last = header.find_last_not_of(" \t", end - 1);
+        if (first != std::string::npos && first < end) {
+            std::string tag = header.substr(first, last - first + 1);
+            if (tag == "*") return true;
+            if (tag.compare(0, 2, "W/") == 0) tag.erase(0, 2);
+            if (tag == etag) return true;
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
+// Set the validators on res. Returns true when the client's copy is current,
+// in which case res is already a bodiless 304 and the handler is done. When
+// an If-Range no longer matches, res.status is set to 200 and the handler must
+// set the whole body with set_content: httplib slices content providers to the
+// requested ranges whatever the status.
+inline bool answer_conditional(const httplib::Request& req, httplib::Response& res, const HttpValidators& validators) {
+    res.set_header("ETag", validators.etag);
+    if (validators.last_modified != 0) res.set_header("Last-Modified", http_date(validators.last_modified));
+    if (!validators.cache_control.empty()) res.set_header("Cache-Control", validators.cache_control);
+    res.set_header("Accept-Ranges", "bytes");
+
+    // If-None-Match takes precedence over If-Modified-Since
+    bool current = false;
+    if (req.has_header("If-None-Match")) {
+        current = etag_listed(req.get_header_value("If-None-Match"), validators.etag);
+    } else if (req.has_header("If-Modified-Since") && validators.last_modified != 0) {
+        std::time_t since = parse_http_date(req.get_header_value("If-Modified-Since"));
+        current = since != 0 && validators.last_modified <= since;
+    }
+    if (current) {
+        res.status = 304;
+        return true;
+    }
+
+    // A range only applies to the representation the client already has part of
+    if (!req.ranges.empty() && req.has_header("If-Range")) {
+        const std::string condition = req.get_header_value("If-Range");
+        bool same = condition.size() > 0 && condition[0] == '"'
+            ? condition == validators.etag
+            : validators.last_modified != 0 && parse_http_date(condition) == validators.last_modified;
+        if (!same) res.status = 200; // Whole body instead of the requested ranges
+    }
+    return false;
+}
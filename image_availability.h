@@ -0,0 +1,124 @@
+#pragma once
+// Which CG list rows have an image to serve, found by one stat per row at
+// startup instead of one per search match. The rows are stat-ed in parallel
+// (on network storage each call mostly waits), and the result is a bitmap of
+// available rows that searches AND into their matches, plus the size and
+// modification time of every image. A background rescan rebuilds it
+// periodically, ingested rows included, so images added or removed later are
+// picked up.
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "bitmap.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+struct ImageAvailability {
+    Bitmap available;            // Rows whose image exists
+    std::vector<uint64_t> sizes; // Bytes of each row's image, 0 when missing
+    std::vector<int64_t> mtimes; // Modification time of each row's image, -1 when missing
+    uint64_t version = 0;        // Increases whenever a rescan finds a difference or a compaction moves rows
+
+    size_t size() const { return sizes.size(); }
+
+    // Number of rows both cover that differ in existence, size or modification time
+    size_t changes(const ImageAvailability& other) const {
+        size_t changed = 0;
+        for (size_t i = 0; i < std::min(size(), other.size()); ++i) {
+            changed += sizes[i] != other.sizes[i] || mtimes[i] != other.mtimes[i];
+        }
+        return changed;
+    }
+
+    // Snapshot section, see snapshot.h
+    template <typename Writer>
+    void save(Writer& out) const {
+        available.save(out);
+        out.write_vector(sizes);
+        out.write_vector(mtimes);
+    }
+
+    template <typename Reader>
+    static ImageAvailability load(Reader& in) {
+        ImageAvailability a;
+        // Copied, so the bitmap never refers into a mapped snapshot
+        Bitmap mapped = Bitmap::load(in);
+        a.available = mapped;
+        in.read_vector(a.sizes);
+        in.read_vector(a.mtimes);
+        if (a.mtimes.size() != a.sizes.size()) throw std::runtime_error("snapshot image availability is corrupt");
+        return a;
+    }
+};
+
+// Scan n rows with stat_row(i, size, mtime), which returns whether row i's
+// image exists; threads stat calls run at once (0 for the OpenMP default)
+template <typename StatRow>
+ImageAvailability scan_image_availability(size_t n, StatRow&& stat_row, int threads = 0) {
+    ImageAvailability result;
+    result.sizes.assign(n, 0);
+    result.mtimes.assign(n, -1);
+    std::vector<uint64_t> words((n + 63) / 64, 0);
+#ifdef _OPENMP
+    if (threads <= 0) threads = omp_get_max_threads();
+#endif
+    // One bitset word per iteration, so no two threads write the same word
+    const int64_t word_count = static_cast<int64_t>(words.size());
+    #pragma omp parallel for schedule(dynamic, 16) num_threads(threads)
+    for (int64_t w = 0; w < word_count; ++w) {
+        uint64_t word = 0;
+        size_t first = static_cast<size_t>(w) * 64;
+        size_t last = std::min(first + 64, n);
+        for (size_t i = first; i < last; ++i) {
+            if (stat_row(i, result.sizes[i], result.mtimes[i])) word |= uint64_t(1) << (i - first);
+        }
+        words[static_cast<size_t>(w)] = word;
+    }
+    result.available = Bitmap::from_words(words.data(), words.size());
+    return result;
+}
+
+// Runs task every interval on its own thread until destroyed; with run_now
+// also once right away
+class PeriodicTask {
+public:
+    PeriodicTask(std::chrono::seconds interval, std::function<void()> task, bool run_now = false) {
+        if (interval.count() <= 0) return;
+        thread_ = std::thread([this, interval, run_now, task = std::move(task)] {
+            if (run_now) task();
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!stop_.wait_for(lock, interval, [this] { return stopping_; })) {
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        });
+    }
+
+    PeriodicTask(const PeriodicTask&) = delete;
+    PeriodicTask& operator=(const PeriodicTask&) = delete;
+
+    ~PeriodicTask() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        stop_.notify_all();
+        if (thread_.joinable()) thread_.join();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable stop_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
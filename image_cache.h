@@ -0,0 +1,191 @@
+#pragma once
+// Byte-bounded cache of image files read from the image directory, shared by
+// every request thread. Keys are spread over independently locked shards, and
+// each shard evicts with CLOCK: a hit only sets the entry's reference bit
+// under a shared lock, and the eviction hand gives referenced entries a second
+// chance, so popular images stay while a scan of one-off images cycles through
+// the rest. Entries record the dataset generation they were read for; once the
+// data reloads, older entries count as misses and are replaced. Entries also
+// keep the size and modification time of the file they were read from, so the
+// caller can drop one the image rescan found replaced or removed.
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// One image file with the validators it was served with
+struct CachedImage {
+    std::string bytes;
+    std::string etag;
+    std::time_t modified = 0; // Of the file when it was read; bytes.size() is its size
+};
+
+struct ImageCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t max_bytes = 0;
+};
+
+class ImageCache {
+public:
+    static constexpr size_t shard_count = 16;
+
+    explicit ImageCache(size_t max_bytes) : max_bytes_(max_bytes) {
+        for (auto& shard : shards_) shard.max_bytes = max_bytes / shard_count;
+    }
+
+    std::shared_ptr<const CachedImage> get(const std::string& key, uint64_t generation) {
+        Shard& shard = shard_of(key);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end() || shard.slots[it->second].generation != generation) {
+            shard.misses.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        Slot& slot = shard.slots[it->second];
+        slot.referenced.store(true, std::memory_order_relaxed);
+        shard.hits.fetch_add(1, std::memory_order_relaxed);
+        return slot.image;
+    }
+
+    // Like get(), without counting a lookup or marking the entry referenced
+    std::shared_ptr<const CachedImage> peek(const std::string& key, uint64_t generation) {
+        Shard& shard = shard_of(key);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end() || shard.slots[it->second].generation != generation) return nullptr;
+        return shard.slots[it->second].image;
+    }
+
+    // Drop key's entry if it still holds image
+    void erase(const std::string& key, const std::shared_ptr<const CachedImage>& image) {
+        Shard& shard = shard_of(key);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end() && shard.slots[it->second].image == image) shard.erase(it->second);
+    }
+
+    // Images larger than a shard's share of the cache are not stored
+    void put(const std::string& key, uint64_t generation, std::shared_ptr<const CachedImage> image) {
+        size_t bytes = entry_bytes(key, *image);
+        Shard& shard = shard_of(key);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) shard.erase(it->second);
+        if (bytes > shard.max_bytes) return;
+        while (shard.bytes + bytes > shard.max_bytes) {
+            shard.evict();
+            shard.evictions++;
+        }
+        size_t i;
+        if (!shard.free.empty()) {
+            i = shard.free.back();
+            shard.free.pop_back();
+        } else {
+            i = shard.slots.size();
+            shard.slots.emplace_back();
+        }
+        Slot& slot = shard.slots[i];
+        slot.key = key;
+        slot.generation = generation;
+        slot.image = std::move(image);
+        slot.bytes = bytes;
+        // New entries start unreferenced: an image requested once is the next to go
+        slot.referenced.store(false, std::memory_order_relaxed);
+        shard.index[key] = i;
+        shard.bytes += bytes;
+    }
+
+    void clear() {
+        for (auto& shard : shards_) {
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            shard.slots.clear();
+            shard.free.clear();
+            shard.index.clear();
+            shard.bytes = 0;
+            shard.hand = 0;
+        }
+    }
+
+    ImageCacheStats stats() {
+        ImageCacheStats stats;
+        stats.max_bytes = max_bytes_;
+        for (auto& shard : shards_) {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            stats.hits += shard.hits.load(std::memory_order_relaxed);
+            stats.misses += shard.misses.load(std::memory_order_relaxed);
+            stats.evictions += shard.evictions;
+            stats.entries += shard.index.size();
+            stats.bytes += shard.bytes;
+        }
+        return stats;
+    }
+
+private:
+    struct Slot {
+        std::string key; // Empty when the slot is free
+        uint64_t generation = 0;
+        std::shared_ptr<const CachedImage> image;
+        size_t bytes = 0;
+        std::atomic<bool> referenced{false};
+    };
+
+    struct Shard {
+        std::shared_mutex mutex;
+        std::deque<Slot> slots; // Deque: slots never move, the clock hand walks them in order
+        std::vector<size_t> free;
+        std::unordered_map<std::string, size_t> index;
+        size_t hand = 0;
+        size_t bytes = 0;
+        size_t max_bytes = 0;
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+        uint64_t evictions = 0;
+
+        void erase(size_t i) {
+            Slot& slot = slots[i];
+            bytes -= slot.bytes;
+            index.erase(slot.key);
+            slot.key.clear();
+            slot.image.reset();
+            slot.bytes = 0;
+            free.push_back(i);
+        }
+
+        // Advance the hand to the first unreferenced entry, clearing reference bits on the way
+        void evict() {
+            for (;;) {
+                if (hand >= slots.size()) hand = 0;
+                Slot& slot = slots[hand];
+                size_t i = hand++;
+                if (slot.key.empty()) continue;
+                if (slot.referenced.exchange(false, std::memory_order_relaxed)) continue;
+                erase(i);
+                return;
+            }
+        }
+    };
+
+    static size_t entry_bytes(const std::string& key, const CachedImage& image) {
+        // Key stored twice (slot and map) plus node overhead
+        return 2 * key.size() + image.etag.size() + sizeof(Slot) + sizeof(CachedImage) + 64 + image.bytes.size();
+    }
+
+    Shard& shard_of(const std::string& key) {
+        return shards_[std::hash<std::string>{}(key) % shard_count];
+    }
+
+    size_t max_bytes_;
+    std::array<Shard, shard_count> shards_;
+};
@@ -0,0 +1,96 @@
+#pragma once
+// LRU cache of rendered /image_info tooltips keyed by image filename, so a
+// hover over the same thumbnails again is answered without formatting the
+// tags again. Like the query cache, entries record the dataset generation
+// they were rendered for and count as misses once the data reloads. Within a
+// generation only ingesting changes tags, and it invalidates just the images
+// it re-ingested; a tooltip rendered from a dataset older than the last
+// invalidation is not stored, as it may predate the ingest.
+#include <algorithm>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct RenderedImageInfo {
+    std::string html;
+    std::string etag;
+};
+
+struct ImageInfoCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    size_t entries = 0;
+    size_t capacity = 0;
+};
+
+class ImageInfoCache {
+public:
+    // A capacity of 0 disables the cache
+    explicit ImageInfoCache(size_t capacity) : capacity_(capacity) {}
+
+    std::shared_ptr<const RenderedImageInfo> get(const std::string& filename, uint64_t generation) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(filename);
+        if (it == index_.end() || it->second->generation != generation) {
+            if (it != index_.end()) erase(it->second);
+            ++misses_;
+            return nullptr;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second);
+        ++hits_;
+        return it->second->info;
+    }
+
+    // rendered_at is the live generation of the dataset the tooltip was rendered from
+    void put(const std::string& filename, uint64_t generation, uint64_t rendered_at,
+        std::shared_ptr<const RenderedImageInfo> info) {
+        if (capacity_ == 0) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (rendered_at < invalidated_at_) return;
+        auto it = index_.find(filename);
+        if (it != index_.end()) erase(it->second);
+        lru_.push_front(Entry{filename, generation, std::move(info)});
+        index_[filename] = lru_.begin();
+        while (lru_.size() > capacity_) erase(std::prev(lru_.end()));
+    }
+
+    // Drop the tooltips of filenames, whose tags changed in the dataset of live generation changed_at
+    void invalidate(const std::vector<std::string>& filenames, uint64_t changed_at) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        invalidated_at_ = std::max(invalidated_at_, changed_at);
+        for (const auto& filename : filenames) {
+            auto it = index_.find(filename);
+            if (it != index_.end()) erase(it->second);
+        }
+    }
+
+    ImageInfoCacheStats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return {hits_, misses_, lru_.size(), capacity_};
+    }
+
+private:
+    struct Entry {
+        std::string filename;
+        uint64_t generation;
+        std::shared_ptr<const RenderedImageInfo> info;
+    };
+
+    void erase(std::list<Entry>::iterator entry) {
+        index_.erase(entry->filename);
+        lru_.erase(entry);
+    }
+
+    size_t capacity_;
+    std::mutex mutex_;
+    std::list<Entry> lru_; // Most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+    uint64_t invalidated_at_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
@@ -0,0 +1,77 @@
+#pragma once
+// Pack file holding the webp images (see pack_file.h for the container), so
+// /img serves a slice of one mapped file instead of opening, copying and
+// closing a file per request. Blobs are the image files byte for byte; each
+// index entry's value is the checksum64() of the image.
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <sys/stat.h>
+
+#include "checksum.h"
+#include "pack_file.h"
+
+inline constexpr PackFormat image_pack_format{"image pack", {'I', 'M', 'G', 'P', 'A', 'C', 'K', '\0'}, {'I', 'M', 'G', 'P', 'A', 'C', 'K', 'E'}, 2};
+
+// Bytes of one image inside the mapped pack
+struct PackedImage {
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+    uint64_t hash = 0;
+
+    explicit operator bool() const { return data != nullptr; }
+};
+
+class ImagePack {
+public:
+    // Prints why an existing file cannot be used; false as well when it is missing
+    bool open(const std::string& path) {
+        struct stat st;
+        modified_ = stat(path.c_str(), &st) == 0 ? st.st_mtime : 0;
+        return pack_.open(path, image_pack_format);
+    }
+
+    bool is_open() const { return pack_.is_open(); }
+
+    // Modification time of the pack when it was opened
+    std::time_t modified() const { return modified_; }
+
+    // Number of packed images
+    size_t size() const { return pack_.size(); }
+
+    // <cg_id>/image_<image>, empty when the image is not packed
+    template <typename Image>
+    PackedImage find(std::string_view cg_id, const Image& image) const {
+        size_t i = pack_.find(cg_id, image);
+        if (i == PackReader::npos) return {};
+        PackBlob blob = pack_.blob(i);
+        return {blob.data, blob.size, pack_.value(i)};
+    }
+
+    // Start reading an image of this pack from storage in the background
+    void prefetch(const PackedImage& image) const { pack_.file().will_need(image.data, image.size); }
+
+private:
+    PackReader pack_;
+    std::time_t modified_ = 0;
+};
+
+// Adds images to a new or existing image pack, see PackWriter
+class ImagePackWriter {
+public:
+    explicit ImagePackWriter(const std::string& path) : pack_(path, image_pack_format) {}
+
+    // False when the image is already packed with exactly these bytes
+    bool add(const std::string& cg_id, uint32_t image, const std::string& bytes) {
+        if (pack_.unchanged(cg_id, image, bytes.data(), bytes.size())) return false;
+        pack_.add(cg_id, image, bytes.data(), bytes.size(), checksum64(bytes.data(), bytes.size()));
+        return true;
+    }
+
+    void commit() { pack_.commit(true); }
+
+    size_t size() const { return pack_.size(); }
+
+private:
+    PackWriter pack_;
+};
@@ -1,15 +1,41 @@
 // #define CPPHTTPLIB_OPENSSL_SUPPORT
 #include <fstream>
-#include <map>
 #include <sstream>
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
 #include <filesystem>
-#include <fm/matrix_io.h>
+#include <mutex>
+#include <unordered_map>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "httplib.h"
+#include "cg_table.h"
+#include "csv.h"
+#include "dataset.h"
+#include "http_cache.h"
+#include "image_availability.h"
+#include "image_cache.h"
+#include "image_info_cache.h"
+#include "image_pack.h"
 #include "nlohmann/json.hpp"
+#include "prefetcher.h"
+#include "query.h"
+#include "query_cache.h"
+#include "query_planner.h"
+#include "residency.h"
+#include "search_results.h"
+#include "signal_trigger.h"
+#include "snapshot.h"
+#include "tag_dictionary.h"
+#include "tag_index.h"
+#include "tag_loader.h"
+#include "tag_pack.h"
+#include "tag_watcher.h"
 
 using json = nlohmann::json;
 namespace fs = std::filesystem;
@@ -17,13 +43,48 @@ namespace fs = std::filesystem;
 const std::string image_dir = "/mnt/shared/data/webp";
 const std::string tag_dir = "/mnt/shared/data/img2tags_json";
 const std::string tag_file = "/mnt/shared/data/all_tags_ja.csv"; // Tag file path
+const std::string selected_tags_file = "/mnt/shared/data/selected_tags.csv"; // Tagger vocabulary with categories
 const std::string cg_list_file = "/mnt/shared/data/cglist_250722.csv"; // CG list file path
+const std::string tag_statistics_file = "/mnt/shared/data/tag_statistics_250807.csv"; // Per-tag image counts for query planning
+const std::string image_cache_control = "public, max-age=31536000, immutable"; // Image URLs always name the same image
+const std::string image_pack_file = "/mnt/shared/data/webp.pack"; // Packed images (pack_tool images), served before image_dir when present
+const std::string tag_pack_file = "/mnt/shared/data/img2tags.pack"; // Packed tag data (tag_pack tool), used instead of tag_dir when present
+const std::string snapshot_file = "/mnt/shared/data/tag_snapshot.bin"; // Binary copy of the cached data for fast restarts
 const int page_size = 20;
 const bool cache_cg_info = true; // Whether to cache CG info
-Matrix<std::string, 2> cached_cg_list;
-Matrix<json, 1> cached_tags;
+const bool use_tag_index = true; // Whether cached searches use the inverted index instead of scanning every image
+const bool use_snapshot = true; // Whether cached data is loaded from and saved to snapshot_file
+const bool out_of_core = false; // Whether the tag store and index are served from mapped segment files instead of the heap
+const std::string segment_dir = "/var/tmp"; // Where out-of-core mode writes built and compacted segments; keep it on a local disk
+constexpr size_t pinned_postings_bytes = size_t(512) << 20; // Postings of the most queried tags locked in memory in out-of-core mode
+constexpr std::chrono::seconds residency_interval{30}; // How often out-of-core mode picks the postings to keep in memory
+const int tag_loader_threads = 32; // Threads reading tag JSON at startup; file reads mostly wait on I/O
 constexpr size_t max_image_count = 10000; // Maximum number of images
-std::map<std::string, std::string> tag_translation_map;
+constexpr size_t search_result_capacity = 256; // Recent search results kept for cursors
+SearchResultStore search_results(search_result_capacity);
+constexpr size_t query_cache_bytes = size_t(64) << 20; // Memory for cached search results
+QueryCache query_cache(query_cache_bytes);
+constexpr size_t image_cache_bytes = size_t(2) << 30; // Memory for images read from image_dir
+ImageCache image_cache(image_cache_bytes);
+const int prefetch_threads = 4; // Threads reading the next images of a search ahead of the client
+constexpr size_t prefetch_queue_capacity = 4 * page_size; // Queued image paths; the oldest are dropped
+constexpr size_t image_info_cache_capacity = 4096; // Rendered /image_info tooltips kept, 0 to disable
+ImageInfoCache image_info_cache(image_info_cache_capacity);
+constexpr size_t max_image_info_batch = 100; // Filenames per /image_info/batch request
+const int image_scan_threads = 64; // Concurrent stat calls while checking which images exist
+constexpr std::chrono::seconds image_rescan_interval{600}; // How often image_dir is checked again, 0 to never
+constexpr std::chrono::milliseconds tag_watch_interval{1000}; // New tag files in tag_dir are ingested in batches this far apart, 0 to not watch
+constexpr size_t max_ingest_batch = 1000; // Images per POST /ingest request
+constexpr std::chrono::seconds compaction_interval{300}; // How often ingested images are folded into the base segment, 0 to never
+constexpr double compaction_cpu_share = 0.25; // Share of one core a compaction may use
+std::shared_ptr<const Dataset> dataset; // Tag dictionary, packs, CG list, tags, index, ingested images and image availability; use std::atomic_load/store
+std::mutex dataset_mutex; // Held while a changed Dataset is built from the current one and published
+std::mutex reload_mutex; // Held by a reload, and while ingesting, so no tags are parsed with a dictionary being replaced
+std::atomic<bool> reloading{false}; // Set while a reload runs; further ones are refused meanwhile
+std::shared_ptr<const BaseSegment> pinned_base; // Base whose postings pinned_postings holds; only used by update_residency
+PinnedPages pinned_postings;
+std::atomic<size_t> pinned_bytes{0};
+std::atomic<size_t> pinned_tags{0};
 
 json load_json(const std::string& file_path) {
     std::ifstream ifs(file_path);
@@ -37,53 +98,536 @@ json load_json(const std::string& file_path) {
     return j;
 }
 
-Matrix<json, 1> load_tags(const Matrix<std::string, 2>& cglist) {
-    Matrix<json, 1> tags_list(cglist.extent(0));
-    for (size_t i = 0; i < cglist.extent(0); ++i) {
-        if (i % 50000 == 0) {
-            std::cout << "Tag loading progress: " << (i * 100.0 / cglist.extent(0)) << "%" << std::endl;
+// Same shape as a tag JSON file: {"tags": {"<category>": {"<tag>": score}}}
+json pack_record_json(const TagPack& pack, TagPackRecord record) {
+    json tags = json::object();
+    json* group = nullptr;
+    bool ok = pack.decode(record,
+        [&](uint32_t key) { group = &(tags[std::string(pack.string(key))] = json::object()); },
+        [&](uint32_t name, float score) { (*group)[std::string(pack.string(name))] = score; });
+    if (!ok) {
+        std::cerr << "Invalid tag pack record" << std::endl;
+        return json();
+    }
+    json j;
+    j["tags"] = std::move(tags);
+    return j;
+}
+
+// Load the tags of every CG list row, handing them to append(part) in row order
+template <typename Append>
+void load_tags(const CgTable& cglist, const TagDictionary& dictionary, const TagPack& tag_pack, Append&& append) {
+    if (tag_pack.is_open()) {
+        auto key_of = [&](size_t i) {
+            return std::pair<std::string_view, uint32_t>(cglist.cg_id(cglist.row_cg(i)), cglist.row_image(i));
+        };
+        load_tag_pack(tag_pack, cglist.size(), key_of, dictionary, tag_loader_threads, append);
+        return;
+    }
+    auto tag_path = [&](size_t i) { return tag_dir + "/" + cglist.image_path(i, ".json"); };
+    load_tag_files(cglist.size(), tag_path, dictionary, tag_loader_threads, append);
+}
+
+TagStore load_tags(const CgTable& cglist, const TagDictionary& dictionary, const TagPack& tag_pack) {
+    TagStore store;
+    load_tags(cglist, dictionary, tag_pack, [&](const TagStore& part) { store.append(part); });
+    store.shrink_to_fit();
+    return store;
+}
+
+// Read the title (column 1), CG id (column 4) and image number (column 5) of
+// every CG list row; the other columns are skipped while parsing
+bool load_cg_table(const std::string& path, CgTable& table) {
+    table = CgTable();
+    size_t skipped = 0;
+    bool ok = read_csv(path, [&](const std::vector<std::string>& row) {
+        if (row.size() < 6) {
+            skipped++;
+            return;
         }
-        const auto& row = cglist[i];
-        std::string tag_path = tag_dir + "/" + row[4] + "/image_" + row[5] + ".json";
-        if (!fs::exists(tag_path)) {
+        table.add_row(row[4], row[5], row[1]);
+    });
+    table.finish();
+    if (skipped > 0) {
+        std::cerr << "Warning: Skipped " << skipped << " CG list rows without a CG id and image column." << std::endl;
+    }
+    return ok;
+}
+
+// Split "<cg_id>/image_<n>.<ext>" into the CG id and n; false for other names
+bool split_image_name(const std::string& filename, std::string& cg_id, std::string& number) {
+    size_t slash = filename.find_first_of('/');
+    size_t dot = filename.find_last_of('.');
+    const std::string prefix = "image_";
+    if (slash == std::string::npos || dot == std::string::npos || dot < slash + 1 + prefix.size() ||
+        filename.compare(slash + 1, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    cg_id = filename.substr(0, slash);
+    number = filename.substr(slash + 1 + prefix.size(), dot - slash - 1 - prefix.size());
+    return true;
+}
+
+// Packed image of "<cg_id>/image_<n>.webp", empty when there is no pack or it lacks the image
+PackedImage find_packed_image(const ImagePack& image_pack, const std::string& filename) {
+    std::string cg_id, number;
+    if (!image_pack.is_open() || !split_image_name(filename, cg_id, number)) return PackedImage();
+    return image_pack.find(cg_id, number);
+}
+
+// Whether "<cg_id>/image_<n>.webp" can be served: from the image pack, or
+// from image_dir for images not packed yet
+bool image_exists(const ImagePack& image_pack, const std::string& filename) {
+    return find_packed_image(image_pack, filename) || fs::exists(image_dir + "/" + filename);
+}
+
+// Read "<cg_id>/image_<n>.webp" from image_dir into image_cache; nullptr when it cannot be read
+std::shared_ptr<const CachedImage> load_image_file(const std::string& filename, uint64_t generation) {
+    std::string path = image_dir + "/" + filename;
+    struct stat st;
+    std::ifstream file(path, std::ios::binary);
+    if (stat(path.c_str(), &st) != 0 || !file) {
+        return nullptr;
+    }
+    auto image = std::make_shared<CachedImage>();
+    std::ostringstream bytes;
+    bytes << file.rdbuf();
+    image->bytes = bytes.str();
+    image->etag = quoted_etag(static_cast<uint64_t>(st.st_ino), static_cast<uint64_t>(st.st_mtime),
+        static_cast<uint64_t>(st.st_size));
+    image->modified = st.st_mtime;
+    image_cache.put(filename, generation, image);
+    return image;
+}
+
+// Live row of "<cg_id>/image_<n>.webp" in set, or -1
+int64_t find_image_row(const std::string& filename, const Dataset& set) {
+    std::string cg_id, number;
+    uint32_t image;
+    if (!split_image_name(filename, cg_id, number)) return -1;
+    // Ingested images are always numbered canonically, CG list rows may not be
+    if (!parse_canonical_image_number(number, image)) return set.find_base_row(cg_id, number);
+    return set.find_row(cg_id, image);
+}
+
+// Whether image, cached from "<cg_id>/image_<n>.webp", still is what the last
+// image scan found on disk; images the scan does not cover are taken as they are
+bool image_is_current(const std::string& filename, const CachedImage& image, const Dataset& set) {
+    const ImageAvailability& availability = *set.availability;
+    int64_t row = cache_cg_info ? find_image_row(filename, set) : -1;
+    if (row < 0 || static_cast<size_t>(row) >= availability.size()) return true;
+    return availability.available.contains(static_cast<uint32_t>(row)) && availability.sizes[row] == image.bytes.size() &&
+           availability.mtimes[row] == static_cast<int64_t>(image.modified);
+}
+
+// Cached copy of an image from image_dir; nullptr when it is not cached, or
+// when the image rescan found the file replaced or removed since it was read,
+// in which case the stale copy is dropped
+std::shared_ptr<const CachedImage> cached_image(const std::string& filename, const Dataset& set, bool count_lookup) {
+    std::shared_ptr<const CachedImage> image =
+        count_lookup ? image_cache.get(filename, set.generation) : image_cache.peek(filename, set.generation);
+    if (!image || image_is_current(filename, *image, set)) return image;
+    image_cache.erase(filename, image);
+    return nullptr;
+}
+
+// Bring an image the client is about to request into memory: readahead of its
+// part of the pack, or a read into image_cache
+void prefetch_image(const std::string& filename) {
+    std::shared_ptr<const Dataset> set = std::atomic_load(&dataset);
+    if (PackedImage image = find_packed_image(*set->image_pack, filename)) {
+        set->image_pack->prefetch(image);
+        return;
+    }
+    if (!cached_image(filename, *set, false)) load_image_file(filename, set->generation);
+}
+
+// Whether "<cg_id>/image_<n>.webp" exists, with its size and modification
+// time: looked up in the image pack, else one stat of its file
+bool stat_image(const ImagePack& image_pack, const std::string& filename, uint64_t& size, int64_t& mtime) {
+    if (PackedImage packed = find_packed_image(image_pack, filename)) {
+        size = packed.size;
+        mtime = image_pack.modified();
+        return true;
+    }
+    struct stat st;
+    std::string path = image_dir + "/" + filename;
+    if (stat(path.c_str(), &st) != 0) return false;
+    size = static_cast<uint64_t>(st.st_size);
+    mtime = static_cast<int64_t>(st.st_mtime);
+    return true;
+}
+
+// Which rows of a CG list and of the delta following it have an image
+ImageAvailability scan_images(const ImagePack& image_pack, const CgTable& cglist, const DeltaSegment& delta) {
+    const size_t base_rows = cglist.size();
+    return scan_image_availability(base_rows + delta.size(), [&](size_t i, uint64_t& size, int64_t& mtime) {
+        std::string filename = i < base_rows ? cglist.image_path(static_cast<uint32_t>(i)) : delta.image_path(static_cast<uint32_t>(i));
+        return stat_image(image_pack, filename, size, mtime);
+    }, image_scan_threads);
+}
+
+// Make next, derived from the current dataset, the current one; dataset_mutex must be held
+void publish_dataset(Dataset next) {
+    next.version = std::atomic_load(&dataset)->version + 1;
+    std::atomic_store(&dataset, std::shared_ptr<const Dataset>(std::make_shared<Dataset>(std::move(next))));
+}
+
+// Scan image_dir again and publish the result if any image appeared, disappeared
+// or changed. Packed images only cost a lookup in the mapped pack, which does
+// not change; the rows it lacks are stat-ed, so images added to image_dir
+// after packing, such as ingested ones, are found.
+void rescan_images() {
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<const Dataset> scanned_set = std::atomic_load(&dataset);
+    auto scanned = std::make_shared<ImageAvailability>(
+        scan_images(*scanned_set->image_pack, *scanned_set->base->cg_table, *scanned_set->delta));
+    std::lock_guard<std::mutex> lock(dataset_mutex);
+    std::shared_ptr<const Dataset> current = std::atomic_load(&dataset);
+    if (current->base != scanned_set->base) return; // Compacted or reloaded meanwhile, the next rescan sees the new rows
+    // Delta rows ingested since the last scan were only checked at ingest
+    size_t changed = scanned->changes(*current->availability);
+    for (size_t row = current->availability->size(); row < scanned->size(); ++row) {
+        auto [chunk, i] = current->delta->locate(static_cast<uint32_t>(row));
+        changed += scanned->available.contains(static_cast<uint32_t>(row)) != static_cast<bool>(chunk->available[i]);
+    }
+    if (changed == 0) return;
+    scanned->version = current->availability->version + 1;
+    size_t available = scanned->available.cardinality();
+    Dataset next = *current;
+    next.availability = std::move(scanned);
+    publish_dataset(std::move(next));
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Image rescan found " << changed << " changed images, " << available << " available (" << ms << " ms)." << std::endl;
+}
+
+// New tags of an image, or its removal, while the server runs
+struct IngestRecord {
+    std::string filename; // "<cg_id>/image_<n>.webp"
+    std::string title;    // Used while the CG list has no title for the CG
+    std::vector<TagEntry> entries; // In TagDictionary::entry_before order
+    std::vector<uint8_t> categories;
+    bool removed = false; // The image is gone; entries are ignored
+};
+
+struct IngestCounts {
+    size_t ingested = 0; // Images added or re-tagged
+    size_t removed = 0;
+};
+
+// Publish records as one new delta chunk. A new image is appended; a re-tagged
+// one is appended again and its old row gets a tombstone, as does the row of a
+// removed one. Records repeating an image's current tags change nothing; when
+// a batch names an image twice, the later record wins. The tag ids of records
+// must come from the current dictionary, so callers hold reload_mutex from
+// parsing them until here.
+IngestCounts ingest_images(const std::vector<IngestRecord>& records) {
+    // Images are looked up before taking the lock, so slow storage holds up
+    // no other writer; the pack cannot change while reload_mutex is held
+    std::vector<char> exists(records.size());
+    std::shared_ptr<const ImagePack> image_pack = std::atomic_load(&dataset)->image_pack;
+    for (size_t k = 0; k < records.size(); ++k) {
+        exists[k] = !records[k].removed && image_exists(*image_pack, records[k].filename);
+    }
+
+    std::lock_guard<std::mutex> lock(dataset_mutex);
+    std::shared_ptr<const Dataset> set = std::atomic_load(&dataset);
+    const uint32_t first_row = static_cast<uint32_t>(set->delta->base_rows() + set->delta->size());
+    DeltaChunk chunk;
+    std::vector<uint32_t> removed;
+    std::unordered_map<std::string, int64_t> batch_rows; // "<cg_id>/<n>" -> row this batch left it at, -1 when removed
+    std::vector<std::string> changed; // Images whose tooltip is stale once published
+    IngestCounts counts;
+    for (size_t k = 0; k < records.size(); ++k) {
+        const IngestRecord& record = records[k];
+        std::string cg_id, number;
+        uint32_t image;
+        if (!split_image_name(record.filename, cg_id, number) || !parse_canonical_image_number(number, image)) {
+            std::cerr << "Warning: Not ingesting " << record.filename << ": not an image name." << std::endl;
             continue;
         }
-        tags_list(i) = load_json(tag_path);
+        std::string key = cg_id + "/" + number;
+        auto earlier = batch_rows.find(key);
+        int64_t row = earlier != batch_rows.end() ? earlier->second : set->find_row(cg_id, image);
+        if (record.removed) {
+            if (row < 0) continue;
+            removed.push_back(static_cast<uint32_t>(row));
+            batch_rows[key] = -1;
+            changed.push_back(record.filename);
+            counts.removed++;
+            continue;
+        }
+        if (row >= 0) {
+            TagStore tags;
+            tags.add_image(record.entries, record.categories);
+            auto [store, i] = row < first_row ? set->tags_of(static_cast<uint32_t>(row))
+                                              : std::make_pair(&chunk.tags, static_cast<uint32_t>(row - first_row));
+            if (store->same_tags(i, tags, 0)) continue;
+            removed.push_back(static_cast<uint32_t>(row));
+        }
+        batch_rows[key] = first_row + chunk.size();
+        chunk.add(cg_id, image, record.title, exists[k], record.entries, record.categories);
+        changed.push_back(record.filename);
+        counts.ingested++;
     }
-    return tags_list;
+    if (chunk.size() == 0 && removed.empty()) return counts;
+    Dataset next = *set;
+    next.delta = set->delta->with(std::move(chunk), std::move(removed));
+    std::cout << "Ingested " << counts.ingested << " images and removed " << counts.removed << ", " << next.delta->size()
+        << " ingested since the last compaction." << std::endl;
+    publish_dataset(std::move(next));
+    image_info_cache.invalidate(changed, std::atomic_load(&dataset)->live_generation());
+    return counts;
 }
 
-// Load tag list, returns Nx2 matrix, first column is English tag, second column is Japanese tag
-Matrix<std::string, 2> load_tags_translation(const std::string& filepath) {
-    Matrix<std::string, 2> tags;
-    std::ifstream fin(filepath);
-    if (!fin) {
-        std::cerr << "Error: Unable to open tag file." << std::endl;
-        return tags;
+// Ingest tag files "<cg_id>/image_<n>.json" of tag_dir; a file that no longer exists removes its image
+void ingest_tag_files(const std::vector<std::string>& files) {
+    std::lock_guard<std::mutex> reload_lock(reload_mutex);
+    TagJsonHandler handler(*std::atomic_load(&dataset)->dictionary);
+    std::string buffer;
+    std::vector<IngestRecord> records;
+    for (const auto& file : files) {
+        std::string path = tag_dir + "/" + file;
+        std::string filename = file.substr(0, file.find_last_of('.')) + ".webp";
+        handler.reset();
+        if (!read_whole_file(path, buffer)) {
+            std::error_code ec;
+            if (!fs::exists(path, ec) && !ec) records.push_back({filename, "", {}, {}, true});
+            continue;
+        }
+        if (!json::sax_parse(buffer.begin(), buffer.end(), &handler)) {
+            std::cerr << "Warning: Unable to read tag file " << path << std::endl;
+            continue;
+        }
+        records.push_back({filename, "", handler.entries(), handler.categories()});
     }
-    fin >> tags;
-    return tags;
+    ingest_images(records);
 }
 
-std::map<std::string, std::string> load_id_title_map(const std::string& filepath) {
-    Matrix<std::string, 2> cg_list;
-    std::map<std::string, std::string> id_title_map;
-    std::ifstream fin(filepath);
-    if (!fin) {
-        std::cerr << "Error: Unable to open CG list file." << std::endl;
-        return {};
-    }
-    fin >> cg_list;
-    for (size_t i = 0; i < cg_list.extent(0); ++i) {
-        std::string id = cg_list(i, 4);
-        std::string title = cg_list(i, 1);
-        if (!id.empty() && !title.empty()) {
-            if (id_title_map.find(id) == id_title_map.end()) {
-                id_title_map[id] = title;
-            }
+// Out-of-core mode: a new segment file name in segment_dir
+std::string new_segment_path() {
+    static std::atomic<uint64_t> segment_count{0};
+    return segment_dir + "/tag_segment_" + std::to_string(getpid()) + "_" + std::to_string(++segment_count) + ".bin";
+}
+
+// Out-of-core mode: write the tags and index streamed to segment (postings
+// placed by queries) to its segment file and serve them from its mapping,
+// without cg_table. The file is unlinked right away, so it disappears once the
+// base is freed. Throws std::runtime_error on failure.
+template <typename Pace>
+std::shared_ptr<BaseSegment> map_tag_segment(TagSegmentWriter& segment, const std::vector<uint64_t>& queries, Pace&& pace) {
+    const std::string& path = segment.path();
+    auto mapped = std::make_shared<BaseSegment>();
+    std::error_code ec;
+    try {
+        SnapshotWriter out(path, {});
+        segment.write(out, queries, pace);
+        out.commit();
+        SnapshotReader in;
+        // Just written by this process, so nothing to verify
+        std::string problem = in.open(path, {}, true, false);
+        fs::remove(path, ec);
+        if (!problem.empty()) throw std::runtime_error(problem);
+        mapped->tags = TagStore::load(in);
+        mapped->index = in.read_pod<uint8_t>() != 0 ? TagIndex::load(in) : TagIndex();
+        in.finish();
+        mapped->mapping = in.mapping();
+        mapped->tags.for_each_column(advise_random);
+    } catch (...) {
+        fs::remove(path + ".tmp", ec);
+        fs::remove(path, ec);
+        throw;
+    }
+    return mapped;
+}
+
+// Out-of-core mode: load the tags of every CG list row into a new segment
+// writer instead of memory; nullptr when it cannot be written
+std::unique_ptr<TagSegmentWriter> stream_tags(const CgTable& cglist, const TagDictionary& dictionary, const TagPack& tag_pack) {
+    try {
+        auto segment = std::make_unique<TagSegmentWriter>(new_segment_path(), dictionary.size(), use_tag_index);
+        load_tags(cglist, dictionary, tag_pack, [&](const TagStore& part) { segment->append(part); });
+        return segment;
+    } catch (const std::exception& e) {
+        std::cerr << "Warning: Unable to write a segment file to " << segment_dir << ", keeping the tags in memory: " << e.what() << std::endl;
+        return nullptr;
+    }
+}
+
+// Fold the images ingested so far into a new base segment. Ingesting goes on
+// meanwhile; what arrives after the compaction started is carried over into
+// the new, otherwise empty delta. A reload meanwhile discards the result.
+void compact() {
+    std::shared_ptr<const Dataset> start = std::atomic_load(&dataset);
+    if (start->delta->size() == 0 && start->delta->deleted().empty()) return;
+    auto started = std::chrono::steady_clock::now();
+    lower_thread_priority();
+    Throttle throttle(compaction_cpu_share);
+    auto stat = [&](const std::string& filename, uint64_t& size, int64_t& mtime) {
+        return stat_image(*start->image_pack, filename, size, mtime);
+    };
+    Compaction compacted;
+    if (out_of_core) {
+        try {
+            TagSegmentWriter segment(new_segment_path(), start->dictionary->size(), use_tag_index);
+            compacted = compact_segments(*start, start->dictionary->size(), use_tag_index, stat, throttle, &segment);
+            auto mapped = map_tag_segment(segment, start->heat->counts(), [&] { throttle.pace(); });
+            mapped->cg_table = std::move(compacted.base->cg_table);
+            compacted.base = std::move(mapped);
+        } catch (const std::exception& e) {
+            std::cerr << "Warning: Unable to write a segment file to " << segment_dir << ", compacting in memory: " << e.what() << std::endl;
+            compacted = Compaction();
+        }
+    }
+    if (!compacted.base) compacted = compact_segments(*start, start->dictionary->size(), use_tag_index, stat, throttle);
+
+    std::lock_guard<std::mutex> lock(dataset_mutex);
+    std::shared_ptr<const Dataset> current = std::atomic_load(&dataset);
+    if (current->generation != start->generation) return;
+    const uint32_t folded = static_cast<uint32_t>(compacted.remap.size());
+    const uint32_t base_rows = static_cast<uint32_t>(compacted.base->cg_table->size());
+    auto delta = std::make_shared<const DeltaSegment>(base_rows);
+    const auto& chunks = current->delta->chunks();
+    for (size_t k = start->delta->chunk_count(); k < chunks.size(); ++k) delta = delta->with(*chunks[k]);
+    std::vector<uint32_t> removed;
+    for (uint32_t row : (current->delta->deleted() - start->delta->deleted()).to_vector()) {
+        if (row >= folded) {
+            removed.push_back(base_rows + (row - folded));
+        } else if (compacted.remap[row] >= 0) {
+            removed.push_back(static_cast<uint32_t>(compacted.remap[row]));
         }
     }
-    return id_title_map;
+    if (!removed.empty()) delta = delta->with(DeltaChunk(), std::move(removed));
+    Dataset next = *current;
+    next.base = std::move(compacted.base);
+    next.compactions = current->compactions + 1;
+    next.delta = std::move(delta);
+    next.availability = remap_availability(*current->availability, compacted);
+    publish_dataset(std::move(next));
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+    std::cout << "Compacted " << start->delta->size() << " ingested images and " << start->delta->deleted().cardinality()
+        << " tombstones into " << base_rows << " rows (" << ms << " ms)." << std::endl;
+}
+
+// Out-of-core mode: lock the postings of the tags queried most since the last
+// pass in memory, up to pinned_postings_bytes, and read the other queried
+// tags' postings ahead
+void update_residency() {
+    std::shared_ptr<const Dataset> set = std::atomic_load(&dataset);
+    const TagIndex& index = set->base->index;
+    std::vector<uint64_t> queries = set->heat->decay();
+    if (set->base != pinned_base) {
+        // Rows were compacted or the data reloaded; unlock the old base's pages before it is freed
+        pinned_postings.update({});
+        pinned_base = set->base->mapping ? set->base : nullptr;
+    }
+    if (!pinned_base || index.tag_count() != queries.size()) return;
+
+    std::vector<uint32_t> queried;
+    for (uint32_t tag = 0; tag < queries.size(); ++tag) {
+        if (queries[tag] > 0) queried.push_back(tag);
+    }
+    std::stable_sort(queried.begin(), queried.end(), [&](uint32_t a, uint32_t b) { return queries[a] > queries[b]; });
+    std::vector<PinnedPages::Range> ranges;
+    size_t budget = pinned_postings_bytes;
+    size_t tags = 0;
+    for (uint32_t tag : queried) {
+        size_t bytes = index.postings_bytes(tag);
+        if (bytes > budget) {
+            index.for_each_column(tag, [&](const void* data, size_t n) {
+                pinned_base->mapping->will_need(static_cast<const unsigned char*>(data), n);
+            });
+            continue;
+        }
+        budget -= bytes;
+        tags++;
+        index.for_each_column(tag, [&](const void* data, size_t n) { ranges.emplace_back(data, n); });
+    }
+    pinned_bytes = pinned_postings.update(ranges);
+    pinned_tags = tags;
+}
+
+// Inputs of the cached data; a snapshot is only used while none of them
+// changed. Tags read from tag_dir are stamped by every CG directory: a tag file
+// written into a CG changes that directory's modification time, not tag_dir's.
+std::vector<SourceStamp> snapshot_sources() {
+    std::vector<SourceStamp> sources = {SourceStamp::of(selected_tags_file), SourceStamp::of(tag_file),
+        SourceStamp::of(tag_statistics_file), SourceStamp::of(cg_list_file), SourceStamp::of(tag_dir),
+        SourceStamp::of(tag_pack_file)};
+    std::error_code ec;
+    if (fs::exists(tag_pack_file, ec)) return sources;
+    std::vector<std::string> cg_dirs;
+    for (auto it = fs::directory_iterator(tag_dir, ec); !ec && it != fs::directory_iterator(); it.increment(ec)) {
+        std::error_code type_ec;
+        if (it->is_directory(type_ec)) cg_dirs.push_back(it->path().string());
+    }
+    std::sort(cg_dirs.begin(), cg_dirs.end());
+    for (const auto& dir : cg_dirs) sources.push_back(SourceStamp::of(dir));
+    return sources;
+}
+
+// Fill the tag dictionary, base and image availability from the snapshot;
+// false (leaving them untouched) when the snapshot is missing, stale or damaged
+bool load_snapshot(const std::string& path, const std::vector<SourceStamp>& sources, TagDictionary& tag_dictionary,
+                   BaseSegment& base, ImageAvailability& availability) {
+    auto start = std::chrono::steady_clock::now();
+    SnapshotReader in;
+    // Out of core, the tags and index stay in the mapped snapshot and only its small sections are verified
+    std::string problem = in.open(path, sources, out_of_core);
+    if (!problem.empty()) {
+        std::cout << "Not using snapshot: " << problem << "." << std::endl;
+        return false;
+    }
+    try {
+        TagDictionary dictionary = TagDictionary::load(in);
+        CgTable cglist = CgTable::load(in);
+        TagStore tags = TagStore::load(in);
+        bool has_index = in.read_pod<uint8_t>() != 0;
+        TagIndex index = has_index ? TagIndex::load(in) : TagIndex();
+        ImageAvailability images = ImageAvailability::load(in);
+        in.finish();
+        if (tags.image_count() != cglist.size()) throw std::runtime_error("snapshot tag store does not match the CG list");
+        if (images.size() != cglist.size()) throw std::runtime_error("snapshot image availability does not match the CG list");
+        tag_dictionary = std::move(dictionary);
+        availability = std::move(images);
+        base.cg_table = std::make_shared<const CgTable>(std::move(cglist));
+        base.tags = std::move(tags);
+        base.index = std::move(index);
+        if (out_of_core) {
+            base.mapping = in.mapping();
+            base.tags.for_each_column(advise_random);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: Unable to read snapshot " << path << ": " << e.what() << std::endl;
+        return false;
+    }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Loaded snapshot " << path << " in " << ms << " ms." << std::endl;
+    return true;
+}
+
+// sources are the stamps taken before the data was read, so a source changed
+// while loading leaves the snapshot stale instead of stamped with the change.
+// write_tags(out) writes the tag store, whether there is an index, and the index.
+template <typename WriteTags>
+void save_snapshot(const std::string& path, const std::vector<SourceStamp>& sources, const TagDictionary& tag_dictionary,
+                   const CgTable& cg_table, WriteTags&& write_tags, const ImageAvailability& availability) {
+    try {
+        SnapshotWriter out(path, sources);
+        tag_dictionary.save(out);
+        cg_table.save(out);
+        write_tags(out);
+        availability.save(out);
+        out.commit();
+        std::cout << "Saved snapshot " << path << "." << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: Unable to save snapshot: " << e.what() << std::endl;
+    }
+}
+
+// Whether req comes from this machine; requests that change the data must
+bool is_local_request(const httplib::Request& req) {
+    return req.remote_addr == "127.0.0.1" || req.remote_addr == "::1";
 }
 
 // Read entire file content into a string
@@ -97,13 +641,12 @@ std::string read_file(const std::string& filepath) {
 }
 
 // Filter tag list into JSON
-std::string filter_tags(const Matrix<std::string, 2>& all_tags, const std::string& keyword) {
+std::string filter_tags(const TagDictionary& dictionary, const std::string& keyword) {
     std::ostringstream oss;
     oss << "[";
     bool first = true;
-    for (size_t i = 0; i < all_tags.extent(0); ++i) {
-        // Get English tag
-        const auto& tag = all_tags(i, 0);
+    for (size_t i = 0; i < dictionary.size(); ++i) {
+        std::string_view tag = dictionary.name(static_cast<uint16_t>(i));
         if (tag.find(keyword) != std::string::npos) {
             if (!first) oss << ",";
             oss << "\"" << tag << "\"";
@@ -155,232 +698,143 @@ std::optional<float> get_tag_score(const json& j, const std::string& tag) {
     return std::nullopt; // Tag not found
 }
 
-std::pair<std::string, float> parse_tag_and_score(const std::string& input) {
-    size_t pos = input.rfind(':');
-    if (pos == std::string::npos) {
-        return {input, 0.0f};
+// Walk the tag pack, or the tag directory without one. The walk stops once
+// max_image_count images are collected, leaving count at max_image_count + 1,
+// unless only the count is wanted.
+SearchResult get_image_files_by_tags(const QueryNode& query, const TagPack& tag_pack, const ImagePack& image_pack, bool count_only) {
+    SearchResult result;
+    size_t processed = 0;
+    // False once the result is full
+    auto visit = [&](const json& image_tags, const std::string& relative_path) {
+        if (++processed % 50000 == 0) {
+            std::cout << "Processed file " << processed << std::endl;
+        }
+        bool match = matches_query(query, [&](const QueryNode& term) {
+            return get_tag_score(image_tags, term.tag);
+        });
+        // If matched, add the corresponding image filename when the image exists
+        if (!match || !image_exists(image_pack, relative_path)) {
+            return true;
+        }
+        result.count++;
+        if (count_only) return true;
+        if (result.paths.size() < max_image_count) {
+            result.paths.push_back(relative_path); // Only save image filename
+            return true;
+        }
+        return false; // Stop if max count reached
+    };
+
+    if (tag_pack.is_open()) {
+        for (size_t i = 0; i < tag_pack.size(); ++i) {
+            std::string relative_path = std::string(tag_pack.cg_id(i)) + "/image_" + std::to_string(tag_pack.image(i)) + ".webp";
+            if (!visit(pack_record_json(tag_pack, tag_pack.record(i)), relative_path)) break;
+        }
+        return result;
     }
+    for (const auto& entry : fs::recursive_directory_iterator(tag_dir)) {
+        if (entry.is_regular_file() && entry.path().extension() == ".json") {
+            fs::path relative_path = fs::relative(entry.path(), tag_dir);
+            relative_path.replace_extension(".webp");
+            if (!visit(load_json(entry.path().string()), relative_path.string())) break;
+        }
+    }
+    return result;
+}
 
-    std::string possible_score = input.substr(pos + 1);
-    char* endptr = nullptr;
-    float score = std::strtof(possible_score.c_str(), &endptr);
+// Count the tags a query reads the postings of, deciding what out-of-core mode keeps in memory
+void count_queried_tags(const QueryNode& node, TagHeat& heat) {
+    if (node.kind == QueryNode::Kind::Term && node.tag_id >= 0) heat.add(static_cast<uint32_t>(node.tag_id));
+    for (const auto& child : node.children) count_queried_tags(child, heat);
+}
 
-    if (endptr != nullptr && *endptr == '\0') {
-        std::string tag = input.substr(0, pos);
-        return {tag, score};
+// Matches are kept as a bitmap of base rows; paths are only built for the pages served
+CachedQuery get_image_files_by_tags(const QueryNode& query, const Dataset& set, bool use_index) {
+    const TagStore& cached_tags = set.base->tags;
+    assert(set.base->cg_table->size() == cached_tags.image_count() && cached_tags.image_count() == set.delta->base_rows());
+    auto score_of = [&](uint32_t i, const QueryNode& term) {
+        return term.tag_id < 0 ? std::nullopt : cached_tags.score(i, static_cast<uint16_t>(term.tag_id));
+    };
+
+    // Matches in CG list order, whether or not their image file exists
+    CachedQuery result;
+    if (use_index) {
+        result.matches = evaluate_query(query, set.base->index, score_of);
     } else {
-        return {input, 0.0f};
+        // No index to ask: verify the query against every cached image, across all cores
+        std::vector<uint32_t> found = parallel_filter(cached_tags.image_count(), [&](uint32_t i) {
+            if (!cached_tags.has_tags(i)) return false;
+            return matches_query(query, [&](const QueryNode& term) { return score_of(i, term); });
+        });
+        result.matches = Bitmap::from_sorted(found.data(), found.size());
     }
+    return result;
 }
 
-std::vector<std::string> extract_tags(const std::string &input) {
-    std::string s = input;
-    if (!s.empty() && s.front() == '[') s.erase(0, 1);
-    if (!s.empty() && s.back() == ']') s.pop_back();
+// Rows of set matching query whose image file exists: the base matches of
+// cached with set's image availability, tombstones and ingested images applied
+Bitmap live_matches(const CachedQuery& cached, const QueryNode& query, const Dataset& set) {
+    const ImageAvailability& availability = *set.availability;
+    const DeltaSegment& delta = *set.delta;
+    assert(delta.base_rows() <= availability.size());
+    Bitmap matches = cached.matches & availability.available;
+    // Re-tagged and removed images only count with their current tags
+    if (!delta.deleted().empty()) matches = matches - delta.deleted();
+    if (delta.size() > 0) {
+        // Ingested images follow the CG list rows and are few, so they are verified one by one
+        std::vector<uint32_t> found = delta.matching_rows(availability.available, availability.size(), [&](const TagStore& tags, uint32_t i) {
+            return matches_query(query, [&](const QueryNode& term) {
+                return term.tag_id < 0 ? std::nullopt : tags.score(i, static_cast<uint16_t>(term.tag_id));
+            });
+        });
+        matches = matches | Bitmap::from_sorted(found.data(), found.size());
+    }
+    return matches;
+}
 
-    std::vector<std::string> tags;
-    std::stringstream ss(s);
-    std::string tag;
+// The first max_image_count matching rows of set can be paged through; only
+// the count is taken for count_only
+SearchResult to_search_result(const Bitmap& matches, const Dataset& set, bool count_only) {
+    SearchResult result;
+    result.cg_table = set.base->cg_table;
+    result.delta = set.delta;
+    result.count = matches.cardinality();
+    if (!count_only) result.rows = matches.to_vector(max_image_count);
+    return result;
+}
 
-    while (std::getline(ss, tag, ',')) {
-        // 只去掉 tag 前后空格，保留中间空格
-        auto start = std::find_if_not(tag.begin(), tag.end(), ::isspace);
-        auto end   = std::find_if_not(tag.rbegin(), tag.rend(), ::isspace).base();
-        if (start < end) {  
-            tags.emplace_back(start, end);
-        }
+// Image paths of results [offset, offset + limit)
+std::vector<std::string> page_paths(const SearchResult& result, size_t offset, size_t limit) {
+    std::vector<std::string> paths;
+    size_t end = std::max(offset, std::min(result.size(), offset + limit));
+    for (size_t k = offset; k < end; ++k) {
+        paths.push_back(result.path(k));
     }
-    return tags;
+    return paths;
 }
 
-std::vector<std::string> get_image_files_by_tags(const std::vector<std::string>& input_tags, int& count) {
-    std::vector<std::string> images;
-    count = 0;
-    for (const auto& entry : fs::recursive_directory_iterator(tag_dir)) {
-        if (entry.is_regular_file() && entry.path().extension() == ".json") {
-            std::string filename = entry.path().filename().string();
-            json image_tags = load_json(entry.path().string());
-            if (++count % 50000 == 0) {
-                std::cout << "Processed file " << count << std::endl;
-            }
-            bool match = true;
-            // Check if each tag is in the matrix
-            std::string tag_group = "";
-            for (const auto& input_tag : input_tags) {
-                if (!tag_group.empty() && input_tag.back() != ']' && input_tag[0] != '[') {
-                    tag_group += input_tag + ",";
-                    continue;
-                }
-                if (input_tag[0] == '[') {
-                    tag_group += input_tag + ',';
-                } else if (input_tag.back() == ']') {
-                    tag_group += input_tag;
-                    // Extract tags from the input
-                    auto tags = extract_tags(tag_group);
-                    bool match_curr_tag_group = false;
-                    for (const auto& tag : tags) {
-                        if (tag[0] == '-') {
-                            std::string exclude_tag = tag.substr(1);
-                            auto [input_tag_name, input_score] = parse_tag_and_score(exclude_tag);
-                            std::transform(input_tag_name.begin(), input_tag_name.end(), input_tag_name.begin(), ::tolower);
-                            std::replace(input_tag_name.begin(), input_tag_name.end(), ' ', '_');
-                            auto tag_score = get_tag_score(image_tags, input_tag_name);
-                            bool found = tag_score.has_value() && (input_score == 0.0f || tag_score.value() >= input_score);
-                            if (!found) {
-                                match_curr_tag_group = true;
-                                break;
-                            }
-                        } else {
-                            std::string include_tag = tag;
-                            auto [input_tag_name, input_score] = parse_tag_and_score(include_tag);
-                            std::transform(input_tag_name.begin(), input_tag_name.end(), input_tag_name.begin(), ::tolower);
-                            std::replace(input_tag_name.begin(), input_tag_name.end(), ' ', '_');
-                            auto tag_score = get_tag_score(image_tags, input_tag_name);
-                            bool found = tag_score.has_value() && (input_score == 0.0f || tag_score.value() >= input_score);
-                            if (found) {
-                                match_curr_tag_group = true;
-                                break;
-                            }
-                        }
-                    }
-                    match = match && match_curr_tag_group;
-                    tag_group = ""; // Reset for next group
-                } else if (input_tag[0] == '-') {
-                    // If tag starts with '-', exclude this tag
-                    std::string exclude_tag = input_tag.substr(1);
-                    bool found = false;
-                    auto [input_tag_name, input_score] = parse_tag_and_score(exclude_tag);
-                    std::transform(input_tag_name.begin(), input_tag_name.end(), input_tag_name.begin(), ::tolower);
-                    std::replace(input_tag_name.begin(), input_tag_name.end(), ' ', '_');
-                    auto tag_score = get_tag_score(image_tags, input_tag_name);
-                    found = tag_score.has_value() && (input_score == 0.0f || tag_score.value() >= input_score);
-                    if (found) {
-                        match = false;
-                        break;
-                    }
-                } else {
-                    // Normal tag match
-                    bool found = false;
-                    auto [input_tag_name, input_score] = parse_tag_and_score(input_tag);
-                    std::transform(input_tag_name.begin(), input_tag_name.end(), input_tag_name.begin(), ::tolower);
-                    std::replace(input_tag_name.begin(), input_tag_name.end(), ' ', '_');
-                    auto tag_score = get_tag_score(image_tags, input_tag_name);
-                    found = tag_score.has_value() && (input_score == 0.0f || tag_score.value() >= input_score);
-                    if (!found) {
-                        match = false;
-                        break;
-                    }
-                }
-            }
-            if (match) {
-                // If matched, add corresponding image filename
-                fs::path relative_path = fs::relative(entry.path(), tag_dir);
-                relative_path.replace_extension(".webp");
-                fs::path image_file = image_dir / relative_path;
-                // Check if image file exists
-                if (fs::exists(image_file)) {
-                    count++;
-                    if (images.size() < max_image_count) {
-                        images.push_back(relative_path.string()); // Only save image filename
-                    } else {
-                        return images; // Stop if max count reached
-                    }
-                }
-            }
-        }
+// One page of a search result; the cursor is only included while more results follow
+json search_page(const SearchResult& result, uint64_t handle, size_t offset, size_t limit) {
+    std::vector<std::string> paths = page_paths(result, offset, limit);
+    size_t end = offset + paths.size();
+    json images = paths;
+    json response;
+    response["count"] = result.count;
+    response["available"] = result.size();
+    response["offset"] = offset;
+    response["images"] = std::move(images);
+    if (end < result.size()) {
+        response["cursor"] = encode_cursor(handle, end);
     }
-    return images;
-}
-
-std::vector<std::string> get_image_files_by_tags(const std::vector<std::string>& input_tags,
-    const Matrix<std::string, 2>& cached_cg_list, const Matrix<json, 1>& cached_tags, int& count) {
-    assert(cached_cg_list.extent(0) == cached_tags.extent(0));
-    count = 0;
-    std::vector<std::string> images;
-    for (size_t i = 0; i < cached_tags.extent(0); ++i) {
-        // if (i % 50000 == 0) {
-        //     std::cout << "Processed tag " << i << " of " << cached_tags.extent(0) << std::endl;
-        // }
-        auto& image_tags = cached_tags[i];
-        if (image_tags.is_null()) {
-            continue; // Skip if no tags available
-        }
-        bool match = true;
-        // Check if each tag is in the matrix
-        std::string tag_group = "";
-        for (const auto& input_tag : input_tags) {
-            if (!tag_group.empty() && input_tag.back() != ']' && input_tag[0] != '[') {
-                tag_group += input_tag + ",";
-                continue;
-            }
-            if (input_tag[0] == '[') {
-                tag_group += input_tag + ',';
-            } else if (input_tag.back() == ']') {
-                tag_group += input_tag;
-                // Extract tags from the input
-                auto tags = extract_tags(tag_group);
-                bool match_curr_tag_group = false;
-                for (const auto& tag : tags) {
-                    if (tag[0] == '-') {
-                        std::string exclude_tag = tag.substr(1);
-                        auto [input_tag_name, input_score] = parse_tag_and_score(exclude_tag);
-                        std::transform(input_tag_name.begin(), input_tag_name.end(), input_tag_name.begin(), ::tolower);
-                        std::replace(input_tag_name.begin(), input_tag_name.end(), ' ', '_');
-                        auto tag_score = get_tag_score(image_tags, input_tag_name);
-                        bool found = tag_score.has_value() && (input_score == 0.0f || tag_score.value() >= input_score);
-                        if (!found) {
-                            match_curr_tag_group = true;
-                            break;
-                        }
-                    } else {
-                        std::string include_tag = tag;
-                        auto [input_tag_name, input_score] = parse_tag_and_score(include_tag);
-                        std::transform(input_tag_name.begin(), input_tag_name.end(), input_tag_name.begin(), ::tolower);
-                        std::replace(input_tag_name.begin(), input_tag_name.end(), ' ', '_');
-                        auto tag_score = get_tag_score(image_tags, input_tag_name);
-                        bool found = tag_score.has_value() && (input_score == 0.0f || tag_score.value() >= input_score);
-                        if (found) {
-                            match_curr_tag_group = true;
-                            break;
-                        }
-                    }
-                }
-                match = match && match_curr_tag_group;
-                tag_group = ""; // Reset for next group
-            } else if (input_tag[0] == '-') {
-                // If tag starts with '-', exclude this tag
-                std::string exclude_tag = input_tag.substr(1);
-                auto [input_tag_name, input_score] = parse_tag_and_score(exclude_tag);
-                std::transform(input_tag_name.begin(), input_tag_name.end(), input_tag_name.begin(), ::tolower);
-                std::replace(input_tag_name.begin(), input_tag_name.end(), ' ', '_');
-                auto tag_score = get_tag_score(image_tags, input_tag_name);
-                bool found = tag_score.has_value() && (input_score == 0.0f || tag_score.value() >= input_score);
-                if (found) {
-                    match = false;
-                    break;
-                }
-            } else {
-                // Normal tag match
-                auto [input_tag_name, input_score] = parse_tag_and_score(input_tag);
-                std::transform(input_tag_name.begin(), input_tag_name.end(), input_tag_name.begin(), ::tolower);
-                std::replace(input_tag_name.begin(), input_tag_name.end(), ' ', '_');
-                auto tag_score = get_tag_score(image_tags, input_tag_name);
-                bool found = tag_score.has_value() && (input_score == 0.0f || tag_score.value() >= input_score);
-                if (!found) {
-                    match = false;
-                    break;
-                }
-            }
-        }
-        if (match) {
-            if (fs::exists(image_dir + "/" + cached_cg_list(i, 4) + "/image_" + cached_cg_list(i, 5) + ".webp")) {
-                count++;
-                if (images.size() < max_image_count)
-                images.push_back(cached_cg_list(i, 4) + "/image_" + cached_cg_list(i, 5) + ".webp"); // Only save image filename
-            }
-        }
-    }
-    return images;
+    return response;
+}
+
+// Non-negative integer field of a request, or fallback when absent
+size_t get_size_param(const json& j, const char* key, size_t fallback) {
+    if (!j.contains(key)) return fallback;
+    long long value = j[key].get<long long>();
+    if (value < 0) throw std::invalid_argument(std::string(key) + " must not be negative");
+    return static_cast<size_t>(value);
 }
 
 enum class ImageRating {
@@ -407,36 +861,319 @@ ImageRating get_image_rating(const json& j) {
     }
 }
 
-void print_tags(std::ostream& os, const json& j) {
+ImageRating get_image_rating(const TagDictionary& tag_dictionary, const TagStore& store, uint32_t image) {
+    if (!store.has_category(image, TagStore::category_rating)) {
+        std::cerr << "Invalid tag data: image has no rating tags" << std::endl;
+        return ImageRating::Unknown;
+    }
+    auto score = [&](const char* tag) {
+        int32_t tag_id = tag_dictionary.find(tag);
+        return tag_id < 0 ? std::nullopt : store.score(image, static_cast<uint16_t>(tag_id));
+    };
+
+    auto explicit_score = score("explicit");
+    auto sensitive_score = score("sensitive");
+    auto questionable_score = score("questionable");
+    if (explicit_score && *explicit_score > 0.5) {
+        return ImageRating::R18;
+    } else if ((sensitive_score && *sensitive_score > 0.6) || (questionable_score && *questionable_score > 0.6)) {
+        return ImageRating::R15; // R15 for sensitive/questionable content
+    } else {
+        return ImageRating::Safe;
+    }
+}
+
+const char* rating_name(ImageRating rating) {
+    switch (rating) {
+        case ImageRating::Safe: return "Safe";
+        case ImageRating::R15: return "R15";
+        case ImageRating::R18: return "R18";
+        default: return "Unknown";
+    }
+}
+
+// Tag information of one image, grouped by category in the order it is shown
+struct ImageInfo {
+    struct Tag {
+        std::string name;
+        std::string_view translation;
+        float score;
+    };
+
+    std::string_view title; // CG title, empty when the CG is unknown or has none
+    std::shared_ptr<const Dataset> dataset; // Holds the title and the translations
+    ImageRating rating = ImageRating::Unknown;
+    std::vector<std::pair<uint8_t, std::vector<Tag>>> categories;
+};
+
+void collect_tags(ImageInfo& info, const json& j) {
+    const TagDictionary& tag_dictionary = *info.dataset->dictionary;
     if (!j.contains("tags") || !j["tags"].is_object()) {
         std::cerr << "Invalid JSON format: missing 'tags' object" << std::endl;
         return;
     }
 
-    const auto& tags = j["tags"];
-    for (auto& category_pair : tags.items()) {
+    for (auto& category_pair : j["tags"].items()) {
         const auto& tag_group = category_pair.value();
         if (!tag_group.is_object()) continue;
 
-        if (category_pair.key() == "0") {
+        uint8_t category = parse_category_key(category_pair.key());
+        if (category == TagStore::category_rating) info.rating = get_image_rating(j);
+        std::vector<ImageInfo::Tag> tags;
+        for (auto& tag : tag_group.items()) {
+            int32_t tag_id = tag_dictionary.find(tag.key());
+            tags.push_back({tag.key(), tag_id < 0 ? std::string_view() : tag_dictionary.translation(static_cast<uint16_t>(tag_id)),
+                tag.value().get<float>()});
+        }
+        info.categories.emplace_back(category, std::move(tags));
+    }
+}
+
+void collect_tags(ImageInfo& info, const TagStore& store, uint32_t image) {
+    const TagDictionary& tag_dictionary = *info.dataset->dictionary;
+    if (!store.has_tags(image)) {
+        std::cerr << "Invalid tag data: image has no tags loaded" << std::endl;
+        return;
+    }
+
+    auto [first, last] = store.tags(image);
+    const TagEntry* e = first;
+    for (uint8_t category : {TagStore::category_general, TagStore::category_character, TagStore::category_rating}) {
+        if (!store.has_category(image, category)) continue;
+
+        if (category == TagStore::category_rating) info.rating = get_image_rating(tag_dictionary, store, image);
+        std::vector<ImageInfo::Tag> tags;
+        // Entries are grouped by category in ascending order
+        for (; e != last && tag_dictionary.category(e->tag_id) <= category; ++e) {
+            if (tag_dictionary.category(e->tag_id) != category) continue;
+            tags.push_back({std::string(tag_dictionary.name(e->tag_id)), tag_dictionary.translation(e->tag_id), dequantize_score(e->score)});
+        }
+        info.categories.emplace_back(category, std::move(tags));
+    }
+}
+
+// Tags of "<cg_id>/image_<n>.webp" from the cached tag store, the ingested images, the tag pack or its JSON file
+ImageInfo get_image_info(const std::string& filename) {
+    ImageInfo info;
+    info.dataset = std::atomic_load(&dataset);
+    const Dataset& set = *info.dataset;
+    info.title = set.title(std::string_view(filename).substr(0, filename.find_first_of('/')));
+
+    int64_t row = cache_cg_info ? find_image_row(filename, set) : -1;
+    auto [store, i] = row >= 0 ? set.tags_of(static_cast<uint32_t>(row)) : std::pair<const TagStore*, uint32_t>(nullptr, 0);
+    if (store && store->has_tags(i)) {
+        collect_tags(info, *store, i);
+    } else if (set.tag_pack->is_open()) {
+        std::string cg_id, number;
+        TagPackRecord record = split_image_name(filename, cg_id, number) ? set.tag_pack->find(cg_id, number) : TagPackRecord();
+        collect_tags(info, record ? pack_record_json(*set.tag_pack, record) : json());
+    } else {
+        // Assume detailed info exists in .json file (img_001.webp → img_001.json)
+        collect_tags(info, load_json(tag_dir + "/" + filename.substr(0, filename.find_last_of('.')) + ".json"));
+    }
+    return info;
+}
+
+void print_tags(std::ostream& os, const ImageInfo& info) {
+    if (!info.title.empty()) {
+        os << "<strong>Image Source: </strong> " << "<em>" << info.title << "</em><br>";
+    }
+    for (const auto& [category, tags] : info.categories) {
+        if (category == TagStore::category_general) {
             os << "<strong style=\"color: blue;\">General Tags</strong> " << "<br>" << std::endl;
-        } else if (category_pair.key() == "4") {
+        } else if (category == TagStore::category_character) {
             os << "<strong style=\"color: green;\">Character Tags</strong> " << "<br>" << std::endl;
-        } else if (category_pair.key() == "9") {
-            ImageRating rating = get_image_rating(j);
+        } else if (category == TagStore::category_rating) {
             os << "<strong style=\"color: orange;\">Rating Tags" << "(" <<
-                (rating == ImageRating::R18 ? "R18" : rating == ImageRating::R15 ? "R15" : "Safe") <<
+                (info.rating == ImageRating::R18 ? "R18" : info.rating == ImageRating::R15 ? "R15" : "Safe") <<
                 ")</strong> " << "<br>" << std::endl;
         }
 
-        for (auto& tag : tag_group.items()) {
-            os << tag.key() << "(" << (tag_translation_map.count(tag.key()) ? tag_translation_map[tag.key()] : "")
-                << ") " << std::fixed << std::setprecision(3) << tag.value().get<float>() << "<br>" << std::endl;
+        for (const auto& tag : tags) {
+            os << tag.name << "(" << tag.translation << ") " << std::fixed << std::setprecision(3) << tag.score << "<br>" << std::endl;
         }
     }
 }
 
-int main() {
+json image_info_json(const std::string& filename, const ImageInfo& info) {
+    json categories = json::array();
+    for (const auto& [category, tags] : info.categories) {
+        json tag_list = json::array();
+        for (const auto& tag : tags) {
+            tag_list.push_back({{"name", tag.name}, {"translation", tag.translation}, {"score", tag.score}});
+        }
+        categories.push_back({{"category", category}, {"tags", std::move(tag_list)}});
+    }
+    json response;
+    response["file"] = filename;
+    response["title"] = info.title.empty() ? json() : json(info.title);
+    response["rating"] = rating_name(info.rating);
+    response["categories"] = std::move(categories);
+    return response;
+}
+
+// Load the tag dictionary, packs, CG list, tags and index and check which
+// images exist, all from the snapshot when read_snapshot and it is current.
+// Which images existed is then taken as the snapshot recorded it, and
+// images_from_snapshot is set so the caller rescans them in the background;
+// without periodic rescans they are checked right away. With build_snapshot
+// only the snapshot is rebuilt. The generation is left at 0; nullptr when the
+// data cannot be loaded.
+std::shared_ptr<Dataset> load_dataset(bool read_snapshot, bool build_snapshot, bool* images_from_snapshot = nullptr) {
+    // Stamped before anything is read, see save_snapshot
+    std::vector<SourceStamp> sources = snapshot_sources();
+    auto image_pack = std::make_shared<ImagePack>();
+    if (image_pack->open(image_pack_file)) {
+        std::cout << "Serving " << image_pack->size() << " images from " << image_pack_file << "." << std::endl;
+    }
+    auto tag_pack = std::make_shared<TagPack>();
+    if (tag_pack->open(tag_pack_file)) {
+        std::cout << "Reading tags of " << tag_pack->size() << " images from " << tag_pack_file << "." << std::endl;
+    }
+    auto tag_dictionary = std::make_shared<TagDictionary>();
+    auto base = std::make_shared<BaseSegment>();
+    auto availability = std::make_shared<ImageAvailability>();
+    bool from_snapshot = cache_cg_info && use_snapshot && read_snapshot && !build_snapshot &&
+                         load_snapshot(snapshot_file, sources, *tag_dictionary, *base, *availability);
+    if (!from_snapshot) {
+        *tag_dictionary = load_tag_dictionary(selected_tags_file, tag_file, tag_statistics_file);
+    }
+    std::cout << "Loaded " << tag_dictionary->size() << " tags from " << selected_tags_file << " and " << tag_file
+        << " (" << tag_dictionary->size_in_bytes() / 1024 << " KB)." << std::endl;
+
+    if (cache_cg_info) {
+        // Out of core, tags loaded from the sources go straight to a segment file
+        std::unique_ptr<TagSegmentWriter> segment;
+        if (!from_snapshot) {
+            CgTable cglist;
+            if (!load_cg_table(cg_list_file, cglist)) {
+                std::cerr << "Error: Unable to open CG list file for caching." << std::endl;
+                return nullptr;
+            }
+            base->cg_table = std::make_shared<const CgTable>(std::move(cglist));
+            if (out_of_core) segment = stream_tags(*base->cg_table, *tag_dictionary, *tag_pack);
+            if (!segment) base->tags = load_tags(*base->cg_table, *tag_dictionary, *tag_pack);
+        }
+        std::cout << "Loaded CG list with " << base->cg_table->size() << " entries (" << base->cg_table->size_in_bytes() / 1024 << " KB)." << std::endl;
+        if (use_tag_index && !segment && base->index.tag_count() != tag_dictionary->size()) {
+            base->index = build_tag_index(base->tags, tag_dictionary->size());
+        }
+        bool rescan_later = from_snapshot && image_rescan_interval.count() > 0;
+        if (!rescan_later) {
+            auto start = std::chrono::steady_clock::now();
+            *availability = scan_images(*image_pack, *base->cg_table, DeltaSegment(static_cast<uint32_t>(base->cg_table->size())));
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "Found images for " << availability->available.cardinality() << "/" << base->cg_table->size()
+                << " CG entries in " << ms << " ms." << std::endl;
+        } else {
+            std::cout << "Using the images the snapshot found for " << availability->available.cardinality() << "/"
+                << base->cg_table->size() << " CG entries until they are checked again." << std::endl;
+        }
+        if (images_from_snapshot) *images_from_snapshot = rescan_later;
+        if (!from_snapshot && (use_snapshot || build_snapshot)) {
+            if (segment) {
+                save_snapshot(snapshot_file, sources, *tag_dictionary, *base->cg_table,
+                    [&](SnapshotWriter& out) { segment->write(out); }, *availability);
+            } else {
+                save_snapshot(snapshot_file, sources, *tag_dictionary, *base->cg_table, [&](SnapshotWriter& out) {
+                    base->tags.save(out);
+                    out.write_pod<uint8_t>(use_tag_index);
+                    if (use_tag_index) base->index.save(out);
+                }, *availability);
+            }
+        }
+        if (segment && !build_snapshot) {
+            try {
+                auto mapped = map_tag_segment(*segment, {}, [] {});
+                mapped->cg_table = std::move(base->cg_table);
+                base = std::move(mapped);
+            } catch (const std::exception& e) {
+                std::cerr << "Warning: Unable to write a segment file to " << segment_dir << ", keeping the tags in memory: " << e.what() << std::endl;
+                base->tags = load_tags(*base->cg_table, *tag_dictionary, *tag_pack);
+                if (use_tag_index) base->index = build_tag_index(base->tags, tag_dictionary->size());
+            }
+            segment.reset();
+        }
+        if (segment) {
+            std::cout << "Streamed the tags of " << segment->image_count() << " CG entries to the snapshot." << std::endl;
+        } else {
+            int total_tags = 0;
+            for (size_t i = 0; i < base->tags.image_count(); ++i) {
+                if (base->tags.has_tags(i)) {
+                    total_tags += 1;
+                }
+            }
+            std::cout << "Loaded tags for " << total_tags << "/" << base->tags.image_count() << " CG entries ("
+                << base->tags.entry_count() << " tags, " << base->tags.size_in_bytes() / (1024 * 1024) << " MB)." << std::endl;
+            if (use_tag_index) {
+                std::cout << "Indexed " << base->index.tag_count() << " tags (" << base->index.size_in_bytes() / (1024 * 1024) << " MB)." << std::endl;
+            }
+        }
+        if (base->mapping) {
+            std::cout << "Serving tags and index out of core from " << base->mapping->size() / (1024 * 1024) << " MB of mapped segment." << std::endl;
+        }
+    } else {
+        CgTable cglist;
+        if (!load_cg_table(cg_list_file, cglist)) {
+            std::cerr << "Error: Unable to open CG list file." << std::endl;
+        }
+        base->cg_table = std::make_shared<const CgTable>(std::move(cglist));
+        std::cout << "CG info caching is disabled." << std::endl;
+    }
+    std::cout << "Loaded " << base->cg_table->title_count() << " CG titles from " << cg_list_file << std::endl;
+
+    auto set = std::make_shared<Dataset>();
+    set->dictionary = std::move(tag_dictionary);
+    set->image_pack = std::move(image_pack);
+    set->tag_pack = std::move(tag_pack);
+    set->heat = std::make_shared<TagHeat>(set->dictionary->size());
+    set->delta = std::make_shared<const DeltaSegment>(static_cast<uint32_t>(base->cg_table->size()));
+    set->base = std::move(base);
+    set->availability = std::move(availability);
+    return set;
+}
+
+// Load the data from the sources again, ignoring the snapshot (it does not see
+// tag files edited in place), and swap it in while requests go on being
+// answered from the current dataset, which is freed once the last of them lets
+// go; stored search results keep only its CG list and delta. The tag files as they are now replace
+// what was ingested from them; images only sent to POST /ingest are dropped.
+// Ingesting waits for the reload, so nothing is parsed against the old
+// dictionary and published into the new dataset.
+enum class ReloadResult { Reloaded, Running, Failed };
+
+ReloadResult reload_dataset() {
+    if (reloading.exchange(true)) {
+        std::cout << "Not reloading: a reload is already running." << std::endl;
+        return ReloadResult::Running;
+    }
+    std::lock_guard<std::mutex> reload_lock(reload_mutex);
+    auto start = std::chrono::steady_clock::now();
+    std::cout << "Reloading the data from the sources." << std::endl;
+    std::shared_ptr<Dataset> loaded;
+    try {
+        loaded = load_dataset(false, false);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+    }
+    if (!loaded) {
+        std::cerr << "Error: Reload failed, keeping the current data." << std::endl;
+        reloading = false;
+        return ReloadResult::Failed;
+    }
+    {
+        std::lock_guard<std::mutex> lock(dataset_mutex);
+        loaded->generation = std::atomic_load(&dataset)->generation + 1;
+        std::atomic_store(&dataset, std::shared_ptr<const Dataset>(loaded));
+    }
+    query_cache.clear(); // Results of older generations never hit again
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Reloaded the data as generation " << loaded->generation << " in " << ms << " ms." << std::endl;
+    reloading = false;
+    return ReloadResult::Reloaded;
+}
+
+int main(int argc, char** argv) {
     // {
     //     Matrix<std::string, 2> all_tags = load_tags(tag_file);
     //     std::cout << "Loaded " << all_tags.extent(0) << " tags from " << tag_file << std::endl;
@@ -462,46 +1199,53 @@ int main() {
 
     //     return 0;
     // }
-    // matrix_impl::getMatrixConfig().splitChar = ' ';
     // auto images = get_image_files_by_tags({ "sleeve_cuffs" });
     // std::cout << "Found " << images.size() << " images for the tag 'sleeve_cuffs':\n";
     // for (const auto& img : images) {
     //     std::cout << " - " << img << "\n";
     // }
-    // matrix_impl::getMatrixConfig().splitChar = ',';
     // return 0;
 
-    httplib::Server svr;
-    Matrix<std::string, 2> all_tags = load_tags_translation(tag_file);
-    std::cout << "Loaded " << all_tags.extent(0) << " tags from " << tag_file << std::endl;
-    for (size_t i = 0; i < all_tags.extent(0); ++i) {
-        tag_translation_map[all_tags(i, 0)] = all_tags(i, 1);
+    // SIGHUP reloads the data; taken by reload_trigger, so no thread may see it first
+    block_signal(SIGHUP);
+
+    // --build-snapshot only rebuilds snapshot_file from the sources and exits
+    bool build_snapshot = argc > 1 && std::string(argv[1]) == "--build-snapshot";
+    if (build_snapshot && !cache_cg_info) {
+        std::cerr << "Error: Snapshots need cache_cg_info." << std::endl;
+        return 1;
     }
-    std::map<std::string, std::string> id_title_map = load_id_title_map(cg_list_file);
-    std::cout << "Loaded " << id_title_map.size() << " CG titles from " << cg_list_file << std::endl;
 
-    if (cache_cg_info) {
-        std::ifstream fin(cg_list_file);
-        if (!fin) {
-            std::cerr << "Error: Unable to open CG list file for caching." << std::endl;
-            return 1;
-        }
-        fin >> cached_cg_list;
-        // cached_cg_list = cached_cg_list.subm(matrix_impl::Slice(0, 10000));
-        std::cout << "Loaded CG list with " << cached_cg_list.extent(0) << " entries." << std::endl;
-        cached_tags = load_tags(cached_cg_list);
-        int total_tags = 0;
-        for (size_t i = 0; i < cached_tags.extent(0); ++i) {
-            if (!cached_tags[i].is_null()) {
-                total_tags += 1;
-            }
-        }
-        std::cout << "Loaded tags for " << total_tags << "/" << cached_tags.extent(0) << " CG entries." << std::endl;
-    } else {
-        std::cout << "CG info caching is disabled." << std::endl;
+    httplib::Server svr;
+    std::cout << "Using " << simd_kernels().name << " kernels for bitmap and score operations." << std::endl;
+    bool images_from_snapshot = false;
+    std::shared_ptr<Dataset> loaded = load_dataset(true, build_snapshot, &images_from_snapshot);
+    if (!loaded) {
+        return 1;
+    }
+    if (build_snapshot) {
+        return 0;
     }
+    loaded->generation = 1;
+    dataset = std::move(loaded);
+
+    // Loose image files are checked again now and then, and right away when the snapshot said which exist
+    PeriodicTask image_rescan(cache_cg_info ? image_rescan_interval : std::chrono::seconds(0), rescan_images, images_from_snapshot);
+
+    // Images the tagger finishes are searchable a batch interval later
+    TagWatcher tag_watcher(tag_dir, cache_cg_info ? tag_watch_interval : std::chrono::milliseconds(0), ingest_tag_files);
 
-    matrix_impl::getMatrixConfig().splitChar = ' '; // Set delimiter to space
+    // Ingested images and tombstones are folded into the base in the background
+    PeriodicTask compaction(cache_cg_info ? compaction_interval : std::chrono::seconds(0), compact);
+
+    // Out of core, the postings of the most queried tags are kept in memory
+    PeriodicTask residency(out_of_core && cache_cg_info ? residency_interval : std::chrono::seconds(0), update_residency);
+
+    // kill -HUP reloads the data like POST /reload
+    SignalTrigger reload_trigger(SIGHUP, [] { reload_dataset(); });
+
+    // Pages of search results are read ahead of the client's image requests
+    Prefetcher prefetcher(prefetch_queue_capacity, prefetch_threads, prefetch_image);
 
     // Main page
     std::string html_cache;
@@ -515,10 +1259,45 @@ int main() {
     // Tag filter API
     svr.Get("/tags", [&](const httplib::Request& req, httplib::Response& res) {
         auto it = req.get_param_value("filter");
-        std::string json = filter_tags(all_tags, it);
+        std::string json = filter_tags(*std::atomic_load(&dataset)->dictionary, it);
         res.set_content(json, "application/json");
     });
 
+    // Cache statistics
+    svr.Get("/stats", [&](const httplib::Request&, httplib::Response& res) {
+        QueryCacheStats stats = query_cache.stats();
+        json response;
+        std::shared_ptr<const Dataset> set = std::atomic_load(&dataset);
+        response["dataset_generation"] = set->generation;
+        response["live_version"] = set->version;
+        response["reloading"] = reloading.load();
+        if (cache_cg_info) {
+            response["images"] = {{"rows", set->availability->size()}, {"available", set->availability->available.cardinality()},
+                {"version", set->availability->version}};
+            response["delta"] = {{"images", set->delta->size()}, {"chunks", set->delta->chunk_count()},
+                {"tombstones", set->delta->deleted().cardinality()}, {"bytes", set->delta->size_in_bytes()}};
+        }
+        if (out_of_core) {
+            response["out_of_core"] = {{"mapped_bytes", set->base->mapping ? set->base->mapping->size() : 0},
+                {"pinned_bytes", pinned_bytes.load()}, {"pinned_tags", pinned_tags.load()}};
+        }
+        response["query_cache"] = {
+            {"hits", stats.hits}, {"misses", stats.misses}, {"evictions", stats.evictions},
+            {"entries", stats.entries}, {"bytes", stats.bytes}, {"max_bytes", stats.max_bytes}};
+        ImageCacheStats images = image_cache.stats();
+        uint64_t lookups = images.hits + images.misses;
+        response["image_cache"] = {
+            {"hits", images.hits}, {"misses", images.misses}, {"hit_ratio", lookups ? double(images.hits) / lookups : 0.0},
+            {"evictions", images.evictions}, {"entries", images.entries}, {"bytes", images.bytes}, {"max_bytes", images.max_bytes}};
+        ImageInfoCacheStats info = image_info_cache.stats();
+        response["image_info_cache"] = {
+            {"hits", info.hits}, {"misses", info.misses}, {"entries", info.entries}, {"capacity", info.capacity}};
+        PrefetchStats prefetch = prefetcher.stats();
+        response["prefetch"] = {
+            {"queued", prefetch.queued}, {"fetched", prefetch.fetched}, {"dropped", prefetch.dropped}, {"cancelled", prefetch.cancelled}};
+        res.set_content(response.dump(), "application/json");
+    });
+
     // Validate tags
     svr.Post("/validate", [&](const httplib::Request& req, httplib::Response& res) {
         std::string body = req.body;
@@ -532,9 +1311,10 @@ int main() {
             if (!tag.empty()) input_tags.push_back(tag);
         }
 
+        std::shared_ptr<const Dataset> set = std::atomic_load(&dataset);
         std::vector<std::string> invalid;
         for (const auto& t : input_tags) {
-            if (std::find(all_tags.begin(), all_tags.end(), t) == all_tags.end()) {
+            if (set->dictionary->find(t) < 0) {
                 invalid.push_back(t);
             }
         }
@@ -591,11 +1371,35 @@ int main() {
     //         res.set_content(std::string("Failed to parse request: ") + e.what(), "text/plain");
     //     }
     // });
-    std::vector<std::string> search_result_images;
+    // POST /search {"tags": "...", "offset": 0, "limit": 20, "count_only": false}
+    // or {"cursor": "...", "limit": 20} for the page after a previous response
     svr.Post("/search", [&](const httplib::Request& req, httplib::Response& res) {
         try {
             auto j = json::parse(req.body);
+            size_t limit = std::min(get_size_param(j, "limit", page_size), max_image_count);
+
+            if (j.contains("cursor")) {
+                uint64_t handle = 0;
+                size_t offset = 0;
+                if (!decode_cursor(j["cursor"].get<std::string>(), handle, offset)) {
+                    throw std::invalid_argument("Malformed cursor");
+                }
+                std::shared_ptr<const SearchResult> result = search_results.get(handle);
+                if (!result) {
+                    res.status = 410;
+                    res.set_content("Search results expired, please search again", "text/plain");
+                    return;
+                }
+                offset = get_size_param(j, "offset", offset); // Jump within the same results
+                res.set_content(search_page(*result, handle, offset, limit).dump(), "application/json");
+                // This page's images are requested next, then the following page's
+                prefetcher.enqueue(req.remote_addr, page_paths(*result, offset, std::min(2 * limit, prefetch_queue_capacity)));
+                return;
+            }
+
             std::string tags = j["tags"];
+            bool count_only = j.value("count_only", false);
+            size_t offset = get_size_param(j, "offset", 0);
 
             std::cout << "Search tags: " << tags << std::endl;
 
@@ -605,17 +1409,50 @@ int main() {
                 res.set_content("Tags cannot be empty", "text/plain");
                 return;
             }
-            // search_result_images = get_image_files_by_tags(tag_list);
+            // Tag ids, rows and images all come from the same load
+            std::shared_ptr<const Dataset> set = std::atomic_load(&dataset);
+            QueryNode query = compile_query(tag_list, [&](const std::string& tag) { return set->dictionary->find(tag) >= 0; });
+            resolve_tags(query, [&](const std::string& tag) { return set->dictionary->find(tag); });
 
-            json response;
-            int count = 0;
+            auto result = std::make_shared<SearchResult>();
             if (cache_cg_info) {
-                response["images"] = get_image_files_by_tags(tag_list, cached_cg_list, cached_tags, count);
+                // Repeated queries, including ones without matches, are answered from the query cache
+                std::string key = canonical_query(query);
+                // Only the base matches are cached; ingests and rescans are applied to them below
+                uint64_t generation = set->base_generation();
+                std::shared_ptr<const CachedQuery> cached = query_cache.get(key, generation);
+                if (!cached) {
+                    count_queried_tags(query, *set->heat);
+                    auto computed = std::make_shared<CachedQuery>();
+                    if (use_tag_index) {
+                        plan_query(query, IndexEstimator(set->base->index));
+                    } else {
+                        plan_query(query, StatisticsEstimator(*set->dictionary));
+                    }
+                    *computed = get_image_files_by_tags(query, *set, use_tag_index);
+                    query_cache.put(key, generation, computed);
+                    cached = computed;
+                }
+                *result = to_search_result(live_matches(*cached, query, *set), *set, count_only);
             } else {
-                response["images"] = get_image_files_by_tags(tag_list, count);
+                plan_query(query, StatisticsEstimator(*set->dictionary));
+                *result = get_image_files_by_tags(query, *set->tag_pack, *set->image_pack, count_only);
+            }
+
+            json response;
+            if (count_only) {
+                response["count"] = result->count;
+            } else {
+                // Results that fit on one page need no handle
+                uint64_t handle = result->size() > limit ? search_results.put(result) : 0;
+                response = search_page(*result, handle, offset, limit);
             }
-            response["count"] = count;
             res.set_content(response.dump(), "application/json");
+            if (!count_only) {
+                // Only this client's earlier searches are superseded
+                prefetcher.cancel(req.remote_addr);
+                prefetcher.enqueue(req.remote_addr, page_paths(*result, offset, std::min(2 * limit, prefetch_queue_capacity)));
+            }
         } catch (const std::exception& e) {
             std::cerr << __LINE__ << " Error parsing request: " << e.what() << std::endl;
             res.status = 400;
@@ -666,19 +1503,44 @@ int main() {
     // /img/<filename>
     svr.Get(R"(/img/(.+))", [&](const httplib::Request& req, httplib::Response& res) {
         std::string filename = req.matches[1];
-        std::string path = image_dir  + "/" + filename;
+        std::shared_ptr<const Dataset> set = std::atomic_load(&dataset);
+        // Images not packed yet are read from image_dir
+        if (PackedImage image = find_packed_image(*set->image_pack, filename)) {
+            std::shared_ptr<const ImagePack> image_pack = set->image_pack;
+            if (answer_conditional(req, res, {quoted_etag(image.hash), image_pack->modified(), image_cache_control})) {
+                return;
+            }
+            if (res.status == 200) {
+                res.set_content(reinterpret_cast<const char*>(image.data), image.size, "image/webp");
+                return;
+            }
+            // Written to the socket straight from the mapping, which a reload meanwhile must not unmap
+            res.set_content_provider(image.size, "image/webp",
+                [image, image_pack](size_t offset, size_t length, httplib::DataSink& sink) {
+                    return sink.write(reinterpret_cast<const char*>(image.data) + offset, length);
+                });
+            return;
+        }
 
-        std::ifstream in(path, std::ios::binary);
-        if (!in) {
-            std::cerr << "Error: Image file not found: " << path << std::endl;
+        std::shared_ptr<const CachedImage> image = cached_image(filename, *set, true);
+        if (!image && !(image = load_image_file(filename, set->generation))) {
+            std::cerr << "Error: Image file not found: " << image_dir << "/" << filename << std::endl;
             res.status = 404;
             res.set_content("Image not found", "text/plain");
             return;
         }
-
-        std::ostringstream ss;
-        ss << in.rdbuf();
-        res.set_content(ss.str(), "image/webp");
+        if (answer_conditional(req, res, {image->etag, image->modified, image_cache_control})) {
+            return;
+        }
+        if (res.status == 200) {
+            res.set_content(image->bytes, "image/webp");
+            return;
+        }
+        // Written from the cached bytes, which the provider keeps alive
+        res.set_content_provider(image->bytes.size(), "image/webp",
+            [image](size_t offset, size_t length, httplib::DataSink& sink) {
+                return sink.write(image->bytes.data() + offset, length);
+            });
     });
 
     // /image_info?file=<filename>
@@ -691,19 +1553,129 @@ int main() {
         }
 
         std::string filename = req.get_param_value("file");
-        std::string fullpath = image_dir + "/" + filename;
+        // Ingesting invalidates the images it re-tags
+        uint64_t generation = std::atomic_load(&dataset)->generation;
+        std::shared_ptr<const RenderedImageInfo> rendered = image_info_cache.get(filename, generation);
+        if (!rendered) {
+            std::ostringstream oss;
+            ImageInfo image = get_image_info(filename);
+            print_tags(oss, image);
+            auto info = std::make_shared<RenderedImageInfo>();
+            info->html = oss.str();
+            // Tag info changes when the data is rebuilt, so clients revalidate by content
+            info->etag = quoted_etag(checksum64(info->html.data(), info->html.size()));
+            image_info_cache.put(filename, image.dataset->generation, image.dataset->live_generation(), info);
+            rendered = std::move(info);
+        }
+        if (answer_conditional(req, res, {rendered->etag, 0, "no-cache"})) {
+            return;
+        }
+        res.set_content(rendered->html, "text/html");
+    });
 
-        // Assume detailed info exists in .json file (img_001.webp → img_001.json)
-        std::string tag_info_path = tag_dir + "/" + filename.substr(0, filename.find_last_of('.')) + ".json";
+    // /image_info/json?file=<filename>: the same information as JSON
+    svr.Get("/image_info/json", [&](const httplib::Request& req, httplib::Response& res) {
+        if (!req.has_param("file")) {
+            std::cerr << "Error: Missing 'file' parameter in request." << std::endl;
+            res.status = 400;
+            res.set_content("Missing file parameter", "text/plain");
+            return;
+        }
+        std::string filename = req.get_param_value("file");
+        res.set_content(image_info_json(filename, get_image_info(filename)).dump(), "application/json");
+    });
 
-        std::ostringstream oss;
-        if (id_title_map.find(filename.substr(0, filename.find_first_of('/'))) != id_title_map.end()) {
-            oss << "<strong>Image Source: </strong> " << "<em>" << id_title_map[filename.substr(0, filename.find_first_of('/'))] << "</em><br>";
+    // POST /image_info/batch {"files": ["<filename>", ...]}: the JSON information of a whole page, in order
+    svr.Post("/image_info/batch", [&](const httplib::Request& req, httplib::Response& res) {
+        try {
+            auto j = json::parse(req.body);
+            const json& files = j.at("files");
+            if (!files.is_array() || files.size() > max_image_info_batch) {
+                throw std::invalid_argument("files must be an array of at most " + std::to_string(max_image_info_batch) + " filenames");
+            }
+            json images = json::array();
+            for (const auto& file : files) {
+                std::string filename = file.get<std::string>();
+                images.push_back(image_info_json(filename, get_image_info(filename)));
+            }
+            json response;
+            response["images"] = std::move(images);
+            res.set_content(response.dump(), "application/json");
+        } catch (const std::exception& e) {
+            std::cerr << __LINE__ << " Error parsing request: " << e.what() << std::endl;
+            res.status = 400;
+            res.set_content(std::string("Failed to parse request: ") + e.what(), "text/plain");
         }
+    });
 
-        print_tags(oss, load_json(tag_info_path));
+    // POST /ingest {"images": [{"file": "<cg_id>/image_<n>.webp", "title": "...", "tags": {"0": {...}, "4": {...}, "9": {...}}}, ...]}
+    // Makes newly tagged or re-tagged images searchable; tags are in the tagger's JSON format.
+    // {"file": "...", "removed": true} takes an image out of the results.
+    if (cache_cg_info) {
+        svr.Post("/ingest", [&](const httplib::Request& req, httplib::Response& res) {
+            if (!is_local_request(req)) {
+                res.status = 403;
+                res.set_content("Ingesting is only allowed from localhost", "text/plain");
+                return;
+            }
+            try {
+                auto j = json::parse(req.body);
+                const json& images = j.at("images");
+                if (!images.is_array() || images.size() > max_ingest_batch) {
+                    throw std::invalid_argument("images must be an array of at most " + std::to_string(max_ingest_batch) + " records");
+                }
+                std::lock_guard<std::mutex> reload_lock(reload_mutex);
+                TagJsonHandler handler(*std::atomic_load(&dataset)->dictionary);
+                std::vector<IngestRecord> records;
+                for (const auto& image : images) {
+                    if (image.value("removed", false)) {
+                        records.push_back({image.at("file").get<std::string>(), "", {}, {}, true});
+                        continue;
+                    }
+                    if (!image.at("tags").is_object()) throw std::invalid_argument("tags must be an object");
+                    handler.reset();
+                    // The record has the layout of a tag file, so the tag file parser reads it
+                    std::string text = image.dump();
+                    json::sax_parse(text.begin(), text.end(), &handler);
+                    records.push_back({image.at("file").get<std::string>(), image.value("title", ""), handler.entries(), handler.categories()});
+                }
+                json response;
+                response["received"] = records.size();
+                IngestCounts counts = ingest_images(records);
+                response["ingested"] = counts.ingested;
+                response["removed"] = counts.removed;
+                response["delta"] = std::atomic_load(&dataset)->delta->size();
+                res.set_content(response.dump(), "application/json");
+            } catch (const std::exception& e) {
+                std::cerr << __LINE__ << " Error parsing request: " << e.what() << std::endl;
+                res.status = 400;
+                res.set_content(std::string("Failed to parse request: ") + e.what(), "text/plain");
+            }
+        });
+    }
 
-        res.set_content(oss.str(), "text/html");
+    // POST /reload: load the data from the sources again without a restart, like kill -HUP.
+    // Only accepted from this machine; answers once the new data is live.
+    svr.Post("/reload", [&](const httplib::Request& req, httplib::Response& res) {
+        if (!is_local_request(req)) {
+            res.status = 403;
+            res.set_content("Reloading is only allowed from localhost", "text/plain");
+            return;
+        }
+        ReloadResult reloaded = reload_dataset();
+        if (reloaded == ReloadResult::Running) {
+            res.status = 409;
+            res.set_content("A reload is already running", "text/plain");
+            return;
+        }
+        if (reloaded == ReloadResult::Failed) {
+            res.status = 500;
+            res.set_content("Reload failed, the previous data is still served", "text/plain");
+            return;
+        }
+        json response;
+        response["generation"] = std::atomic_load(&dataset)->generation;
+        res.set_content(response.dump(), "application/json");
     });
 
     std::cout << "Server running at http://localhost:8080/ ...\n";
@@ -0,0 +1,455 @@
+#pragma once
+// Common layout of the tag and image packs: append-only files of blobs keyed
+// by (CG id, image number), replacing one small file per image (an inode, an
+// open and a read each, which a network file system turns into metadata round
+// trips). Layout:
+//
+//   header   format magic and version, end of the last committed footer
+//   blobs    one per image, appended in any order
+//   table    string table (CG ids and whatever the format interns), the CG
+//            ids sorted by value, the (CG id, image number) -> blob index
+//            sorted by key, and optionally one u64 value per index entry
+//   footer   table offset and size, end magic
+//
+// Integers are little-endian. The file only ever grows: adding images appends
+// their blobs, then a new table and footer, leaving the previous ones as dead
+// bytes. Once the new footer is on disk the header's committed size is
+// rewritten to point past it, and readers only look at the committed part, so
+// a server that maps the pack while it is extended, or after an append was
+// interrupted, reads the last committed version. The next writer cuts off
+// what an interrupted append left behind; only one writer may run at a time.
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "mapped_file.h"
+
+struct PackFormat {
+    const char* name; // For messages
+    char magic[8];
+    char end_magic[8];
+    uint32_t version;
+};
+
+struct PackHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t committed_bytes; // End of the last committed footer, 0 before the first commit
+};
+
+struct PackFooter {
+    uint64_t table_offset;
+    uint64_t table_bytes;
+    char magic[8];
+};
+
+struct PackEntry {
+    uint32_t cg;     // Position in the sorted CG id list
+    uint32_t image;  // n of image_<n>
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+// Bytes of one image's blob inside the mapped pack
+struct PackBlob {
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+
+    explicit operator bool() const { return data != nullptr; }
+};
+
+// Image number of "image_<n>" style names, false unless all digits
+inline bool parse_image_number(std::string_view text, uint32_t& number) {
+    if (text.empty() || text.size() > 9) return false;
+    number = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') return false;
+        number = number * 10 + static_cast<uint32_t>(c - '0');
+    }
+    return true;
+}
+
+// Flush what was written to path to the device; false on failure
+inline bool sync_file(const std::string& path) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    bool ok = FlushFileBuffers(file) != 0;
+    CloseHandle(file);
+    return ok;
+#else
+    int fd = ::open(path.c_str(), O_WRONLY);
+    if (fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+#endif
+}
+
+class PackReader {
+public:
+    static constexpr size_t npos = SIZE_MAX;
+
+    // Prints why an existing file cannot be used; false as well when it is missing
+    bool open(const std::string& path, const PackFormat& format) {
+        close();
+        if (!file_.open(path)) return false;
+        try {
+            parse(format);
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Error: Unable to read " << format.name << " " << path << ": " << e.what() << std::endl;
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        file_.close();
+        strings_ = string_offsets_ = cg_ids_ = entries_ = values_ = nullptr;
+        string_count_ = cg_count_ = entry_count_ = 0;
+        table_offset_ = committed_bytes_ = 0;
+    }
+
+    bool is_open() const { return file_.data() != nullptr; }
+
+    // Number of packed images
+    size_t size() const { return entry_count_; }
+
+    size_t string_count() const { return string_count_; }
+
+    std::string_view string(uint32_t id) const {
+        uint32_t first = u32(string_offsets_ + 4 * size_t(id)), last = u32(string_offsets_ + 4 * (size_t(id) + 1));
+        return std::string_view(reinterpret_cast<const char*>(strings_) + first, last - first);
+    }
+
+    std::string_view cg_id(size_t i) const { return string(u32(cg_ids_ + 4 * size_t(entry(i).cg))); }
+    uint32_t image(size_t i) const { return entry(i).image; }
+    uint64_t offset(size_t i) const { return entry(i).offset; }
+
+    // Per-entry value of formats that store one, else 0
+    uint64_t value(size_t i) const { return values_ ? u64(values_ + 8 * i) : 0; }
+
+    PackBlob blob(size_t i) const {
+        PackEntry e = entry(i);
+        return {file_.data() + e.offset, e.size};
+    }
+
+    // Index of <cg_id>/image_<image>, npos when the image is not packed
+    size_t find(std::string_view cg_id, uint32_t image) const {
+        size_t lo = 0, hi = cg_count_;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (string(u32(cg_ids_ + 4 * mid)) < cg_id) lo = mid + 1; else hi = mid;
+        }
+        if (lo == cg_count_ || string(u32(cg_ids_ + 4 * lo)) != cg_id) return npos;
+        const uint32_t cg = static_cast<uint32_t>(lo);
+        lo = 0, hi = entry_count_;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            PackEntry e = entry(mid);
+            if (e.cg < cg || (e.cg == cg && e.image < image)) lo = mid + 1; else hi = mid;
+        }
+        if (lo == entry_count_ || entry(lo).cg != cg || entry(lo).image != image) return npos;
+        return lo;
+    }
+
+    size_t find(std::string_view cg_id, std::string_view image) const {
+        uint32_t number;
+        return parse_image_number(image, number) ? find(cg_id, number) : npos;
+    }
+
+    // The mapped file, e.g. to hand blobs to the OS by offset
+    const MappedFile& file() const { return file_; }
+
+    // Bytes up to the end of the footer read; later ones belong to an unfinished append
+    uint64_t committed_bytes() const { return committed_bytes_; }
+
+    static uint32_t u32(const unsigned char* p) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static uint64_t u64(const unsigned char* p) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+private:
+    PackEntry entry(size_t i) const {
+        PackEntry e;
+        std::memcpy(&e, entries_ + sizeof(PackEntry) * i, sizeof(e));
+        return e;
+    }
+
+    void parse(const PackFormat& format) {
+        const unsigned char* data = file_.data();
+        PackHeader header;
+        PackFooter footer;
+        if (file_.size() < sizeof(header)) throw std::runtime_error("file is truncated");
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, format.magic, sizeof(header.magic)) != 0) throw std::runtime_error(std::string("not a ") + format.name);
+        if (header.version != format.version) throw std::runtime_error("unsupported version " + std::to_string(header.version));
+        if (header.committed_bytes == 0) throw std::runtime_error("nothing committed yet, the first write is running or was interrupted");
+        // Bytes after the committed footer are an append in progress or an interrupted one
+        if (header.committed_bytes < sizeof(header) + sizeof(footer) || header.committed_bytes > file_.size()) {
+            throw std::runtime_error("file is truncated");
+        }
+        const size_t size = static_cast<size_t>(header.committed_bytes);
+        std::memcpy(&footer, data + size - sizeof(footer), sizeof(footer));
+        if (std::memcmp(footer.magic, format.end_magic, sizeof(footer.magic)) != 0) throw std::runtime_error("footer is missing");
+        if (footer.table_offset < sizeof(header) || footer.table_offset > size - sizeof(footer) ||
+            footer.table_bytes != size - sizeof(footer) - footer.table_offset) {
+            throw std::runtime_error("footer is corrupt");
+        }
+        table_offset_ = footer.table_offset;
+        committed_bytes_ = header.committed_bytes;
+
+        const unsigned char* p = data + footer.table_offset;
+        const unsigned char* end = data + size - sizeof(footer);
+        auto take = [&](uint64_t bytes) {
+            if (uint64_t(end - p) < bytes) throw std::runtime_error("table is truncated");
+            const unsigned char* q = p;
+            p += bytes;
+            p += (8 - (p - data) % 8) % 8;
+            if (p > end) throw std::runtime_error("table is truncated");
+            return q;
+        };
+        auto count = [&](uint64_t element_bytes) {
+            uint64_t n = u64(take(8));
+            if (n > uint64_t(end - p) / element_bytes) throw std::runtime_error("table is truncated");
+            return static_cast<size_t>(n);
+        };
+
+        string_count_ = count(4);
+        string_offsets_ = take(4 * (uint64_t(string_count_) + 1));
+        uint64_t arena_bytes = u32(string_offsets_ + 4 * string_count_);
+        strings_ = take(arena_bytes);
+        for (size_t i = 0; i < string_count_; ++i) {
+            if (u32(string_offsets_ + 4 * i) > u32(string_offsets_ + 4 * (i + 1))) throw std::runtime_error("string table is corrupt");
+        }
+        cg_count_ = count(4);
+        cg_ids_ = take(4 * uint64_t(cg_count_));
+        for (size_t i = 0; i < cg_count_; ++i) {
+            if (u32(cg_ids_ + 4 * i) >= string_count_) throw std::runtime_error("CG id table is corrupt");
+        }
+        entry_count_ = count(sizeof(PackEntry));
+        entries_ = take(sizeof(PackEntry) * uint64_t(entry_count_));
+        for (size_t i = 0; i < entry_count_; ++i) {
+            PackEntry e = entry(i);
+            if (e.cg >= cg_count_ || e.offset < sizeof(header) || e.offset > table_offset_ || e.size > table_offset_ - e.offset) {
+                throw std::runtime_error("blob index is corrupt");
+            }
+        }
+        if (p != end) {
+            if (count(8) != entry_count_) throw std::runtime_error("value table is corrupt");
+            values_ = take(8 * uint64_t(entry_count_));
+        }
+        if (p != end) throw std::runtime_error("table has trailing data");
+    }
+
+    MappedFile file_;
+    const unsigned char* strings_ = nullptr;
+    const unsigned char* string_offsets_ = nullptr; // string_count_ + 1 u32 offsets into strings_
+    const unsigned char* cg_ids_ = nullptr;         // String ids of the CG ids, sorted by value
+    const unsigned char* entries_ = nullptr;        // PackEntry array sorted by (cg, image)
+    const unsigned char* values_ = nullptr;         // Optional u64 per entry
+    size_t string_count_ = 0;
+    size_t cg_count_ = 0;
+    size_t entry_count_ = 0;
+    uint64_t table_offset_ = 0;
+    uint64_t committed_bytes_ = 0;
+};
+
+// Adds images to a new or existing pack. Nothing reaches the file's index until
+// commit(); throws std::runtime_error on I/O errors or an unreadable pack. A
+// failed write, or destroying the writer before commit(), cuts the file back
+// to its last committed footer.
+class PackWriter {
+public:
+    PackWriter(const std::string& path, const PackFormat& format) : path_(path), format_(format) {
+        std::error_code ec;
+        uint64_t size = std::filesystem::exists(path, ec) ? std::filesystem::file_size(path, ec) : 0;
+        // A pack whose first write never committed is started over
+        bool exists = size > 0 && !uncommitted(path, format);
+        if (exists) {
+            if (!existing_.open(path, format)) throw std::runtime_error(std::string("Unable to read existing ") + format.name + " " + path);
+            for (uint32_t id = 0; id < existing_.string_count(); ++id) intern(std::string(existing_.string(id)));
+            for (size_t i = 0; i < existing_.size(); ++i) {
+                entries_[{std::string(existing_.cg_id(i)), existing_.image(i)}] =
+                    {existing_.offset(i), static_cast<uint32_t>(existing_.blob(i).size), existing_.value(i)};
+            }
+            existing_end_ = existing_.committed_bytes();
+            if (size > existing_end_) {
+                std::cerr << "Warning: Discarding " << size - existing_end_ << " bytes an interrupted write left after the index of "
+                    << path << std::endl;
+                std::filesystem::resize_file(path, existing_end_, ec);
+                if (ec) throw std::runtime_error("Unable to truncate " + path + ": " + ec.message());
+            }
+        }
+        out_.open(path, std::ios::binary | (exists ? std::ios::app : std::ios::trunc));
+        if (!out_) throw std::runtime_error("Unable to open " + path + " for writing");
+        end_ = committed_end_ = existing_end_;
+        if (!exists) {
+            PackHeader header{};
+            std::memcpy(header.magic, format.magic, sizeof(header.magic));
+            header.version = format.version;
+            write(&header, sizeof(header));
+        }
+    }
+
+    PackWriter(const PackWriter&) = delete;
+    PackWriter& operator=(const PackWriter&) = delete;
+
+    ~PackWriter() {
+        if (end_ > committed_end_) rollback();
+    }
+
+    uint32_t intern(const std::string& s) {
+        auto it = string_ids_.find(s);
+        if (it != string_ids_.end()) return it->second;
+        uint32_t id = static_cast<uint32_t>(strings_.size());
+        strings_.push_back(s);
+        string_ids_.emplace(s, id);
+        return id;
+    }
+
+    // Whether the image is already packed with exactly these bytes
+    bool unchanged(const std::string& cg_id, uint32_t image, const void* data, size_t size) const {
+        auto it = entries_.find({cg_id, image});
+        // Blobs from before this writer are the ones the existing index points at
+        if (it == entries_.end() || std::get<0>(it->second) >= existing_end_) return false;
+        size_t i = existing_.find(cg_id, image);
+        PackBlob old = existing_.blob(i);
+        return old.size == size && std::memcmp(old.data, data, size) == 0;
+    }
+
+    void add(const std::string& cg_id, uint32_t image, const void* data, size_t size, uint64_t value = 0) {
+        if (size > UINT32_MAX) throw std::runtime_error("blob of " + cg_id + "/image_" + std::to_string(image) + " is too large");
+        intern(cg_id);
+        entries_[{cg_id, image}] = {end_, static_cast<uint32_t>(size), value};
+        write(data, size);
+        changed_ = true;
+    }
+
+    // Append the index of every packed image and the footer; with_values also
+    // stores the per-entry values
+    void commit(bool with_values) {
+        if (!changed_) return;
+        pad();
+        const uint64_t table_offset = end_;
+
+        std::string arena;
+        std::vector<uint32_t> offsets{0};
+        for (const auto& s : strings_) {
+            arena += s;
+            offsets.push_back(static_cast<uint32_t>(arena.size()));
+        }
+        std::vector<uint32_t> cg_ids;
+        std::vector<PackEntry> entries;
+        std::vector<uint64_t> values;
+        for (const auto& [key, location] : entries_) {
+            if (cg_ids.empty() || strings_[cg_ids.back()] != key.first) cg_ids.push_back(string_ids_.at(key.first));
+            entries.push_back({static_cast<uint32_t>(cg_ids.size() - 1), key.second, std::get<0>(location), std::get<1>(location), 0});
+            values.push_back(std::get<2>(location));
+        }
+
+        write_array(offsets.data(), strings_.size(), offsets.size() * sizeof(uint32_t));
+        write(arena.data(), arena.size());
+        pad();
+        write_array(cg_ids.data(), cg_ids.size(), cg_ids.size() * sizeof(uint32_t));
+        write_array(entries.data(), entries.size(), entries.size() * sizeof(PackEntry));
+        if (with_values) write_array(values.data(), values.size(), values.size() * sizeof(uint64_t));
+
+        PackFooter footer{};
+        footer.table_offset = table_offset;
+        footer.table_bytes = end_ - table_offset;
+        std::memcpy(footer.magic, format_.end_magic, sizeof(footer.magic));
+        write(&footer, sizeof(footer));
+        out_.flush();
+        if (!out_ || !sync_file(path_)) {
+            rollback();
+            throw std::runtime_error("Unable to write " + path_);
+        }
+        // Only now that the footer is on disk do readers see it
+        std::fstream header(path_, std::ios::binary | std::ios::in | std::ios::out);
+        header.seekp(offsetof(PackHeader, committed_bytes));
+        header.write(reinterpret_cast<const char*>(&end_), sizeof(end_));
+        header.close();
+        if (!header || !sync_file(path_)) {
+            rollback();
+            throw std::runtime_error("Unable to write the header of " + path_);
+        }
+        committed_end_ = end_;
+        changed_ = false;
+    }
+
+    size_t size() const { return entries_.size(); }
+
+private:
+    void write(const void* data, size_t n) {
+        out_.write(static_cast<const char*>(data), static_cast<std::streamsize>(n));
+        if (!out_) {
+            rollback();
+            throw std::runtime_error("Unable to write " + path_);
+        }
+        end_ += n;
+    }
+
+    // Cut the file back to the last committed footer, dropping the blobs no
+    // index points at; the writer cannot be used afterwards
+    void rollback() {
+        out_.close();
+        std::error_code ec;
+        std::filesystem::resize_file(path_, committed_end_, ec);
+        end_ = committed_end_;
+    }
+
+    // Whether path is a pack of format that never committed an index
+    static bool uncommitted(const std::string& path, const PackFormat& format) {
+        PackHeader header{};
+        std::ifstream in(path, std::ios::binary);
+        in.read(reinterpret_cast<char*>(&header), sizeof(header));
+        return in && std::memcmp(header.magic, format.magic, sizeof(header.magic)) == 0 &&
+               header.version == format.version && header.committed_bytes == 0;
+    }
+
+    void pad() {
+        static const char zeros[8] = {};
+        write(zeros, (8 - end_ % 8) % 8);
+    }
+
+    template <typename T>
+    void write_array(const T* data, uint64_t count, size_t bytes) {
+        write(&count, sizeof(count));
+        write(data, bytes);
+        pad();
+    }
+
+    std::string path_;
+    const PackFormat& format_;
+    PackReader existing_;
+    std::ofstream out_;
+    uint64_t end_ = 0;
+    uint64_t existing_end_ = 0;  // End of the committed part this writer started from
+    uint64_t committed_end_ = 0; // End of the last footer committed, the length a failed write cuts the file back to
+    bool changed_ = false;
+    std::vector<std::string> strings_;
+    std::unordered_map<std::string, uint32_t> string_ids_;
+    std::map<std::pair<std::string, uint32_t>, std::tuple<uint64_t, uint32_t, uint64_t>> entries_; // Blob offset, size, value
+};
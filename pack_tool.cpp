@@ -0,0 +1,162 @@
+// Converts the per-image files into packs (see pack_file.h): the tagger's JSON
+// files (<tag_dir>/<cg_id>/image_<n>.json) into a tag pack, or the webp images
+// (<image_dir>/<cg_id>/image_<n>.webp) into an image pack. Run again after new
+// images were added: only images that are new or changed are appended.
+//
+//   pack_tool tags <tag_dir> <pack_file>
+//   pack_tool images <image_dir> <pack_file>
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "image_pack.h"
+#include "nlohmann/json.hpp"
+#include "tag_pack.h"
+
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+struct SourceFile {
+    std::string cg_id;
+    uint32_t image;
+    fs::path path;
+};
+
+// Categories of one JSON file; false when it cannot be read or parsed
+bool read_tag_file(const fs::path& path, std::vector<TagPackCategory>& categories) {
+    std::ifstream ifs(path);
+    if (!ifs) return false;
+    json j = json::parse(ifs, nullptr, false);
+    if (j.is_discarded()) return false;
+    categories.clear();
+    if (!j.contains("tags") || !j["tags"].is_object()) return true;
+    for (const auto& category_pair : j["tags"].items()) {
+        if (!category_pair.value().is_object()) continue;
+        TagPackCategory category;
+        category.key = category_pair.key();
+        for (const auto& tag : category_pair.value().items()) {
+            if (tag.value().is_number()) category.tags.emplace_back(tag.key(), tag.value().get<float>());
+        }
+        categories.push_back(std::move(category));
+    }
+    return true;
+}
+
+bool read_image_file(const fs::path& path, std::string& bytes) {
+    std::FILE* file = std::fopen(path.string().c_str(), "rb");
+    if (!file) return false;
+    bytes.clear();
+    char chunk[65536];
+    size_t n;
+    while ((n = std::fread(chunk, 1, sizeof(chunk), file)) > 0) bytes.append(chunk, n);
+    bool ok = !std::ferror(file);
+    std::fclose(file);
+    return ok;
+}
+
+// Every <cg_id>/image_<n><extension> below dir, sorted by (cg_id, n) so that
+// neighbouring images stay close in the pack
+bool find_source_files(const fs::path& dir, const std::string& extension, std::vector<SourceFile>& files, size_t& skipped) {
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(dir, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        if (!it->is_regular_file() || it->path().extension() != extension) continue;
+        fs::path relative_path = fs::relative(it->path(), dir);
+        std::string stem = relative_path.stem().string();
+        uint32_t image;
+        if (std::distance(relative_path.begin(), relative_path.end()) != 2 || stem.compare(0, 6, "image_") != 0 ||
+            !parse_image_number(std::string_view(stem).substr(6), image)) {
+            skipped++;
+            continue;
+        }
+        files.push_back({relative_path.begin()->string(), image, it->path()});
+    }
+    if (ec) {
+        std::cerr << "Error: Unable to walk " << dir << ": " << ec.message() << std::endl;
+        return false;
+    }
+    std::sort(files.begin(), files.end(), [](const SourceFile& a, const SourceFile& b) {
+        return a.cg_id != b.cg_id ? a.cg_id < b.cg_id : a.image < b.image;
+    });
+    return true;
+}
+
+// Read files in parallel chunks (over the network this is mostly waiting) and
+// hand them to add(file, content) in order; returns the number added
+template <typename Content, typename Read, typename Add>
+size_t pack_files(const std::vector<SourceFile>& files, Read&& read, Add&& add, size_t& unreadable) {
+    constexpr size_t chunk = 1024;
+    size_t added = 0;
+    std::vector<Content> contents(chunk);
+    std::vector<char> ok(chunk);
+    for (size_t first = 0; first < files.size(); first += chunk) {
+        const int64_t n = static_cast<int64_t>(std::min(chunk, files.size() - first));
+        #pragma omp parallel for schedule(dynamic, 16)
+        for (int64_t k = 0; k < n; ++k) {
+            ok[k] = read(files[first + k].path, contents[k]);
+        }
+        for (int64_t k = 0; k < n; ++k) {
+            const SourceFile& file = files[first + k];
+            if (!ok[k]) {
+                std::cerr << "Warning: Skipping unreadable file " << file.path << std::endl;
+                unreadable++;
+                continue;
+            }
+            if (add(file, contents[k])) added++;
+        }
+        if ((first / chunk) % 50 == 49 || first + chunk >= files.size()) {
+            std::cout << "Packed " << std::min(first + chunk, files.size()) << "/" << files.size() << " files." << std::endl;
+        }
+    }
+    return added;
+}
+
+int main(int argc, char** argv) {
+    const std::string mode = argc == 4 ? argv[1] : "";
+    if (mode != "tags" && mode != "images") {
+        std::cerr << "Usage: " << argv[0] << " tags <tag_dir> <pack_file>" << std::endl;
+        std::cerr << "       " << argv[0] << " images <image_dir> <pack_file>" << std::endl;
+        return 1;
+    }
+    const fs::path source_dir = argv[2];
+    const std::string pack_file = argv[3];
+
+    std::vector<SourceFile> files;
+    size_t skipped = 0, unreadable = 0;
+    const std::string extension = mode == "tags" ? ".json" : ".webp";
+    if (!find_source_files(source_dir, extension, files, skipped)) return 1;
+    std::cout << "Found " << files.size() << " " << extension << " files in " << source_dir << "." << std::endl;
+
+    try {
+        size_t added, packed;
+        if (mode == "tags") {
+            TagPackWriter writer(pack_file);
+            added = pack_files<std::vector<TagPackCategory>>(files, read_tag_file,
+                [&](const SourceFile& file, const std::vector<TagPackCategory>& categories) {
+                    return writer.add(file.cg_id, file.image, categories);
+                }, unreadable);
+            writer.commit();
+            packed = writer.size();
+        } else {
+            ImagePackWriter writer(pack_file);
+            added = pack_files<std::string>(files, read_image_file,
+                [&](const SourceFile& file, const std::string& bytes) {
+                    return writer.add(file.cg_id, file.image, bytes);
+                }, unreadable);
+            writer.commit();
+            packed = writer.size();
+        }
+        std::cout << "Added or updated " << added << " images, " << packed << " images in " << pack_file << "." << std::endl;
+        if (skipped + unreadable > 0) {
+            std::cerr << "Warning: Skipped " << skipped << " files not named <cg_id>/image_<n>" << extension << " and "
+                << unreadable << " unreadable files." << std::endl;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
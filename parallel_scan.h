@@ -0,0 +1,98 @@
+#pragma once
+// Order-preserving parallel loops. The range is cut into fixed-size chunks that
+// OpenMP threads pick up dynamically; every chunk appends its output to its own
+// buffer and the buffers are concatenated in chunk order afterwards, so the
+// result is exactly what the sequential loop would produce. Without -fopenmp
+// the pragmas are ignored and the loop simply runs on the calling thread.
+//
+// Scans run on the HTTP worker threads, several at once under load, so every
+// scan takes an equal share of the cores while it runs instead of a full
+// team each, and scans never nest.
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+constexpr size_t parallel_scan_chunk = 4096;
+
+// Registers a running scan for as long as it lives; threads() is its share of the cores
+class ParallelScanSlot {
+public:
+    ParallelScanSlot() : active_(++running()) {
+#ifdef _OPENMP
+        omp_set_max_active_levels(1);
+#endif
+    }
+    ~ParallelScanSlot() { --running(); }
+
+    ParallelScanSlot(const ParallelScanSlot&) = delete;
+    ParallelScanSlot& operator=(const ParallelScanSlot&) = delete;
+
+    int threads() const {
+#ifdef _OPENMP
+        static const int cores = omp_get_num_procs();
+        return std::max(1, cores / active_);
+#else
+        return 1;
+#endif
+    }
+
+private:
+    static std::atomic<int>& running() {
+        static std::atomic<int> count{0};
+        return count;
+    }
+
+    int active_; // Scans running when this one started, itself included
+};
+
+// Calls visit(i, out) for every i in [0, n); visit may append any number of values to out
+template <typename T, typename Visit>
+std::vector<T> parallel_collect(size_t n, Visit&& visit, size_t chunk = parallel_scan_chunk) {
+    std::vector<T> result;
+    if (n <= chunk) {
+        for (size_t i = 0; i < n; ++i) visit(i, result);
+        return result;
+    }
+
+    const int64_t chunk_count = static_cast<int64_t>((n + chunk - 1) / chunk);
+    std::vector<std::vector<T>> buffers(static_cast<size_t>(chunk_count));
+    ParallelScanSlot slot;
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(slot.threads())
+    for (int64_t c = 0; c < chunk_count; ++c) {
+        size_t first = static_cast<size_t>(c) * chunk;
+        size_t last = std::min(first + chunk, n);
+        auto& out = buffers[static_cast<size_t>(c)];
+        for (size_t i = first; i < last; ++i) visit(i, out);
+    }
+
+    size_t total = 0;
+    for (const auto& buffer : buffers) total += buffer.size();
+    result.reserve(total);
+    for (auto& buffer : buffers) {
+        result.insert(result.end(), buffer.begin(), buffer.end());
+        std::vector<T>().swap(buffer);
+    }
+    return result;
+}
+
+// The ids in [0, n) for which keep(id) holds, in ascending order
+template <typename Keep>
+std::vector<uint32_t> parallel_filter(size_t n, Keep&& keep) {
+    return parallel_collect<uint32_t>(n, [&](size_t i, std::vector<uint32_t>& out) {
+        if (keep(static_cast<uint32_t>(i))) out.push_back(static_cast<uint32_t>(i));
+    });
+}
+
+// The elements of ids for which keep(id) holds, in their original order
+template <typename Keep>
+std::vector<uint32_t> parallel_filter(const std::vector<uint32_t>& ids, Keep&& keep) {
+    return parallel_collect<uint32_t>(ids.size(), [&](size_t i, std::vector<uint32_t>& out) {
+        if (keep(ids[i])) out.push_back(ids[i]);
+    });
+}
@@ -0,0 +1,111 @@
+#pragma once
+// Background workers that warm image storage ahead of the client: after a
+// search the browser requests the images of the page it shows and then those
+// of the next page, so the handlers queue these paths here and the workers
+// fetch them before the requests arrive. The queue is bounded (the oldest
+// paths are dropped first). Queued paths are tagged with the client they are
+// for, and a new search cancels only what that client's earlier searches
+// still have queued, since its newest search is the page it is painting;
+// other clients' read-ahead stays queued.
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct PrefetchStats {
+    uint64_t queued = 0;
+    uint64_t fetched = 0;
+    uint64_t dropped = 0;   // Pushed out of the full queue
+    uint64_t cancelled = 0; // Discarded by a newer search of the same client
+};
+
+class Prefetcher {
+public:
+    using Fetch = std::function<void(const std::string&)>;
+
+    Prefetcher(size_t capacity, int threads, Fetch fetch) : capacity_(capacity), fetch_(std::move(fetch)) {
+        for (int i = 0; i < threads; ++i) workers_.emplace_back([this] { run(); });
+    }
+
+    Prefetcher(const Prefetcher&) = delete;
+    Prefetcher& operator=(const Prefetcher&) = delete;
+
+    ~Prefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (auto& worker : workers_) worker.join();
+    }
+
+    // Queue paths for owner behind the ones already waiting
+    void enqueue(const std::string& owner, const std::vector<std::string>& paths) {
+        if (paths.empty() || workers_.empty()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const auto& path : paths) {
+                queue_.push_back({path, owner});
+                stats_.queued++;
+            }
+            while (queue_.size() > capacity_) {
+                queue_.pop_front();
+                stats_.dropped++;
+            }
+        }
+        ready_.notify_all();
+    }
+
+    // Discard the paths queued for owner; fetches already running finish
+    void cancel(const std::string& owner) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t before = queue_.size();
+        queue_.erase(std::remove_if(queue_.begin(), queue_.end(), [&](const Entry& e) { return e.owner == owner; }), queue_.end());
+        stats_.cancelled += before - queue_.size();
+    }
+
+    PrefetchStats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    struct Entry {
+        std::string path;
+        std::string owner;
+    };
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (stopping_) return;
+            std::string path = std::move(queue_.front().path);
+            queue_.pop_front();
+            lock.unlock();
+            try {
+                fetch_(path);
+            } catch (const std::exception& e) {
+                std::cerr << "Warning: Prefetching " << path << " failed: " << e.what() << std::endl;
+            }
+            lock.lock();
+            stats_.fetched++;
+        }
+    }
+
+    size_t capacity_;
+    Fetch fetch_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<Entry> queue_;
+    bool stopping_ = false;
+    PrefetchStats stats_;
+    std::vector<std::thread> workers_;
+};
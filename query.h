@@ -0,0 +1,440 @@
+#pragma once
+// Search query compiler. The tag list from split() is compiled once into a
+// small AST whose terms carry resolved tag ids; the AST is then evaluated
+// either as bitmap operations over the TagIndex or image by image.
+//
+// Grammar (',' binds tighter than '|'):
+//   query    := and_list ('|' and_list)*
+//   and_list := unary (',' unary)*
+//   unary    := '-' unary | '(' query ')' | '[' any_list ']' | term
+//   any_list := unary ((',' | '|') unary)*        every member is OR'ed
+//   term     := tag | tag ':' min | tag ':' [min] '..' [max]
+//
+// Parentheses inside a tag name such as "saber_(fate)" stay part of the name;
+// a ')' only closes a group when a '(' group is open and the tag's own
+// parentheses are balanced. Likewise '|' is part of a tag such as ":|" or
+// "\||/" when the compiler is given the dictionary: the longest dictionary
+// tag starting at a term wins, and '|' is an operator everywhere else.
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "parallel_scan.h"
+#include "tag_index.h"
+
+inline std::pair<std::string, float> parse_tag_and_score(const std::string& input) {
+    size_t pos = input.rfind(':');
+    if (pos == std::string::npos) {
+        return {input, 0.0f};
+    }
+
+    std::string possible_score = input.substr(pos + 1);
+    char* endptr = nullptr;
+    float score = std::strtof(possible_score.c_str(), &endptr);
+
+    // "nan" and "inf" parse, but are no score a tag can be compared with
+    if (endptr != nullptr && *endptr == '\0' && std::isfinite(score)) {
+        std::string tag = input.substr(0, pos);
+        return {tag, score};
+    } else {
+        return {input, 0.0f};
+    }
+}
+
+// Inclusive score bounds of a search term. Scores are compared in quantized
+// form on every path, the index's and the scans', so a query matches the same
+// images whichever plan runs it: a score matches when its quantized value is
+// at least the bound, as it would match score >= bound unquantized.
+struct ScoreRange {
+    float min_score = 0.0f;
+    float max_score = std::numeric_limits<float>::infinity();
+
+    uint16_t min_q() const { return quantize_score_ceil(min_score); }
+    uint16_t max_q() const { return quantize_score_floor(max_score); }
+
+    bool contains(float score) const {
+        uint16_t q = quantize_score(score);
+        return q >= min_q() && q <= max_q();
+    }
+    bool is_presence() const { return min_score <= 0.0f && max_score == std::numeric_limits<float>::infinity(); }
+    bool is_empty() const { return min_score > 1.0f || max_score < 0.0f || min_score > max_score || min_q() > max_q(); }
+};
+
+// Accepts "tag", "tag:0.7" (minimum score) and "tag:0.3..0.7" (score range, either bound may be omitted)
+inline std::pair<std::string, ScoreRange> parse_tag_and_score_range(const std::string& input) {
+    size_t pos = input.rfind(':');
+    size_t dots = pos == std::string::npos ? std::string::npos : input.find("..", pos + 1);
+    if (dots == std::string::npos) {
+        auto [tag, score] = parse_tag_and_score(input);
+        ScoreRange range;
+        range.min_score = score;
+        return {tag, range};
+    }
+
+    auto parse_bound = [](const std::string& text, float fallback, bool& ok) {
+        if (text.empty()) return fallback;
+        char* endptr = nullptr;
+        float value = std::strtof(text.c_str(), &endptr);
+        ok = ok && endptr != nullptr && *endptr == '\0' && std::isfinite(value);
+        return value;
+    };
+    bool ok = true;
+    ScoreRange range;
+    range.min_score = parse_bound(input.substr(pos + 1, dots - pos - 1), 0.0f, ok);
+    range.max_score = parse_bound(input.substr(dots + 2), std::numeric_limits<float>::infinity(), ok);
+    if (!ok) {
+        return {input, ScoreRange()};
+    }
+    return {input.substr(0, pos), range};
+}
+
+// Lowercase, spaces replaced by '_', the way tags are stored
+inline std::string normalize_tag_name(std::string name) {
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    std::replace(name.begin(), name.end(), ' ', '_');
+    return name;
+}
+
+struct QueryNode {
+    enum class Kind { Term, And, Or, Not };
+    // How an And node is evaluated against the index, chosen by plan_query()
+    enum class Strategy {
+        Intersect,      // Materialize every child and AND/ANDNOT the bitmaps
+        FilteredScan    // Materialize the first child, verify the others image by image
+    };
+
+    Kind kind = Kind::Term;
+    std::string tag;          // Term: lowercase, spaces replaced by '_'
+    int32_t tag_id = -1;      // Term: id in the TagIndex, -1 when unknown
+    ScoreRange range;         // Term
+    std::vector<QueryNode> children;
+
+    // Filled in by plan_query()
+    Strategy strategy = Strategy::Intersect;
+    double cardinality = 0.0; // Estimated number of matching images
+    double cost = 0.0;        // Estimated evaluation cost in bitmap word operations
+
+    static QueryNode make(Kind kind) {
+        QueryNode node;
+        node.kind = kind;
+        return node;
+    }
+};
+
+class QueryCompiler {
+public:
+    // is_tag(name) tells whether a normalized name is in the dictionary; without
+    // it every '|' is an operator
+    using IsTag = std::function<bool(const std::string&)>;
+
+    explicit QueryCompiler(std::string text, IsTag is_tag = nullptr)
+        : text_(std::move(text)), is_tag_(std::move(is_tag)) {}
+
+    QueryNode compile() {
+        QueryNode root = parse_query();
+        if (peek() != '\0') {
+            fail(std::string("Unexpected '") + text_[pos_] + "'");
+        }
+        simplify(root);
+        return root;
+    }
+
+private:
+    std::string text_;
+    IsTag is_tag_;
+    size_t pos_ = 0;
+    int paren_depth_ = 0;
+
+    [[noreturn]] void fail(const std::string& message) const {
+        throw std::invalid_argument(message + " at position " + std::to_string(pos_) + " of query");
+    }
+
+    char peek() {
+        while (pos_ < text_.size() && ::isspace(static_cast<unsigned char>(text_[pos_]))) ++pos_;
+        return pos_ < text_.size() ? text_[pos_] : '\0';
+    }
+
+    bool accept(char c) {
+        if (peek() != c) return false;
+        ++pos_;
+        return true;
+    }
+
+    // Empty list entries such as "a,,b" or "[a, ]" are skipped
+    bool at_item_end() {
+        char c = peek();
+        if (c == '|') return term_end() == pos_; // Unless a tag such as "|_|" starts here
+        return c == '\0' || c == ',' || c == '|' || c == ']' || (c == ')' && paren_depth_ > 0);
+    }
+
+    QueryNode parse_query() {
+        QueryNode any = QueryNode::make(QueryNode::Kind::Or);
+        do {
+            any.children.push_back(parse_and_list());
+        } while (accept('|'));
+        return any;
+    }
+
+    QueryNode parse_and_list() {
+        QueryNode all = QueryNode::make(QueryNode::Kind::And);
+        do {
+            if (!at_item_end()) all.children.push_back(parse_unary());
+        } while (accept(','));
+        if (all.children.empty()) fail("Expected a tag");
+        return all;
+    }
+
+    QueryNode parse_unary() {
+        char c = peek();
+        if (c == '-') {
+            ++pos_;
+            QueryNode negated = QueryNode::make(QueryNode::Kind::Not);
+            negated.children.push_back(parse_unary());
+            return negated;
+        }
+        if (c == '(') {
+            ++pos_;
+            ++paren_depth_;
+            QueryNode group = parse_query();
+            if (!accept(')')) fail("Missing ')'");
+            --paren_depth_;
+            return group;
+        }
+        if (c == '[') {
+            ++pos_;
+            QueryNode any = QueryNode::make(QueryNode::Kind::Or);
+            do {
+                if (!at_item_end()) any.children.push_back(parse_unary());
+            } while (accept(',') || accept('|'));
+            if (!accept(']')) fail("Missing ']'");
+            return any;
+        }
+        return parse_term();
+    }
+
+    // End of the term starting at pos_: the first ',', '[', ']', '|' or group
+    // closing ')', or past the last '|' of the longest dictionary tag there
+    size_t term_end() const {
+        size_t first_break = std::string::npos;
+        size_t longest_tag = std::string::npos;
+        int depth = 0;
+        for (size_t end = pos_;; ++end) {
+            char c = end < text_.size() ? text_[end] : '\0';
+            bool closes_group = c == ')' && depth == 0 && paren_depth_ > 0;
+            if (c == '\0' || c == ',' || c == '|' || c == '[' || c == ']' || closes_group) {
+                if (first_break == std::string::npos) {
+                    first_break = end;
+                    if (!is_tag_) break;
+                } else if (is_tag_(term_at(pos_, end).first)) {
+                    longest_tag = end;
+                }
+                if (c != '|') break;
+            } else if (c == '(') {
+                ++depth;
+            } else if (c == ')' && depth > 0) {
+                --depth;
+            }
+        }
+        return longest_tag != std::string::npos ? longest_tag : first_break;
+    }
+
+    // Normalized tag name and score range of text_[begin, end)
+    std::pair<std::string, ScoreRange> term_at(size_t begin, size_t end) const {
+        std::string text = text_.substr(begin, end - begin);
+        text.erase(text.find_last_not_of(" \n\r\t") + 1);
+        auto [input_tag_name, input_range] = parse_tag_and_score_range(text);
+        return {normalize_tag_name(std::move(input_tag_name)), input_range};
+    }
+
+    QueryNode parse_term() {
+        size_t start = pos_;
+        pos_ = term_end();
+        if (text_.find_first_not_of(" \n\r\t", start) >= pos_) fail("Expected a tag");
+
+        QueryNode term;
+        std::tie(term.tag, term.range) = term_at(start, pos_);
+        return term;
+    }
+
+    // Collapse single-child groups, merge nested groups of the same kind and drop double negations
+    static void simplify(QueryNode& node) {
+        for (auto& child : node.children) simplify(child);
+        if (node.kind == QueryNode::Kind::And || node.kind == QueryNode::Kind::Or) {
+            std::vector<QueryNode> flat;
+            for (auto& child : node.children) {
+                if (child.kind == node.kind) {
+                    for (auto& grandchild : child.children) flat.push_back(std::move(grandchild));
+                } else {
+                    flat.push_back(std::move(child));
+                }
+            }
+            node.children = std::move(flat);
+            if (node.children.size() == 1) {
+                QueryNode only = std::move(node.children[0]);
+                node = std::move(only);
+            }
+        } else if (node.kind == QueryNode::Kind::Not && node.children[0].kind == QueryNode::Kind::Not) {
+            QueryNode inner = std::move(node.children[0].children[0]);
+            node = std::move(inner);
+        }
+    }
+};
+
+// Compile the comma separated tag list returned by split(); is_tag as for QueryCompiler
+inline QueryNode compile_query(const std::vector<std::string>& input_tags, QueryCompiler::IsTag is_tag = nullptr) {
+    std::string text;
+    for (const auto& tag : input_tags) {
+        if (!text.empty()) text += ',';
+        text += tag;
+    }
+    return QueryCompiler(text, std::move(is_tag)).compile();
+}
+
+// Canonical text of a compiled query, equal for queries that differ only in
+// case, spaces versus underscores, the order or repetition of AND/OR members,
+// or how a score bound is written. Thresholds are compared in quantized form,
+// the way the index evaluates them. Control characters delimit the structure
+// so that no tag name can collide with it.
+inline std::string canonical_query(const QueryNode& node) {
+    switch (node.kind) {
+    case QueryNode::Kind::Term: {
+        if (node.range.is_empty()) return node.tag + "\x1f-";
+        uint16_t min_q = node.range.min_q();
+        uint16_t max_q = node.range.max_q();
+        if (min_q == 0 && max_q == 65535) return node.tag;
+        return node.tag + "\x1f" + std::to_string(min_q) + "-" + std::to_string(max_q);
+    }
+    case QueryNode::Kind::Not:
+        return "\x01" + canonical_query(node.children[0]);
+    case QueryNode::Kind::And:
+    case QueryNode::Kind::Or: {
+        std::vector<std::string> parts;
+        for (const auto& child : node.children) parts.push_back(canonical_query(child));
+        std::sort(parts.begin(), parts.end());
+        parts.erase(std::unique(parts.begin(), parts.end()), parts.end());
+        if (parts.size() == 1) return parts[0];
+        std::string text(1, node.kind == QueryNode::Kind::And ? '\x02' : '\x03');
+        for (const auto& part : parts) text += part + "\x1e";
+        return text + '\x04';
+    }
+    }
+    return std::string();
+}
+
+// find_tag(name) returns the tag's id, or -1 when it is unknown
+template <typename FindTag>
+void resolve_tags(QueryNode& node, FindTag&& find_tag) {
+    if (node.kind == QueryNode::Kind::Term) {
+        node.tag_id = find_tag(node.tag);
+    }
+    for (auto& child : node.children) resolve_tags(child, find_tag);
+}
+
+// Presence terms map straight onto a posting list and need no copy
+inline const Bitmap* direct_postings(const QueryNode& node, const TagIndex& index) {
+    if (node.kind != QueryNode::Kind::Term || node.tag_id < 0 || !node.range.is_presence()) {
+        return nullptr;
+    }
+    return &index.postings(static_cast<uint32_t>(node.tag_id));
+}
+
+// Evaluate for a single image; score_of(term) returns the image's score for term.tag, if any
+template <typename ScoreOf>
+bool matches_query(const QueryNode& node, ScoreOf&& score_of) {
+    switch (node.kind) {
+    case QueryNode::Kind::Term: {
+        std::optional<float> score = score_of(node);
+        return score.has_value() && node.range.contains(score.value());
+    }
+    case QueryNode::Kind::Not:
+        return !matches_query(node.children[0], score_of);
+    case QueryNode::Kind::Or:
+        for (const auto& child : node.children) {
+            if (matches_query(child, score_of)) return true;
+        }
+        return false;
+    case QueryNode::Kind::And:
+        for (const auto& child : node.children) {
+            if (!matches_query(child, score_of)) return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Evaluate against the index. Children are visited in the order the planner left
+// them; image_score_of(image_id, term) is only used by FilteredScan nodes.
+template <typename ImageScoreOf>
+Bitmap evaluate_query(const QueryNode& node, const TagIndex& index, ImageScoreOf&& image_score_of) {
+    switch (node.kind) {
+    case QueryNode::Kind::Term: {
+        if (node.tag_id < 0 || node.range.is_empty()) {
+            return Bitmap();
+        }
+        if (const Bitmap* postings = direct_postings(node, index)) {
+            return *postings;
+        }
+        return index.postings_in_range(static_cast<uint32_t>(node.tag_id), node.range.min_q(), node.range.max_q());
+    }
+    case QueryNode::Kind::Not:
+        return index.all_images() - evaluate_query(node.children[0], index, image_score_of);
+    case QueryNode::Kind::Or: {
+        Bitmap matches;
+        for (const auto& child : node.children) {
+            matches = matches | evaluate_query(child, index, image_score_of);
+        }
+        return matches;
+    }
+    case QueryNode::Kind::And: {
+        if (node.strategy == QueryNode::Strategy::FilteredScan) {
+            const Bitmap* candidates = direct_postings(node.children[0], index);
+            Bitmap evaluated;
+            if (!candidates) {
+                evaluated = evaluate_query(node.children[0], index, image_score_of);
+                candidates = &evaluated;
+            }
+            // Candidates are verified in parallel, image_score_of must be safe to call concurrently
+            std::vector<uint32_t> matches = parallel_filter(candidates->to_vector(), [&](uint32_t image_id) {
+                auto score_of = [&](const QueryNode& term) { return image_score_of(image_id, term); };
+                for (size_t k = 1; k < node.children.size(); ++k) {
+                    if (!matches_query(node.children[k], score_of)) return false;
+                }
+                return true;
+            });
+            return Bitmap::from_sorted(matches.data(), matches.size());
+        }
+
+        // Negated children become ANDNOT against what has matched so far
+        Bitmap matches;
+        bool first = true;
+        for (const auto& child : node.children) {
+            bool exclude = child.kind == QueryNode::Kind::Not;
+            const QueryNode& operand = exclude ? child.children[0] : child;
+            const Bitmap* postings = direct_postings(operand, index);
+            Bitmap evaluated;
+            if (!postings) {
+                evaluated = evaluate_query(operand, index, image_score_of);
+                postings = &evaluated;
+            }
+            if (exclude) {
+                matches = (first ? index.all_images() : matches) - *postings;
+            } else {
+                matches = first ? *postings : matches & *postings;
+            }
+            first = false;
+            if (matches.empty()) break;
+        }
+        return matches;
+    }
+    }
+    return Bitmap();
+}
+
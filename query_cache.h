@@ -0,0 +1,105 @@
+#pragma once
+// LRU cache of search results keyed by canonical_query(). Entries hold the
+// matching base segment rows as a compressed bitmap, so queries without
+// matches are cached as well. Which images exist, the ingested images and the
+// tombstones are applied to a hit on every request, so ingesting and image
+// rescans leave the entries valid. The cache is bounded by the bytes its
+// entries occupy, and each entry records the base generation it was computed
+// for: once the data reloads or a compaction renumbers the rows, older
+// entries count as misses and are dropped.
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "bitmap.h"
+
+struct CachedQuery {
+    Bitmap matches; // Base rows with matching tags, whether or not their image exists
+};
+
+struct QueryCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t max_bytes = 0;
+};
+
+class QueryCache {
+public:
+    explicit QueryCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+    std::shared_ptr<const CachedQuery> get(const std::string& key, uint64_t generation) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(key);
+        if (it == index_.end() || it->second->generation != generation) {
+            if (it != index_.end()) erase(it->second);
+            ++misses_;
+            return nullptr;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second);
+        ++hits_;
+        return it->second->result;
+    }
+
+    // Results larger than the whole cache are not stored
+    void put(const std::string& key, uint64_t generation, std::shared_ptr<const CachedQuery> result) {
+        size_t bytes = entry_bytes(key, *result);
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(key);
+        if (it != index_.end()) erase(it->second);
+        if (bytes > max_bytes_) return;
+        lru_.push_front(Entry{key, generation, std::move(result), bytes});
+        index_[key] = lru_.begin();
+        bytes_ += bytes;
+        while (bytes_ > max_bytes_) {
+            erase(std::prev(lru_.end()));
+            ++evictions_;
+        }
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        lru_.clear();
+        index_.clear();
+        bytes_ = 0;
+    }
+
+    QueryCacheStats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return {hits_, misses_, evictions_, lru_.size(), bytes_, max_bytes_};
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        uint64_t generation;
+        std::shared_ptr<const CachedQuery> result;
+        size_t bytes;
+    };
+
+    static size_t entry_bytes(const std::string& key, const CachedQuery& result) {
+        // Key stored twice (list and map) plus node overhead
+        return 2 * key.size() + sizeof(Entry) + sizeof(CachedQuery) + 64 + result.matches.size_in_bytes();
+    }
+
+    void erase(std::list<Entry>::iterator entry) {
+        bytes_ -= entry->bytes;
+        index_.erase(entry->key);
+        lru_.erase(entry);
+    }
+
+    size_t max_bytes_;
+    std::mutex mutex_;
+    std::list<Entry> lru_; // Most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+    size_t bytes_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t evictions_ = 0;
+};
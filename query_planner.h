@@ -0,0 +1,177 @@
+#pragma once
+// Cost-based planning for compiled queries. plan_query() estimates how many
+// images every node matches, reorders AND/OR children so the most selective
+// work happens first, and decides per AND node whether to intersect posting
+// bitmaps or to materialize only the most selective child and verify the rest
+// image by image.
+#include <algorithm>
+
+#include "query.h"
+#include "tag_dictionary.h"
+
+class TermEstimator {
+public:
+    virtual ~TermEstimator() = default;
+    // Number of images a query can range over
+    virtual double universe() const = 0;
+    // Estimated number of images matching one Term node
+    virtual double term_cardinality(const QueryNode& term) const = 0;
+};
+
+// Exact counts read from the posting lists
+class IndexEstimator : public TermEstimator {
+public:
+    explicit IndexEstimator(const TagIndex& index)
+        : index_(index), universe_(static_cast<double>(index.all_images().cardinality())) {}
+
+    double universe() const override { return universe_; }
+
+    double term_cardinality(const QueryNode& term) const override {
+        if (term.tag_id < 0 || term.range.is_empty()) return 0.0;
+        uint32_t tag_id = static_cast<uint32_t>(term.tag_id);
+        if (term.range.is_presence()) return static_cast<double>(index_.postings(tag_id).cardinality());
+        return static_cast<double>(index_.count_in_range(tag_id, term.range.min_q(), term.range.max_q()));
+    }
+
+private:
+    const TagIndex& index_;
+    double universe_;
+};
+
+// Per-tag image counts kept in the tag dictionary (tag_statistics_250807.csv).
+// Used when there is no index to ask, which is the uncached directory walk.
+class StatisticsEstimator : public TermEstimator {
+public:
+    explicit StatisticsEstimator(const TagDictionary& dictionary) : dictionary_(dictionary) {
+        // Every image is counted under exactly one rating tag, so those add up to the dataset size
+        for (size_t id = 0; id < dictionary_.size(); ++id) {
+            double count = dictionary_.count(static_cast<uint16_t>(id));
+            if (dictionary_.category(static_cast<uint16_t>(id)) == TagStore::category_rating) universe_ += count;
+            max_count_ = std::max(max_count_, count);
+        }
+        universe_ = std::max({universe_, max_count_, 1.0});
+    }
+
+    double universe() const override { return universe_; }
+
+    double term_cardinality(const QueryNode& term) const override {
+        if (term.tag_id < 0 || term.range.is_empty()) return 0.0;
+        double count = dictionary_.count(static_cast<uint16_t>(term.tag_id));
+        if (term.range.is_presence()) return count;
+        // Assume scores spread evenly over [0, 1]
+        double width = static_cast<double>(std::min(term.range.max_score, 1.0f) - std::max(term.range.min_score, 0.0f));
+        return count * std::clamp(width, 0.0, 1.0);
+    }
+
+private:
+    const TagDictionary& dictionary_;
+    double universe_ = 0.0;
+    double max_count_ = 0.0;
+};
+
+struct PlanCosts {
+    // Verifying one term on one image, relative to one bitmap word operation
+    double image_check = 16.0;
+};
+
+namespace query_plan_detail {
+
+// Touching a posting of c ids costs about c array entries, or U / 64 words once it is a bitset
+inline double bitmap_cost(double cardinality, double universe) {
+    return std::min(cardinality, universe / 64.0);
+}
+
+inline size_t term_count(const QueryNode& node) {
+    if (node.kind == QueryNode::Kind::Term) return 1;
+    size_t n = 0;
+    for (const auto& child : node.children) n += term_count(child);
+    return n;
+}
+
+// Fraction of the images reaching an AND child that survive it
+inline double survival(const QueryNode& node, double universe) {
+    return universe > 0.0 ? node.cardinality / universe : 0.0;
+}
+
+// Cost of folding a child into an intersection: negated children are applied
+// as ANDNOT of their operand instead of materializing the complement
+inline double intersect_cost(const QueryNode& child, double universe) {
+    const QueryNode& operand = child.kind == QueryNode::Kind::Not ? child.children[0] : child;
+    return operand.cost + bitmap_cost(operand.cardinality, universe);
+}
+
+inline void plan(QueryNode& node, const TermEstimator& estimator, const PlanCosts& costs) {
+    const double universe = estimator.universe();
+    for (auto& child : node.children) plan(child, estimator, costs);
+
+    switch (node.kind) {
+    case QueryNode::Kind::Term: {
+        node.cardinality = estimator.term_cardinality(node);
+        // Score ranges slice the score-sorted postings and scatter them into a bitmap
+        node.cost = node.range.is_presence() ? 0.0 : node.cardinality;
+        break;
+    }
+    case QueryNode::Kind::Not:
+        node.cardinality = std::max(0.0, universe - node.children[0].cardinality);
+        node.cost = node.children[0].cost + bitmap_cost(universe, universe);
+        break;
+    case QueryNode::Kind::Or: {
+        // Likeliest alternatives first so per-image checks stop early
+        std::stable_sort(node.children.begin(), node.children.end(),
+            [](const QueryNode& a, const QueryNode& b) { return a.cardinality > b.cardinality; });
+        double miss = 1.0;
+        node.cost = 0.0;
+        for (const auto& child : node.children) {
+            miss *= 1.0 - survival(child, universe);
+            node.cost += child.cost + bitmap_cost(child.cardinality, universe);
+        }
+        node.cardinality = universe * (1.0 - miss);
+        break;
+    }
+    case QueryNode::Kind::And: {
+        // Most selective include drives the evaluation; everything else,
+        // exclusions included, follows in order of how much it filters out
+        auto driver = node.children.end();
+        for (auto it = node.children.begin(); it != node.children.end(); ++it) {
+            if (it->kind != QueryNode::Kind::Not && (driver == node.children.end() || it->cardinality < driver->cardinality)) {
+                driver = it;
+            }
+        }
+        if (driver != node.children.end()) {
+            std::rotate(node.children.begin(), driver, driver + 1);
+        }
+        size_t first = driver != node.children.end() ? 1 : 0;
+        std::stable_sort(node.children.begin() + first, node.children.end(),
+            [&](const QueryNode& a, const QueryNode& b) { return survival(a, universe) < survival(b, universe); });
+
+        double keep = 1.0;
+        double intersect = 0.0;
+        for (const auto& child : node.children) {
+            keep *= survival(child, universe);
+            intersect += intersect_cost(child, universe);
+        }
+        node.cardinality = universe * keep;
+        node.cost = intersect;
+        node.strategy = QueryNode::Strategy::Intersect;
+
+        if (first == 1 && node.children.size() > 1) {
+            const QueryNode& lead = node.children[0];
+            size_t checks = 0;
+            for (size_t k = 1; k < node.children.size(); ++k) checks += term_count(node.children[k]);
+            double scan = lead.cost + bitmap_cost(lead.cardinality, universe) +
+                          lead.cardinality * static_cast<double>(checks) * costs.image_check;
+            if (scan < intersect) {
+                node.strategy = QueryNode::Strategy::FilteredScan;
+                node.cost = scan;
+            }
+        }
+        break;
+    }
+    }
+}
+
+} // namespace query_plan_detail
+
+inline void plan_query(QueryNode& query, const TermEstimator& estimator, const PlanCosts& costs = PlanCosts()) {
+    query_plan_detail::plan(query, estimator, costs);
+}
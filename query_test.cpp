@@ -0,0 +1,80 @@
+// Checks of the query compiler: ctest --test-dir <build dir>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+#include <string>
+
+#include "query.h"
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+// Tags with '|' from data/selected_tags.csv, plus a few plain ones
+static const std::set<std::string> dictionary = {":|", "\\||/", "|_|", "<|>_<|>", "smile", "1girl", "long_hair"};
+
+static QueryNode compile(const std::string& text) {
+    return QueryCompiler(text, [](const std::string& tag) { return dictionary.count(tag) > 0; }).compile();
+}
+
+static bool is_term(const QueryNode& node, const std::string& tag) {
+    return node.kind == QueryNode::Kind::Term && node.tag == tag;
+}
+
+int main() {
+    QueryNode node = compile(":|");
+    check(is_term(node, ":|"), "\":|\" is one tag");
+
+    node = compile(":|:0.5");
+    check(is_term(node, ":|") && node.range.min_score == 0.5f, "\":|:0.5\" is a tag with a minimum score");
+
+    node = compile(":| | smile");
+    check(node.kind == QueryNode::Kind::Or && node.children.size() == 2 && is_term(node.children[0], ":|") &&
+              is_term(node.children[1], "smile"),
+        "\":| | smile\" is an OR of \":|\" and smile");
+
+    node = compile("smile, \\||/, -|_|");
+    check(node.kind == QueryNode::Kind::And && node.children.size() == 3 && is_term(node.children[1], "\\||/") &&
+              node.children[2].kind == QueryNode::Kind::Not && is_term(node.children[2].children[0], "|_|"),
+        "tags with '|' inside an AND list and after '-'");
+
+    node = compile("[<|>_<|>, :|]");
+    check(node.kind == QueryNode::Kind::Or && node.children.size() == 2 && is_term(node.children[0], "<|>_<|>"),
+        "tags with '|' inside an any list");
+
+    node = compile("smile|long_hair");
+    check(node.kind == QueryNode::Kind::Or && node.children.size() == 2, "'|' between plain tags is still an OR");
+
+    // Scans and the index agree on thresholds: a stored score matches when its value reaches the bound
+    node = compile("smile:0.35");
+    check(!node.range.contains(dequantize_score(22937)) && node.range.min_q() == 22938 &&
+              node.range.contains(dequantize_score(22938)),
+        "\"smile:0.35\" matches exactly the quantized scores of at least 0.35");
+    node = compile("smile:0.5..0.5");
+    check(node.range.is_empty(), "a range between two quantized scores is empty");
+
+    // "nan" and "inf" are no bounds; the whole term is then a tag name
+    node = compile("smile:nan");
+    check(is_term(node, "smile:nan") && node.range.is_presence(), "\"smile:nan\" is a tag name, not a score");
+    node = compile("smile:0.3..nan");
+    check(is_term(node, "smile:0.3..nan") && node.range.is_presence(), "\"smile:0.3..nan\" is a tag name");
+    node = compile("smile:-inf..0.5");
+    check(is_term(node, "smile:-inf..0.5") && node.range.is_presence(), "\"smile:-inf..0.5\" is a tag name");
+
+    // Without the dictionary every '|' is an operator
+    bool rejected = false;
+    try {
+        QueryCompiler(":|").compile();
+    } catch (const std::invalid_argument&) {
+        rejected = true;
+    }
+    check(rejected, "\":|\" without a dictionary is rejected");
+
+    if (failures == 0) std::cout << "All query checks passed." << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,152 @@
+#pragma once
+// What stays in memory in out-of-core mode, where the tag store and index are
+// views into mapped segment files and the kernel pages them in and out.
+// Searches count how often each tag is queried (TagHeat); a periodic pass then
+// locks the postings of the most queried tags with mlock up to a byte budget
+// and lets go of the ones that cooled off, marking them MADV_COLD so they are
+// reclaimed before anything else. Queried tags beyond the budget get
+// MADV_WILLNEED so their pages are read ahead of the next query. A query on a
+// cold tag still works; it waits for its pages instead of failing.
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Decaying per-tag query counts, safe to add to from any thread
+class TagHeat {
+public:
+    explicit TagHeat(size_t tag_count) : counts_(tag_count) {}
+
+    void add(uint32_t tag_id) {
+        if (tag_id < counts_.size()) counts_[tag_id].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::vector<uint64_t> counts() const {
+        std::vector<uint64_t> counts(counts_.size());
+        for (size_t i = 0; i < counts.size(); ++i) counts[i] = counts_[i].load(std::memory_order_relaxed);
+        return counts;
+    }
+
+    // The counts so far, halving them so older queries weigh less every time
+    std::vector<uint64_t> decay() {
+        std::vector<uint64_t> counts(counts_.size());
+        for (size_t i = 0; i < counts.size(); ++i) {
+            counts[i] = counts_[i].load(std::memory_order_relaxed);
+            counts_[i].fetch_sub(counts[i] - counts[i] / 2, std::memory_order_relaxed);
+        }
+        return counts;
+    }
+
+private:
+    std::vector<std::atomic<uint64_t>> counts_;
+};
+
+// Mark mapped data that is read a little at a time in no particular order,
+// like the tags of one image: reading around it would only fill the page cache
+inline void advise_random(const void* data, size_t bytes) {
+#ifdef __linux__
+    if (!data || bytes == 0) return;
+    const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    uintptr_t begin = reinterpret_cast<uintptr_t>(data) & ~(page - 1);
+    madvise(reinterpret_cast<void*>(begin), reinterpret_cast<uintptr_t>(data) + bytes - begin, MADV_RANDOM);
+#else
+    (void)data;
+    (void)bytes;
+#endif
+}
+
+// The pages of a mapping kept locked in memory. Not thread safe; one
+// background pass owns it.
+class PinnedPages {
+public:
+    using Range = std::pair<const void*, size_t>; // Data and bytes
+
+    PinnedPages() = default;
+    PinnedPages(const PinnedPages&) = delete;
+    PinnedPages& operator=(const PinnedPages&) = delete;
+    ~PinnedPages() { update({}); }
+
+    // Lock the pages of ranges and unlock the ones locked before that are not
+    // among them; returns the bytes now locked
+    size_t update(const std::vector<Range>& ranges) {
+        std::vector<Span> next = to_pages(ranges);
+        for (const Span& span : subtract(pages_, next)) {
+#ifdef __linux__
+            munlock(reinterpret_cast<void*>(span.first), span.second - span.first);
+#ifdef MADV_COLD
+            madvise(reinterpret_cast<void*>(span.first), span.second - span.first, MADV_COLD);
+#endif
+#endif
+        }
+        for (const Span& span : subtract(next, pages_)) {
+#ifdef __linux__
+            if (mlock(reinterpret_cast<void*>(span.first), span.second - span.first) != 0) {
+                // Over RLIMIT_MEMLOCK: at least read them in
+                if (!lock_failed_) {
+                    std::cerr << "Warning: Unable to lock hot postings in memory (raise ulimit -l); reading them ahead instead." << std::endl;
+                }
+                lock_failed_ = true;
+                madvise(reinterpret_cast<void*>(span.first), span.second - span.first, MADV_WILLNEED);
+            }
+#endif
+        }
+        pages_ = std::move(next);
+        size_t bytes = 0;
+        for (const Span& span : pages_) bytes += span.second - span.first;
+        return bytes;
+    }
+
+private:
+    using Span = std::pair<uintptr_t, uintptr_t>; // [begin, end) page aligned
+
+    static std::vector<Span> to_pages(const std::vector<Range>& ranges) {
+        std::vector<Span> spans;
+#ifdef __linux__
+        const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        for (const auto& [data, bytes] : ranges) {
+            if (!data || bytes == 0) continue;
+            uintptr_t begin = reinterpret_cast<uintptr_t>(data) & ~(page - 1);
+            uintptr_t end = (reinterpret_cast<uintptr_t>(data) + bytes + page - 1) & ~(page - 1);
+            spans.emplace_back(begin, end);
+        }
+#else
+        (void)ranges;
+#endif
+        std::sort(spans.begin(), spans.end());
+        std::vector<Span> merged;
+        for (const Span& span : spans) {
+            if (!merged.empty() && span.first <= merged.back().second) {
+                merged.back().second = std::max(merged.back().second, span.second);
+            } else {
+                merged.push_back(span);
+            }
+        }
+        return merged;
+    }
+
+    // Parts of the sorted, disjoint spans a not covered by b
+    static std::vector<Span> subtract(const std::vector<Span>& a, const std::vector<Span>& b) {
+        std::vector<Span> out;
+        size_t j = 0;
+        for (Span span : a) {
+            while (j < b.size() && b[j].second <= span.first) ++j;
+            for (size_t k = j; k < b.size() && b[k].first < span.second; ++k) {
+                if (b[k].first > span.first) out.emplace_back(span.first, b[k].first);
+                span.first = std::max(span.first, b[k].second);
+            }
+            if (span.first < span.second) out.push_back(span);
+        }
+        return out;
+    }
+
+    std::vector<Span> pages_;
+    bool lock_failed_ = false;
+};
@@ -0,0 +1,93 @@
+#pragma once
+// Results of recent searches, kept behind random handles so that later pages
+// are served from an opaque cursor instead of re-running the query or sending
+// every path up front. Each query owns its own entry; the store evicts the
+// least recently used ones once it holds `capacity` results. A result keeps
+// only the CG list and delta its rows refer to, not the tags and index of the
+// dataset it was computed on, so results outliving a compaction or reload
+// hold on to little memory.
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "cg_table.h"
+#include "delta_segment.h"
+
+struct SearchResult {
+    size_t count = 0;               // Exact number of matching images
+    std::vector<uint32_t> rows;     // The first max_image_count matches as rows of cg_table and delta (cached mode)
+    std::vector<std::string> paths; // or as image paths (uncached mode)
+    std::shared_ptr<const CgTable> cg_table; // Kept alive so rows stay valid after compactions and reloads
+    std::shared_ptr<const DeltaSegment> delta;
+
+    size_t size() const { return rows.empty() ? paths.size() : rows.size(); }
+
+    // "<cg_id>/image_<n>.webp" of result k
+    std::string path(size_t k) const {
+        if (rows.empty()) return paths[k];
+        uint32_t row = rows[k];
+        return row < cg_table->size() ? cg_table->image_path(row) : delta->image_path(row);
+    }
+};
+
+class SearchResultStore {
+public:
+    explicit SearchResultStore(size_t capacity) : capacity_(capacity), rng_(std::random_device()()) {}
+
+    uint64_t put(std::shared_ptr<const SearchResult> result) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t handle;
+        do {
+            handle = rng_();
+        } while (handle == 0 || index_.count(handle));
+        lru_.emplace_front(handle, std::move(result));
+        index_[handle] = lru_.begin();
+        while (lru_.size() > capacity_) {
+            index_.erase(lru_.back().first);
+            lru_.pop_back();
+        }
+        return handle;
+    }
+
+    // nullptr once the result has been evicted
+    std::shared_ptr<const SearchResult> get(uint64_t handle) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(handle);
+        if (it == index_.end()) return nullptr;
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->second;
+    }
+
+private:
+    using Entry = std::pair<uint64_t, std::shared_ptr<const SearchResult>>;
+
+    size_t capacity_;
+    std::mutex mutex_;
+    std::mt19937_64 rng_;
+    std::list<Entry> lru_; // Most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+};
+
+// A cursor is a result handle plus the offset of the next page, as 24 hex digits
+inline std::string encode_cursor(uint64_t handle, size_t offset) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%016llx%08llx",
+        static_cast<unsigned long long>(handle), static_cast<unsigned long long>(offset & 0xffffffffu));
+    return buffer;
+}
+
+inline bool decode_cursor(const std::string& cursor, uint64_t& handle, size_t& offset) {
+    if (cursor.size() != 24 || cursor.find_first_not_of("0123456789abcdef") != std::string::npos) {
+        return false;
+    }
+    handle = std::stoull(cursor.substr(0, 16), nullptr, 16);
+    offset = static_cast<size_t>(std::stoull(cursor.substr(16), nullptr, 16));
+    return true;
+}
@@ -0,0 +1,75 @@
+#pragma once
+// Runs a handler on its own thread each time the process receives a signal,
+// e.g. SIGHUP for a reload. The signal is taken with sigwait instead of a
+// signal handler, so the handler may lock, allocate and log like any other
+// code; for that the signal has to be blocked in every thread, which
+// block_signal does when called at the start of main, before any thread is
+// created (threads inherit the mask of the thread creating them).
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+// Keep signal from interrupting the calling thread and the threads it creates later
+inline void block_signal(int signal) {
+#ifdef __linux__
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, signal);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+#else
+    (void)signal;
+#endif
+}
+
+class SignalTrigger {
+public:
+    // signal must be blocked with block_signal first. Signals arriving while
+    // the handler runs are merged into one more run after it.
+    SignalTrigger(int signal, std::function<void()> handler) : signal_(signal), handler_(std::move(handler)) {
+#ifdef __linux__
+        thread_ = std::thread([this] { run(); });
+#endif
+    }
+
+    SignalTrigger(const SignalTrigger&) = delete;
+    SignalTrigger& operator=(const SignalTrigger&) = delete;
+
+    ~SignalTrigger() {
+#ifdef __linux__
+        if (thread_.joinable()) {
+            stopping_ = true;
+            pthread_kill(thread_.native_handle(), signal_);
+            thread_.join();
+        }
+#endif
+    }
+
+private:
+#ifdef __linux__
+    void run() {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, signal_);
+        int received;
+        while (sigwait(&set, &received) == 0 && !stopping_) {
+            try {
+                handler_();
+            } catch (const std::exception& e) {
+                std::cerr << "Warning: Handling signal " << signal_ << " failed: " << e.what() << std::endl;
+            }
+        }
+    }
+#endif
+
+    int signal_;
+    std::function<void()> handler_;
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+};
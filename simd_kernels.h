@@ -0,0 +1,245 @@
+#pragma once
+// Word-level kernels behind bitset containers and dense score columns, each
+// built three times: portable scalar code, AVX2 and AVX-512 (F + BW). The
+// binary itself targets the baseline ISA; the wider versions are compiled per
+// function through target attributes, and simd_kernels() picks the best one the
+// CPU reports through CPUID the first time it is called. One build therefore
+// runs on every x86-64 host and still vectorizes where it can.
+#include <cstddef>
+#include <cstdint>
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#include <immintrin.h>
+#define TAGSEARCH_X86_KERNELS 1
+#endif
+
+enum class SimdLevel { Scalar, AVX2, AVX512 };
+
+struct SimdKernels {
+    SimdLevel level;
+    const char* name;
+    // out[i] = a[i] op b[i] for n words, returns the number of bits set in out
+    uint64_t (*and_words)(const uint64_t* a, const uint64_t* b, uint64_t* out, size_t n);
+    uint64_t (*or_words)(const uint64_t* a, const uint64_t* b, uint64_t* out, size_t n);
+    uint64_t (*andnot_words)(const uint64_t* a, const uint64_t* b, uint64_t* out, size_t n); // a & ~b
+    uint64_t (*popcount)(const uint64_t* words, size_t n);
+    // Bit i of out is set when min_q <= scores[i] <= max_q. n must be a multiple
+    // of 64; writes n / 64 words and returns the number of bits set.
+    uint64_t (*score_range)(const uint16_t* scores, size_t n, uint16_t min_q, uint16_t max_q, uint64_t* out);
+};
+
+namespace simd_detail {
+
+enum class WordOp { And, Or, AndNot };
+
+template <WordOp op>
+inline uint64_t apply(uint64_t a, uint64_t b) {
+    return op == WordOp::And ? a & b : op == WordOp::Or ? a | b : a & ~b;
+}
+
+inline uint64_t popcount64(uint64_t w) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<uint64_t>(__builtin_popcountll(w));
+#else
+    w = w - ((w >> 1) & 0x5555555555555555ULL);
+    w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+    w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (w * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+template <WordOp op>
+uint64_t scalar_combine(const uint64_t* a, const uint64_t* b, uint64_t* out, size_t n) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = apply<op>(a[i], b[i]);
+        count += popcount64(out[i]);
+    }
+    return count;
+}
+
+inline uint64_t scalar_popcount(const uint64_t* words, size_t n) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < n; ++i) count += popcount64(words[i]);
+    return count;
+}
+
+inline uint64_t scalar_score_range(const uint16_t* scores, size_t n, uint16_t min_q, uint16_t max_q, uint64_t* out) {
+    uint64_t count = 0;
+    for (size_t w = 0; w < n / 64; ++w) {
+        uint64_t bits = 0;
+        for (size_t k = 0; k < 64; ++k) {
+            uint16_t s = scores[w * 64 + k];
+            bits |= uint64_t(s >= min_q && s <= max_q) << k;
+        }
+        out[w] = bits;
+        count += popcount64(bits);
+    }
+    return count;
+}
+
+#ifdef TAGSEARCH_X86_KERNELS
+
+// Per-byte popcount through a nibble lookup table, summed into four 64-bit lanes
+__attribute__((target("avx2"))) inline __m256i avx2_popcount_lanes(__m256i v) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low_mask));
+    __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2"))) inline uint64_t avx2_sum_lanes(__m256i v) {
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return static_cast<uint64_t>(_mm_cvtsi128_si64(s)) + static_cast<uint64_t>(_mm_extract_epi64(s, 1));
+}
+
+template <WordOp op>
+__attribute__((target("avx2"))) uint64_t avx2_combine(const uint64_t* a, const uint64_t* b, uint64_t* out, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        __m256i r = op == WordOp::And ? _mm256_and_si256(va, vb)
+                  : op == WordOp::Or  ? _mm256_or_si256(va, vb)
+                  :                     _mm256_andnot_si256(vb, va);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), r);
+        acc = _mm256_add_epi64(acc, avx2_popcount_lanes(r));
+    }
+    return avx2_sum_lanes(acc) + scalar_combine<op>(a + i, b + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) inline uint64_t avx2_popcount(const uint64_t* words, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm256_add_epi64(acc, avx2_popcount_lanes(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + i))));
+    }
+    return avx2_sum_lanes(acc) + scalar_popcount(words + i, n - i);
+}
+
+// 0xffff in every 16-bit lane whose score lies in [min_q, max_q]; AVX2 has no
+// unsigned 16-bit compare, so compare against the clamped value instead
+__attribute__((target("avx2"))) inline __m256i avx2_in_range(const uint16_t* scores, __m256i lo, __m256i hi) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(scores));
+    return _mm256_and_si256(_mm256_cmpeq_epi16(_mm256_max_epu16(v, lo), v), _mm256_cmpeq_epi16(_mm256_min_epu16(v, hi), v));
+}
+
+// One bit per score for 32 consecutive scores
+__attribute__((target("avx2"))) inline uint32_t avx2_range_mask32(const uint16_t* scores, __m256i lo, __m256i hi) {
+    __m256i packed = _mm256_packs_epi16(avx2_in_range(scores, lo, hi), avx2_in_range(scores + 16, lo, hi));
+    packed = _mm256_permute4x64_epi64(packed, 0xd8); // Undo the per-lane interleave of packs
+    return static_cast<uint32_t>(_mm256_movemask_epi8(packed));
+}
+
+__attribute__((target("avx2"))) inline uint64_t avx2_score_range(const uint16_t* scores, size_t n, uint16_t min_q, uint16_t max_q, uint64_t* out) {
+    const __m256i lo = _mm256_set1_epi16(static_cast<short>(min_q));
+    const __m256i hi = _mm256_set1_epi16(static_cast<short>(max_q));
+    uint64_t count = 0;
+    for (size_t w = 0; w < n / 64; ++w) {
+        const uint16_t* s = scores + w * 64;
+        uint64_t bits = uint64_t(avx2_range_mask32(s, lo, hi)) | (uint64_t(avx2_range_mask32(s + 32, lo, hi)) << 32);
+        out[w] = bits;
+        count += popcount64(bits);
+    }
+    return count;
+}
+
+__attribute__((target("avx512f,avx512bw"))) inline __m512i avx512_popcount_lanes(__m512i v) {
+    const __m512i lookup = _mm512_set4_epi32(0x04030302, 0x03020201, 0x03020201, 0x02010100);
+    const __m512i low_mask = _mm512_set1_epi8(0x0f);
+    __m512i lo = _mm512_shuffle_epi8(lookup, _mm512_and_si512(v, low_mask));
+    __m512i hi = _mm512_shuffle_epi8(lookup, _mm512_and_si512(_mm512_srli_epi16(v, 4), low_mask));
+    return _mm512_sad_epu8(_mm512_add_epi8(lo, hi), _mm512_setzero_si512());
+}
+
+__attribute__((target("avx512f,avx512bw"))) inline uint64_t avx512_sum_lanes(__m512i v) {
+    alignas(64) uint64_t lanes[8];
+    _mm512_store_si512(lanes, v);
+    uint64_t sum = 0;
+    for (uint64_t lane : lanes) sum += lane;
+    return sum;
+}
+
+template <WordOp op>
+__attribute__((target("avx512f,avx512bw"))) uint64_t avx512_combine(const uint64_t* a, const uint64_t* b, uint64_t* out, size_t n) {
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i va = _mm512_loadu_si512(a + i);
+        __m512i vb = _mm512_loadu_si512(b + i);
+        __m512i r = op == WordOp::And ? _mm512_and_si512(va, vb)
+                  : op == WordOp::Or  ? _mm512_or_si512(va, vb)
+                  :                     _mm512_and_si512(va, _mm512_xor_si512(vb, _mm512_set1_epi64(-1)));
+        _mm512_storeu_si512(out + i, r);
+        acc = _mm512_add_epi64(acc, avx512_popcount_lanes(r));
+    }
+    return avx512_sum_lanes(acc) + scalar_combine<op>(a + i, b + i, out + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) inline uint64_t avx512_popcount(const uint64_t* words, size_t n) {
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm512_add_epi64(acc, avx512_popcount_lanes(_mm512_loadu_si512(words + i)));
+    }
+    return avx512_sum_lanes(acc) + scalar_popcount(words + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) inline uint64_t avx512_score_range(const uint16_t* scores, size_t n, uint16_t min_q, uint16_t max_q, uint64_t* out) {
+    const __m512i lo = _mm512_set1_epi16(static_cast<short>(min_q));
+    const __m512i hi = _mm512_set1_epi16(static_cast<short>(max_q));
+    uint64_t count = 0;
+    for (size_t w = 0; w < n / 64; ++w) {
+        __m512i v0 = _mm512_loadu_si512(scores + w * 64);
+        __m512i v1 = _mm512_loadu_si512(scores + w * 64 + 32);
+        uint64_t m0 = _mm512_mask_cmple_epu16_mask(_mm512_cmpge_epu16_mask(v0, lo), v0, hi);
+        uint64_t m1 = _mm512_mask_cmple_epu16_mask(_mm512_cmpge_epu16_mask(v1, lo), v1, hi);
+        uint64_t bits = m0 | (m1 << 32);
+        out[w] = bits;
+        count += popcount64(bits);
+    }
+    return count;
+}
+
+#endif // TAGSEARCH_X86_KERNELS
+
+} // namespace simd_detail
+
+// Best level the CPU and OS support
+inline SimdLevel detect_simd_level() {
+#ifdef TAGSEARCH_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+#endif
+    return SimdLevel::Scalar;
+}
+
+// Kernels for a given level; levels this build has no code for fall back to scalar
+inline const SimdKernels& simd_kernels_for(SimdLevel level) {
+    using namespace simd_detail;
+    static const SimdKernels scalar = {SimdLevel::Scalar, "scalar",
+        scalar_combine<WordOp::And>, scalar_combine<WordOp::Or>, scalar_combine<WordOp::AndNot>,
+        scalar_popcount, scalar_score_range};
+#ifdef TAGSEARCH_X86_KERNELS
+    static const SimdKernels avx2 = {SimdLevel::AVX2, "avx2",
+        avx2_combine<WordOp::And>, avx2_combine<WordOp::Or>, avx2_combine<WordOp::AndNot>,
+        avx2_popcount, avx2_score_range};
+    static const SimdKernels avx512 = {SimdLevel::AVX512, "avx512",
+        avx512_combine<WordOp::And>, avx512_combine<WordOp::Or>, avx512_combine<WordOp::AndNot>,
+        avx512_popcount, avx512_score_range};
+    if (level == SimdLevel::AVX512) return avx512;
+    if (level == SimdLevel::AVX2) return avx2;
+#endif
+    (void)level;
+    return scalar;
+}
+
+// Selected once, on first use
+inline const SimdKernels& simd_kernels() {
+    static const SimdKernels& kernels = simd_kernels_for(detect_simd_level());
+    return kernels;
+}
@@ -0,0 +1,302 @@
+#pragma once
+// Binary snapshot of the data built at startup (tag dictionary, CG list, tag
+// store, inverted index), so a restart maps one file instead of re-reading
+// the CSV files and every per-image JSON. The file is a fixed header followed
+// by a payload of sections:
+//
+//   header   magic, format version, payload size, checksum of the small data
+//   payload  source stamps, then whatever the owner of each section wrote
+//
+// Sections are written as plain little-endian integers and arrays, each array
+// prefixed by its length and padded to 8 bytes. An array of checksum_block
+// bytes or more is followed by one checksum per checksum_block of it; the
+// header's checksum covers everything else. Readers verify that small data as
+// they go and the large arrays block by block in parallel at the end, so a
+// restart does not hash the whole file on one thread. The source stamps record the
+// size and modification time of every input the data was built from; when any
+// of them differs at startup the snapshot is stale and the caller rebuilds.
+// Readers map the file read-only, so concurrent servers share it through the
+// page cache. With map_columns, columns (column.h) are read as views into the
+// mapping instead of being copied, and the caller keeps the mapping from
+// mapping() for as long as they are used; out-of-core mode loads the tag
+// store and index this way, and its segment files use the same format with
+// no source stamps. Mapped large arrays are not checksummed: reading them
+// would stream a file larger than RAM through the page cache and evict the
+// pages kept resident, so only the small data is verified then.
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "checksum.h"
+#include "column.h"
+#include "mapped_file.h"
+
+// Bump whenever the layout of any section changes
+constexpr uint32_t snapshot_version = 6;
+
+// Arrays this large are checksummed on their own, per block of this size
+constexpr size_t checksum_block = size_t(1) << 20;
+
+// Size and modification time of one input file or directory (-1 when missing)
+struct SourceStamp {
+    std::string path;
+    int64_t mtime = -1;
+    uint64_t size = 0;
+
+    static SourceStamp of(const std::string& path) {
+        namespace fs = std::filesystem;
+        SourceStamp stamp;
+        stamp.path = path;
+        std::error_code ec;
+        auto status = fs::status(path, ec);
+        if (ec || !fs::exists(status)) return stamp;
+        auto time = fs::last_write_time(path, ec);
+        if (ec) return stamp;
+        stamp.mtime = static_cast<int64_t>(time.time_since_epoch().count());
+        if (fs::is_regular_file(status)) stamp.size = fs::file_size(path, ec);
+        return stamp;
+    }
+
+    bool operator==(const SourceStamp& other) const {
+        return path == other.path && mtime == other.mtime && size == other.size;
+    }
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_bytes;
+    uint64_t payload_bytes;
+    uint64_t checksum;
+};
+
+inline constexpr char snapshot_magic[8] = {'T', 'A', 'G', 'S', 'N', 'A', 'P', '\0'};
+
+// Streams sections to "<path>.tmp" and renames it over path once complete, so
+// readers never see a half-written snapshot. Throws std::runtime_error on I/O errors.
+class SnapshotWriter {
+public:
+    SnapshotWriter(const std::string& path, const std::vector<SourceStamp>& sources)
+        : path_(path), out_(path + ".tmp", std::ios::binary | std::ios::trunc) {
+        if (!out_) throw std::runtime_error("Unable to create " + path + ".tmp");
+        SnapshotHeader header{};
+        out_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        write_pod<uint64_t>(sources.size());
+        for (const auto& source : sources) {
+            write_string(source.path);
+            write_pod(source.mtime);
+            write_pod(source.size);
+        }
+    }
+
+    template <typename T>
+    void write_pod(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "snapshot values must be trivially copyable");
+        write_bytes(&value, sizeof(T));
+    }
+
+    template <typename T>
+    void write_vector(const std::vector<T>& values) {
+        write_array(values.data(), values.size());
+    }
+
+    template <typename T>
+    void write_column(const Column<T>& values) {
+        write_array(values.data(), values.size());
+    }
+
+    void write_string(const std::string& value) { write_array(value.data(), value.size()); }
+
+    template <typename T>
+    void write_array(const T* values, size_t n) {
+        static_assert(std::is_trivially_copyable<T>::value, "snapshot values must be trivially copyable");
+        write_pod<uint64_t>(n);
+        const size_t bytes = n * sizeof(T);
+        write_bytes(values, bytes, bytes < checksum_block);
+        static const char zeros[8] = {};
+        write_bytes(zeros, (8 - payload_bytes_ % 8) % 8);
+        if (bytes < checksum_block) return;
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(values);
+        for (size_t offset = 0; offset < bytes; offset += checksum_block) {
+            Checksum64 block;
+            block.update(p + offset, std::min(checksum_block, bytes - offset));
+            write_pod(block.value());
+        }
+    }
+
+    // Fill in the header and move the file into place
+    void commit() {
+        SnapshotHeader header{};
+        std::memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+        header.version = snapshot_version;
+        header.header_bytes = sizeof(SnapshotHeader);
+        header.payload_bytes = payload_bytes_;
+        header.checksum = checksum_.value();
+        out_.seekp(0);
+        out_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out_.close();
+        if (!out_) throw std::runtime_error("Unable to write " + path_ + ".tmp");
+        std::error_code ec;
+        std::filesystem::rename(path_ + ".tmp", path_, ec);
+        if (ec) throw std::runtime_error("Unable to rename snapshot to " + path_ + ": " + ec.message());
+    }
+
+private:
+    void write_bytes(const void* data, size_t n, bool checksummed = true) {
+        if (n == 0) return;
+        out_.write(static_cast<const char*>(data), static_cast<std::streamsize>(n));
+        if (!out_) throw std::runtime_error("Unable to write " + path_ + ".tmp");
+        if (checksummed) checksum_.update(data, n);
+        payload_bytes_ += n;
+    }
+
+    std::string path_;
+    std::ofstream out_;
+    Checksum64 checksum_;
+    uint64_t payload_bytes_ = 0;
+};
+
+// Reads the sections back in the order they were written. Every read is bounds
+// checked and throws std::runtime_error on a truncated or inconsistent file;
+// finish() throws when a checksum does not match, so callers use what they
+// read only once it returned.
+class SnapshotReader {
+public:
+    // Empty string when the snapshot is usable, otherwise why it is not.
+    // Without verify no checksum is checked, e.g. for a file this process just wrote.
+    std::string open(const std::string& path, const std::vector<SourceStamp>& sources, bool map_columns = false,
+                     bool verify = true) {
+        map_columns_ = map_columns;
+        verify_ = verify;
+        if (!file_->open(path)) return "no snapshot at " + path;
+        SnapshotHeader header;
+        if (file_->size() < sizeof(header)) return "snapshot is truncated";
+        std::memcpy(&header, file_->data(), sizeof(header));
+        if (std::memcmp(header.magic, snapshot_magic, sizeof(header.magic)) != 0) return "not a snapshot file";
+        if (header.version != snapshot_version) return "snapshot has format version " + std::to_string(header.version);
+        if (header.header_bytes != sizeof(header) || header.payload_bytes != file_->size() - sizeof(header)) {
+            return "snapshot is truncated";
+        }
+        position_ = sizeof(header);
+        expected_checksum_ = header.checksum;
+        try {
+            size_t count = read_pod<uint64_t>();
+            if (count != sources.size()) return "snapshot was built from other sources";
+            for (const auto& source : sources) {
+                SourceStamp stamp;
+                stamp.path = read_string();
+                stamp.mtime = read_pod<int64_t>();
+                stamp.size = read_pod<uint64_t>();
+                if (!(stamp == source)) return source.path + " changed since the snapshot was built";
+            }
+        } catch (const std::runtime_error& e) {
+            return e.what();
+        }
+        return "";
+    }
+
+    template <typename T>
+    T read_pod() {
+        static_assert(std::is_trivially_copyable<T>::value, "snapshot values must be trivially copyable");
+        T value;
+        std::memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    void read_vector(std::vector<T>& values) {
+        size_t n = read_count(sizeof(T));
+        values.resize(n);
+        if (n > 0) std::memcpy(values.data(), take_array(n * sizeof(T)), n * sizeof(T));
+    }
+
+    // A view into the mapping with map_columns, otherwise a copy
+    template <typename T>
+    void read_column(Column<T>& values) {
+        size_t n = read_count(sizeof(T));
+        if (map_columns_) {
+            values = Column<T>::view(reinterpret_cast<const T*>(take_array(n * sizeof(T))), n);
+        } else {
+            values.resize(n);
+            if (n > 0) std::memcpy(values.data(), take_array(n * sizeof(T)), n * sizeof(T));
+        }
+    }
+
+    // Keeps the views from read_column valid
+    std::shared_ptr<const MappedFile> mapping() const { return file_; }
+
+    std::string read_string() {
+        size_t n = read_count(1);
+        return std::string(reinterpret_cast<const char*>(take_array(n)), n);
+    }
+
+    // Throws unless exactly the whole payload was consumed and every checksum matches
+    void finish() const {
+        if (position_ != file_->size()) throw std::runtime_error("snapshot has trailing data");
+        if (!verify_) return;
+        if (checksum_.value() != expected_checksum_) throw std::runtime_error("snapshot checksum mismatch");
+        bool matches = true;
+        const int64_t count = static_cast<int64_t>(blocks_.size());
+        #pragma omp parallel for schedule(dynamic, 1) reduction(&& : matches)
+        for (int64_t i = 0; i < count; ++i) {
+            const Block& block = blocks_[static_cast<size_t>(i)];
+            Checksum64 checksum;
+            checksum.update(block.data, block.bytes);
+            matches = matches && checksum.value() == block.checksum;
+        }
+        if (!matches) throw std::runtime_error("snapshot checksum mismatch");
+    }
+
+private:
+    size_t read_count(size_t element_size) {
+        uint64_t n = read_pod<uint64_t>();
+        if (n > (file_->size() - position_) / element_size) throw std::runtime_error("snapshot is truncated");
+        return static_cast<size_t>(n);
+    }
+
+    const unsigned char* take(size_t n, bool checksummed = true) {
+        if (n > file_->size() - position_) throw std::runtime_error("snapshot is truncated");
+        const unsigned char* p = file_->data() + position_;
+        position_ += n;
+        if (checksummed && verify_) checksum_.update(p, n);
+        return p;
+    }
+
+    // The bytes of an array whose length was read, past its padding and block checksums
+    const unsigned char* take_array(size_t bytes) {
+        const unsigned char* p = take(bytes, bytes < checksum_block);
+        skip_padding();
+        if (bytes >= checksum_block) {
+            for (size_t offset = 0; offset < bytes; offset += checksum_block) {
+                uint64_t checksum = read_pod<uint64_t>();
+                if (verify_ && !map_columns_) blocks_.push_back({p + offset, std::min(checksum_block, bytes - offset), checksum});
+            }
+        }
+        return p;
+    }
+
+    void skip_padding() { take((8 - (position_ - sizeof(SnapshotHeader)) % 8) % 8); }
+
+    // A block of a large array, checked by finish()
+    struct Block {
+        const unsigned char* data;
+        size_t bytes;
+        uint64_t checksum;
+    };
+
+    std::shared_ptr<MappedFile> file_ = std::make_shared<MappedFile>();
+    size_t position_ = 0;
+    bool map_columns_ = false;
+    bool verify_ = true;
+    Checksum64 checksum_;
+    uint64_t expected_checksum_ = 0;
+    std::vector<Block> blocks_;
+};
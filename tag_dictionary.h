@@ -0,0 +1,273 @@
+#pragma once
+// Immutable dictionary of every tag the tagger can emit. Each name maps to a
+// dense 16-bit id through a minimal perfect hash (hash-and-displace: keys are
+// spread over buckets, and every bucket gets a seed that sends its keys to
+// free slots of a table exactly as large as the key set). Category, image
+// count and Japanese translation are parallel arrays indexed by id, so after
+// startup every lookup is a couple of array reads and safe for concurrent use.
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "csv.h"
+#include "tag_store.h"
+
+struct TagInfo {
+    std::string name;
+    uint8_t category = 0;
+    uint32_t count = 0;
+    std::string translation;
+};
+
+class TagDictionary {
+public:
+    static constexpr size_t max_tags = size_t(UINT16_MAX) + 1;
+
+    TagDictionary() = default;
+
+    // Ids follow the order of tags; duplicate names keep their first entry
+    explicit TagDictionary(const std::vector<TagInfo>& tags) {
+        std::unordered_map<std::string_view, bool> seen;
+        for (const auto& tag : tags) {
+            if (size() == max_tags) {
+                std::cerr << "Warning: tag dictionary is full, dropping tags from " << tag.name << std::endl;
+                break;
+            }
+            if (!seen.emplace(tag.name, true).second) continue;
+            append(name_arena_, name_offsets_, tag.name);
+            append(translation_arena_, translation_offsets_, tag.translation);
+            categories_.push_back(tag.category);
+            counts_.push_back(tag.count);
+        }
+        name_arena_.shrink_to_fit();
+        translation_arena_.shrink_to_fit();
+        build_ranks();
+        build_hash();
+    }
+
+    size_t size() const { return categories_.size(); }
+
+    // Returns -1 for unknown names
+    int32_t find(std::string_view name) const {
+        if (slots_.empty()) return -1;
+        uint64_t h = hash_name(name);
+        uint16_t id = slots_[slot(h, seeds_[bucket(h)])];
+        return this->name(id) == name ? id : -1;
+    }
+
+    std::string_view name(uint16_t id) const { return view(name_arena_, name_offsets_, id); }
+    std::string_view translation(uint16_t id) const { return view(translation_arena_, translation_offsets_, id); }
+    uint8_t category(uint16_t id) const { return categories_[id]; }
+    uint32_t count(uint16_t id) const { return counts_[id]; }
+
+    // Order entries the way the tagger's JSON lists them: by category, then by name
+    bool entry_before(const TagEntry& a, const TagEntry& b) const {
+        uint8_t ca = categories_[a.tag_id], cb = categories_[b.tag_id];
+        return ca != cb ? ca < cb : name_ranks_[a.tag_id] < name_ranks_[b.tag_id];
+    }
+
+    // Snapshot section, see snapshot.h; the hash is stored, not rebuilt
+    template <typename Writer>
+    void save(Writer& out) const {
+        out.write_string(name_arena_);
+        out.write_vector(name_offsets_);
+        out.write_string(translation_arena_);
+        out.write_vector(translation_offsets_);
+        out.write_vector(categories_);
+        out.write_vector(counts_);
+        out.write_vector(name_ranks_);
+        out.write_vector(seeds_);
+        out.write_vector(slots_);
+    }
+
+    template <typename Reader>
+    static TagDictionary load(Reader& in) {
+        TagDictionary d;
+        d.name_arena_ = in.read_string();
+        in.read_vector(d.name_offsets_);
+        d.translation_arena_ = in.read_string();
+        in.read_vector(d.translation_offsets_);
+        in.read_vector(d.categories_);
+        in.read_vector(d.counts_);
+        in.read_vector(d.name_ranks_);
+        in.read_vector(d.seeds_);
+        in.read_vector(d.slots_);
+        return d;
+    }
+
+    size_t size_in_bytes() const {
+        return name_arena_.capacity() + translation_arena_.capacity() +
+               (name_offsets_.capacity() + translation_offsets_.capacity() + counts_.capacity() + seeds_.capacity()) * sizeof(uint32_t) +
+               (name_ranks_.capacity() + slots_.capacity()) * sizeof(uint16_t) + categories_.capacity();
+    }
+
+private:
+    std::string name_arena_;
+    std::vector<uint32_t> name_offsets_{0};
+    std::string translation_arena_;
+    std::vector<uint32_t> translation_offsets_{0};
+    std::vector<uint8_t> categories_;
+    std::vector<uint32_t> counts_;
+    std::vector<uint16_t> name_ranks_; // Position of the name in sorted order
+
+    std::vector<uint32_t> seeds_;      // Per bucket displacement seed
+    std::vector<uint16_t> slots_;      // Hash slot -> id
+
+    static void append(std::string& arena, std::vector<uint32_t>& offsets, const std::string& value) {
+        arena += value;
+        offsets.push_back(static_cast<uint32_t>(arena.size()));
+    }
+
+    static std::string_view view(const std::string& arena, const std::vector<uint32_t>& offsets, uint16_t id) {
+        return std::string_view(arena).substr(offsets[id], offsets[id + 1] - offsets[id]);
+    }
+
+    static uint64_t hash_name(std::string_view name) {
+        uint64_t h = 1469598103934665603ULL; // FNV-1a
+        for (unsigned char c : name) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    size_t bucket(uint64_t h) const { return (h >> 32) % seeds_.size(); }
+
+    size_t slot(uint64_t h, uint32_t seed) const {
+        return mix(h ^ (uint64_t(seed) * 0x9E3779B97F4A7C15ULL)) % slots_.size();
+    }
+
+    void build_ranks() {
+        std::vector<uint16_t> order(size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](uint16_t a, uint16_t b) { return name(a) < name(b); });
+        name_ranks_.resize(size());
+        for (size_t r = 0; r < order.size(); ++r) name_ranks_[order[r]] = static_cast<uint16_t>(r);
+    }
+
+    void build_hash() {
+        const size_t n = size();
+        if (n == 0) return;
+        seeds_.assign(n / 4 + 1, 0);
+        slots_.assign(n, 0);
+
+        std::vector<uint64_t> hashes(n);
+        std::vector<std::vector<uint16_t>> buckets(seeds_.size());
+        for (size_t id = 0; id < n; ++id) {
+            hashes[id] = hash_name(name(static_cast<uint16_t>(id)));
+            buckets[bucket(hashes[id])].push_back(static_cast<uint16_t>(id));
+        }
+
+        // Place the largest buckets first while the table is still empty
+        std::vector<size_t> order(buckets.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(),
+            [&](size_t a, size_t b) { return buckets[a].size() > buckets[b].size(); });
+
+        std::vector<bool> taken(n, false);
+        std::vector<size_t> placed;
+        for (size_t b : order) {
+            const auto& keys = buckets[b];
+            if (keys.empty()) break;
+            for (uint32_t seed = 0;; ++seed) {
+                if (seed == UINT32_MAX) throw std::runtime_error("Unable to build tag dictionary hash");
+                placed.clear();
+                bool ok = true;
+                for (uint16_t id : keys) {
+                    size_t s = slot(hashes[id], seed);
+                    if (taken[s] || std::find(placed.begin(), placed.end(), s) != placed.end()) {
+                        ok = false;
+                        break;
+                    }
+                    placed.push_back(s);
+                }
+                if (!ok) continue;
+                seeds_[b] = seed;
+                for (size_t k = 0; k < keys.size(); ++k) {
+                    taken[placed[k]] = true;
+                    slots_[placed[k]] = keys[k];
+                }
+                break;
+            }
+        }
+    }
+};
+
+// Build the dictionary from selected_tags.csv (tag_id, name, category, count),
+// add Japanese names from the translation file (English, Japanese) and take
+// per-tag image counts of our dataset from the statistics file (English,
+// Japanese, count). Without statistics the selected_tags counts are kept.
+inline TagDictionary load_tag_dictionary(const std::string& selected_tags_path,
+    const std::string& translation_path, const std::string& statistics_path) {
+    std::vector<TagInfo> tags;
+    std::unordered_map<std::string, size_t> positions;
+    auto parse_count = [](const std::string& text, uint32_t& value) {
+        char* endptr = nullptr;
+        unsigned long long v = std::strtoull(text.c_str(), &endptr, 10);
+        if (text.empty() || *endptr != '\0') return false;
+        value = static_cast<uint32_t>(std::min<unsigned long long>(v, UINT32_MAX));
+        return true;
+    };
+
+    bool ok = read_csv(selected_tags_path, [&](const std::vector<std::string>& row) {
+        TagInfo tag;
+        uint32_t category = 0;
+        if (row.size() < 4 || !parse_count(row[2], category) || !parse_count(row[3], tag.count)) return; // Header
+        tag.name = row[1];
+        tag.category = static_cast<uint8_t>(std::min<uint32_t>(category, 255));
+        positions.emplace(tag.name, tags.size());
+        tags.push_back(std::move(tag));
+    });
+    if (!ok) {
+        std::cerr << "Error: Unable to open selected tags file." << std::endl;
+    }
+
+    bool first_row = true;
+    ok = read_csv(translation_path, [&](const std::vector<std::string>& row) {
+        bool header = first_row;
+        first_row = false;
+        if (row.size() < 2 || (header && positions.find(row[0]) == positions.end())) return;
+        auto it = positions.find(row[0]);
+        if (it == positions.end()) {
+            // Translated but not in selected_tags: keep it so it can still be looked up
+            TagInfo tag;
+            tag.name = row[0];
+            tag.category = TagStore::category_general;
+            it = positions.emplace(tag.name, tags.size()).first;
+            tags.push_back(std::move(tag));
+        }
+        tags[it->second].translation = row[1];
+    });
+    if (!ok) {
+        std::cerr << "Error: Unable to open tag file." << std::endl;
+    }
+
+    std::vector<uint32_t> dataset_counts(tags.size(), 0);
+    ok = read_csv(statistics_path, [&](const std::vector<std::string>& row) {
+        uint32_t count = 0;
+        if (row.size() < 3 || !parse_count(row[2], count)) return; // Header
+        auto it = positions.find(row[0]);
+        if (it != positions.end()) dataset_counts[it->second] = count;
+    });
+    if (ok) {
+        for (size_t i = 0; i < tags.size(); ++i) tags[i].count = dataset_counts[i];
+    } else {
+        std::cerr << "Error: Unable to open tag statistics file, planning with selected_tags counts." << std::endl;
+    }
+    return TagDictionary(tags);
+}
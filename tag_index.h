@@ -0,0 +1,224 @@
+#pragma once
+// Inverted index from tag id to the bitmap of image ids (rows of the CG list)
+// carrying that tag. Built once at startup from the TagStore and read-only
+// afterwards, so request threads can share it without locking. Tag ids come
+// from the TagDictionary, so names are resolved once per query.
+//
+// Next to the presence bitmap every tag keeps its postings sorted by quantized
+// score, so a threshold or score range is a binary search plus a slice. Tags on
+// a large share of the images also keep a dense per-image score column, where a
+// range is one vectorized compare pass instead of scattering a huge slice.
+//
+// Saved postings are placed by how often their tag is queried, hottest first
+// (by posting count while there are no query counts yet), so in out-of-core
+// mode, where they are views into the mapped file, the postings that are
+// pinned in memory sit on few pages and cold ones are not read in with them.
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+#include "bitmap.h"
+#include "column.h"
+#include "simd_kernels.h"
+#include "tag_store.h"
+
+// Postings of one tag ordered by ascending score, ties by ascending image id
+struct ScoredPostings {
+    Column<uint16_t> scores;
+    Column<uint32_t> ids;
+
+    // [first, last) positions whose score lies in [min_q, max_q]
+    std::pair<size_t, size_t> range(uint16_t min_q, uint16_t max_q) const {
+        size_t first = std::lower_bound(scores.begin(), scores.end(), min_q) - scores.begin();
+        size_t last = std::upper_bound(scores.begin(), scores.end(), max_q) - scores.begin();
+        return {first, std::max(first, last)};
+    }
+};
+
+class TagIndex {
+public:
+    TagIndex() = default;
+    explicit TagIndex(size_t tag_count) : postings_(tag_count) {}
+
+    // Tags on at least 1 / dense_score_ratio of the images get a dense score column
+    static constexpr size_t dense_score_ratio = 4;
+
+    // Images must be added in ascending id order
+    void add_image(uint32_t image_id) {
+        all_images_.add(image_id);
+        image_slots_ = image_id + size_t(1);
+    }
+
+    void add_tag(uint32_t tag_id, uint32_t image_id, uint16_t score) {
+        Postings& p = postings_[tag_id];
+        p.presence.add(image_id);
+        p.scored.scores.push_back(score);
+        p.scored.ids.push_back(image_id);
+    }
+
+    // Sort the scored postings once all images have been added
+    void finalize() {
+        all_images_.shrink_to_fit();
+        for (auto& p : postings_) {
+            p.presence.shrink_to_fit();
+            std::vector<uint32_t> order(p.scored.ids.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::stable_sort(order.begin(), order.end(),
+                [&](uint32_t a, uint32_t b) { return p.scored.scores[a] < p.scored.scores[b]; });
+            ScoredPostings sorted;
+            sorted.scores.reserve(order.size());
+            sorted.ids.reserve(order.size());
+            for (uint32_t k : order) {
+                sorted.scores.push_back(p.scored.scores[k]);
+                sorted.ids.push_back(p.scored.ids[k]);
+            }
+            p.scored = std::move(sorted);
+
+            // Rounded up to whole words for the compare kernel; absent images read as score 0
+            if (!p.scored.ids.empty() && p.scored.ids.size() * dense_score_ratio >= image_slots_) {
+                p.dense_scores.assign((image_slots_ + 63) / 64 * 64, 0);
+                for (size_t k = 0; k < p.scored.ids.size(); ++k) p.dense_scores[p.scored.ids[k]] = p.scored.scores[k];
+            }
+        }
+    }
+
+    // Images that have tag data at all; the universe for exclusions
+    const Bitmap& all_images() const { return all_images_; }
+
+    const Bitmap& postings(uint32_t tag_id) const { return postings_[tag_id].presence; }
+
+    // Images whose quantized score for the tag lies in [min_q, max_q]
+    Bitmap postings_in_range(uint32_t tag_id, uint16_t min_q, uint16_t max_q) const {
+        const ScoredPostings& scored = postings_[tag_id].scored;
+        auto [first, last] = scored.range(min_q, max_q);
+        if (last - first == scored.ids.size()) {
+            return postings_[tag_id].presence;
+        }
+        const Column<uint16_t>& dense = postings_[tag_id].dense_scores;
+        // A thin slice is cheaper to scatter than a pass over the whole column
+        if (!dense.empty() && last - first > dense.size() / 64) {
+            std::vector<uint64_t> words(dense.size() / 64);
+            simd_kernels().score_range(dense.data(), dense.size(), min_q, max_q, words.data());
+            Bitmap matches = Bitmap::from_words(words.data(), words.size());
+            // Score 0 also matches images without the tag
+            return min_q == 0 ? matches & postings_[tag_id].presence : matches;
+        }
+        return Bitmap::from_unsorted(scored.ids.data() + first, last - first);
+    }
+
+    size_t count_in_range(uint32_t tag_id, uint16_t min_q, uint16_t max_q) const {
+        auto [first, last] = postings_[tag_id].scored.range(min_q, max_q);
+        return last - first;
+    }
+
+    size_t tag_count() const { return postings_.size(); }
+
+    // Snapshot section, see snapshot.h. Postings are written in descending
+    // order of queries[tag id] (may be empty), then of posting count.
+    template <typename Writer>
+    void save(Writer& out, const std::vector<uint64_t>& queries = {}) const {
+        all_images_.save(out);
+        out.template write_pod<uint64_t>(image_slots_);
+        out.template write_pod<uint64_t>(postings_.size());
+        std::vector<uint32_t> order(postings_.size());
+        std::iota(order.begin(), order.end(), 0);
+        auto queried = [&](uint32_t tag) { return tag < queries.size() ? queries[tag] : 0; };
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            if (queried(a) != queried(b)) return queried(a) > queried(b);
+            return postings_[a].scored.ids.size() > postings_[b].scored.ids.size();
+        });
+        for (uint32_t tag : order) {
+            const Postings& p = postings_[tag];
+            out.write_pod(tag);
+            p.presence.save(out);
+            out.write_column(p.scored.scores);
+            out.write_column(p.scored.ids);
+            out.write_column(p.dense_scores);
+        }
+    }
+
+    template <typename Reader>
+    static TagIndex load(Reader& in) {
+        TagIndex index;
+        index.all_images_ = Bitmap::load(in);
+        index.image_slots_ = in.template read_pod<uint64_t>();
+        index.postings_.resize(in.template read_pod<uint64_t>());
+        for (size_t k = 0; k < index.postings_.size(); ++k) {
+            uint32_t tag = in.template read_pod<uint32_t>();
+            if (tag >= index.postings_.size()) throw std::runtime_error("snapshot index is corrupt");
+            Postings& p = index.postings_[tag];
+            p.presence = Bitmap::load(in);
+            in.read_column(p.scored.scores);
+            in.read_column(p.scored.ids);
+            in.read_column(p.dense_scores);
+        }
+        return index;
+    }
+
+    // Visit the (data, bytes) of every array of a tag's postings, e.g. to pin them
+    template <typename F>
+    void for_each_column(uint32_t tag_id, F&& f) const {
+        const Postings& p = postings_[tag_id];
+        p.presence.for_each_column(f);
+        if (!p.scored.ids.empty()) {
+            f(p.scored.scores.data(), p.scored.scores.size_in_bytes());
+            f(p.scored.ids.data(), p.scored.ids.size_in_bytes());
+        }
+        if (!p.dense_scores.empty()) f(p.dense_scores.data(), p.dense_scores.size_in_bytes());
+    }
+
+    // Bytes of a tag's postings, wherever they are
+    size_t postings_bytes(uint32_t tag_id) const {
+        size_t n = 0;
+        for_each_column(tag_id, [&](const void*, size_t bytes) { n += bytes; });
+        return n;
+    }
+
+    size_t size_in_bytes() const {
+        size_t n = all_images_.size_in_bytes();
+        for (size_t i = 0; i < postings_.size(); ++i) {
+            n += postings_[i].presence.size_in_bytes() +
+                 postings_[i].scored.scores.capacity() * sizeof(uint16_t) +
+                 postings_[i].scored.ids.capacity() * sizeof(uint32_t) +
+                 postings_[i].dense_scores.capacity() * sizeof(uint16_t);
+        }
+        return n;
+    }
+
+private:
+    struct Postings {
+        Bitmap presence;
+        ScoredPostings scored;
+        Column<uint16_t> dense_scores; // Score by image id, empty for rarer tags
+    };
+
+    Bitmap all_images_;
+    size_t image_slots_ = 0; // Highest image id + 1
+    std::vector<Postings> postings_; // Indexed by tag id
+};
+
+// Image ids are the store's rows, i.e. rows of the CG list. pace() is called
+// once per image, letting a background build hand the CPU back now and then.
+template <typename Pace>
+TagIndex build_tag_index(const TagStore& store, size_t tag_count, Pace&& pace) {
+    TagIndex index(tag_count);
+    for (uint32_t i = 0; i < store.image_count(); ++i) {
+        pace();
+        if (!store.has_tags(i)) {
+            continue;
+        }
+        index.add_image(i);
+        auto [first, last] = store.tags(i);
+        for (const TagEntry* e = first; e != last; ++e) {
+            index.add_tag(e->tag_id, i, e->score);
+        }
+    }
+    index.finalize();
+    return index;
+}
+
+inline TagIndex build_tag_index(const TagStore& store, size_t tag_count) {
+    return build_tag_index(store, tag_count, [] {});
+}
@@ -0,0 +1,260 @@
+#pragma once
+// Parallel startup loaders filling the TagStore, either from the per-image tag
+// JSON files or from a tag pack (tag_pack.h). Worker threads handle chunks of
+// consecutive rows; JSON files are decoded with nlohmann's SAX interface
+// straight into TagEntry arrays, so no JSON DOM is ever built and no separate
+// exists() stat is made: a file that cannot be opened is a missing image.
+// Every chunk fills its own TagStore and the chunks are appended in row order,
+// giving exactly the store a sequential loader would build; out-of-core mode
+// streams them to a segment file instead (tag_segment.h).
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+#include "tag_dictionary.h"
+#include "tag_pack.h"
+#include "tag_store.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Category number of a tagger JSON key; anything else is kept apart as 255
+inline uint8_t parse_category_key(std::string_view key) {
+    uint32_t category;
+    return parse_image_number(key, category) && category <= 255 ? static_cast<uint8_t>(category) : 255;
+}
+
+// Collects {"tags": {"<category>": {"<tag>": score, ...}, ...}} into entries
+class TagJsonHandler {
+public:
+    using json = nlohmann::json;
+
+    explicit TagJsonHandler(const TagDictionary& dictionary) : dictionary_(dictionary) {}
+
+    void reset() {
+        entries_.clear();
+        categories_.clear();
+        depth_ = 0;
+        tags_depth_ = category_depth_ = -1;
+        key_.clear();
+        unknown_ = 0;
+    }
+
+    // Order entries the way TagStore expects them
+    const std::vector<TagEntry>& entries() {
+        auto before = [&](const TagEntry& a, const TagEntry& b) { return dictionary_.entry_before(a, b); };
+        if (!std::is_sorted(entries_.begin(), entries_.end(), before)) {
+            std::sort(entries_.begin(), entries_.end(), before);
+        }
+        return entries_;
+    }
+    const std::vector<uint8_t>& categories() const { return categories_; }
+    size_t unknown() const { return unknown_; }
+
+    bool null() { return true; }
+    bool boolean(bool) { return true; }
+    bool number_integer(json::number_integer_t value) { return score(static_cast<float>(value)); }
+    bool number_unsigned(json::number_unsigned_t value) { return score(static_cast<float>(value)); }
+    bool number_float(json::number_float_t value, const json::string_t&) { return score(static_cast<float>(value)); }
+    bool string(json::string_t&) { return true; }
+    bool binary(json::binary_t&) { return true; }
+
+    bool start_object(size_t) {
+        ++depth_;
+        if (depth_ == 2 && key_ == "tags") {
+            tags_depth_ = depth_;
+        } else if (tags_depth_ >= 0 && depth_ == tags_depth_ + 1) {
+            categories_.push_back(parse_category_key(key_));
+            category_depth_ = depth_;
+        }
+        return true;
+    }
+
+    bool end_object() {
+        if (depth_ == category_depth_) category_depth_ = -1;
+        if (depth_ == tags_depth_) tags_depth_ = -1;
+        --depth_;
+        return true;
+    }
+
+    bool start_array(size_t) {
+        ++depth_;
+        return true;
+    }
+
+    bool end_array() {
+        --depth_;
+        return true;
+    }
+
+    bool key(json::string_t& value) {
+        key_.swap(value);
+        return true;
+    }
+
+    bool parse_error(size_t, const std::string&, const nlohmann::detail::exception&) { return false; }
+
+private:
+    // Tag scores are the number values directly inside a category object
+    bool score(float value) {
+        if (category_depth_ < 0 || depth_ != category_depth_) return true;
+        int32_t tag_id = dictionary_.find(key_);
+        if (tag_id < 0) {
+            unknown_++;
+        } else {
+            entries_.push_back({static_cast<uint16_t>(tag_id), quantize_score(value)});
+        }
+        return true;
+    }
+
+    const TagDictionary& dictionary_;
+    std::vector<TagEntry> entries_;
+    std::vector<uint8_t> categories_;
+    int depth_ = 0;
+    int tags_depth_ = -1;
+    int category_depth_ = -1;
+    std::string key_;
+    size_t unknown_ = 0;
+};
+
+// Whole file into buffer; false if it cannot be opened
+inline bool read_whole_file(const std::string& path, std::string& buffer) {
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file) return false;
+    buffer.clear();
+    char chunk[65536];
+    size_t n;
+    while ((n = std::fread(chunk, 1, sizeof(chunk), file)) > 0) buffer.append(chunk, n);
+    std::fclose(file);
+    return true;
+}
+
+// Load image_count images on a pool of threads. Each chunk of rows gets its
+// own loader from make_loader(), called as load(i, part) to append image i to
+// the chunk's part; append(part) then gets the parts in row order. Chunks are
+// loaded a batch at a time, so only one batch of parts is held however many
+// images there are, and append runs on the calling thread between batches.
+// threads == 0 leaves the thread count to OpenMP.
+template <typename MakeLoader, typename Append>
+void load_in_chunks(size_t image_count, MakeLoader&& make_loader, int threads, Append&& append) {
+    constexpr size_t chunk = 1024;
+    constexpr int64_t batch = 256;
+    constexpr size_t progress_step = 50000;
+    const int64_t chunk_count = static_cast<int64_t>((image_count + chunk - 1) / chunk);
+    std::vector<TagStore> parts(static_cast<size_t>(std::min(chunk_count, batch)));
+    std::atomic<size_t> done{0};
+#ifdef _OPENMP
+    if (threads <= 0) threads = omp_get_max_threads();
+#endif
+
+    for (int64_t first_chunk = 0; first_chunk < chunk_count; first_chunk += batch) {
+        const int64_t last_chunk = std::min(first_chunk + batch, chunk_count);
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+        for (int64_t c = first_chunk; c < last_chunk; ++c) {
+            auto load = make_loader();
+            TagStore& part = parts[static_cast<size_t>(c - first_chunk)];
+            size_t first = static_cast<size_t>(c) * chunk;
+            size_t last = std::min(first + chunk, image_count);
+            for (size_t i = first; i < last; ++i) load(i, part);
+            size_t before = done.fetch_add(last - first);
+            if ((before + (last - first)) / progress_step != before / progress_step) {
+                #pragma omp critical(tag_loader_progress)
+                std::cout << "Tag loading progress: " << ((before + (last - first)) * 100.0 / image_count) << "%" << std::endl;
+            }
+        }
+        for (int64_t c = first_chunk; c < last_chunk; ++c) {
+            TagStore& part = parts[static_cast<size_t>(c - first_chunk)];
+            append(static_cast<const TagStore&>(part));
+            part = TagStore();
+        }
+    }
+}
+
+inline void report_skipped_tags(size_t malformed, size_t unknown, const char* what) {
+    if (malformed > 0) {
+        std::cerr << "Warning: Skipped " << malformed << " malformed " << what << "." << std::endl;
+    }
+    if (unknown > 0) {
+        std::cerr << "Warning: Skipped " << unknown << " tags missing from the tag dictionary." << std::endl;
+    }
+}
+
+// Load image_count tag files, path_of(i) naming the file of image i, handing
+// them to append(part) in row order. Reading from a network mount is mostly
+// waiting, so more threads than cores can pay off.
+template <typename PathOf, typename Append>
+void load_tag_files(size_t image_count, PathOf&& path_of, const TagDictionary& dictionary, int threads, Append&& append) {
+    std::atomic<size_t> unknown{0};
+    std::atomic<size_t> malformed{0};
+    load_in_chunks(image_count, [&]() {
+        return [&, handler = TagJsonHandler(dictionary), buffer = std::string()](size_t i, TagStore& part) mutable {
+            handler.reset();
+            if (!read_whole_file(path_of(i), buffer)) {
+                part.add_missing_image();
+                return;
+            }
+            if (!nlohmann::json::sax_parse(buffer.begin(), buffer.end(), &handler)) {
+                malformed++;
+                part.add_missing_image();
+                return;
+            }
+            unknown += handler.unknown();
+            part.add_image(handler.entries(), handler.categories());
+        };
+    }, threads, append);
+    report_skipped_tags(malformed, unknown, "tag files");
+}
+
+// Load image_count images from the tag pack, key_of(i) giving the (CG id, image
+// number) of image i, handing them to append(part) in row order. Pack strings
+// are resolved against the dictionary once.
+template <typename KeyOf, typename Append>
+void load_tag_pack(const TagPack& pack, size_t image_count, KeyOf&& key_of, const TagDictionary& dictionary, int threads,
+                   Append&& append) {
+    std::vector<int32_t> tag_ids(pack.string_count());
+    std::vector<uint8_t> category_keys(pack.string_count());
+    for (uint32_t id = 0; id < pack.string_count(); ++id) {
+        tag_ids[id] = dictionary.find(pack.string(id));
+        category_keys[id] = parse_category_key(pack.string(id));
+    }
+
+    std::atomic<size_t> unknown{0};
+    std::atomic<size_t> malformed{0};
+    load_in_chunks(image_count, [&]() {
+        auto before = [&](const TagEntry& a, const TagEntry& b) { return dictionary.entry_before(a, b); };
+        return [&, before, entries = std::vector<TagEntry>(), categories = std::vector<uint8_t>()](size_t i, TagStore& part) mutable {
+            const auto& [cg_id, image] = key_of(i);
+            TagPackRecord record = pack.find(cg_id, image);
+            if (!record) {
+                part.add_missing_image();
+                return;
+            }
+            entries.clear();
+            categories.clear();
+            size_t skipped = 0;
+            bool ok = pack.decode(record,
+                [&](uint32_t key) { categories.push_back(category_keys[key]); },
+                [&](uint32_t name, float score) {
+                    if (tag_ids[name] < 0) {
+                        skipped++;
+                    } else {
+                        entries.push_back({static_cast<uint16_t>(tag_ids[name]), quantize_score(score)});
+                    }
+                });
+            if (!ok) {
+                malformed++;
+                part.add_missing_image();
+                return;
+            }
+            unknown += skipped;
+            if (!std::is_sorted(entries.begin(), entries.end(), before)) std::sort(entries.begin(), entries.end(), before);
+            part.add_image(entries, categories);
+        };
+    }, threads, append);
+    report_skipped_tags(malformed, unknown, "tag pack records");
+}
@@ -0,0 +1,112 @@
+#pragma once
+// Pack file holding the tagger output of every image (see pack_file.h for the
+// container). Each image's blob is a record: a u32 category count, then per
+// category a u32 key string id and a u32 tag count followed by that many
+// (u32 name string id, f32 score) pairs. Tag names and category keys live in
+// the pack's string table, so every distinct name is stored once.
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "pack_file.h"
+
+inline constexpr PackFormat tag_pack_format{"tag pack", {'T', 'A', 'G', 'P', 'A', 'C', 'K', '\0'}, {'T', 'A', 'G', 'P', 'A', 'C', 'K', 'E'}, 2};
+
+using TagPackRecord = PackBlob;
+
+class TagPack {
+public:
+    // Prints why an existing file cannot be used; false as well when it is missing
+    bool open(const std::string& path) { return pack_.open(path, tag_pack_format); }
+    bool is_open() const { return pack_.is_open(); }
+
+    // Number of packed images
+    size_t size() const { return pack_.size(); }
+    size_t string_count() const { return pack_.string_count(); }
+    std::string_view string(uint32_t id) const { return pack_.string(id); }
+    std::string_view cg_id(size_t i) const { return pack_.cg_id(i); }
+    uint32_t image(size_t i) const { return pack_.image(i); }
+    TagPackRecord record(size_t i) const { return pack_.blob(i); }
+
+    // Record of <cg_id>/image_<image>, empty when the image is not packed
+    template <typename Image>
+    TagPackRecord find(std::string_view cg_id, const Image& image) const {
+        size_t i = pack_.find(cg_id, image);
+        return i == PackReader::npos ? TagPackRecord() : pack_.blob(i);
+    }
+
+    // Calls on_category(key string id) before the on_tag(name string id, score)
+    // calls of each category; false when the record is malformed
+    template <typename OnCategory, typename OnTag>
+    bool decode(TagPackRecord record, OnCategory&& on_category, OnTag&& on_tag) const {
+        const unsigned char* p = record.data;
+        const unsigned char* end = record.data + record.size;
+        auto next = [&](uint32_t& value) {
+            if (end - p < 4) return false;
+            value = PackReader::u32(p);
+            p += 4;
+            return true;
+        };
+        uint32_t categories;
+        if (!next(categories)) return false;
+        for (uint32_t c = 0; c < categories; ++c) {
+            uint32_t key, tags;
+            if (!next(key) || !next(tags) || key >= string_count() || size_t(end - p) / 8 < tags) return false;
+            on_category(key);
+            for (uint32_t t = 0; t < tags; ++t) {
+                uint32_t name = PackReader::u32(p);
+                float score;
+                std::memcpy(&score, p + 4, sizeof(score));
+                p += 8;
+                if (name >= string_count()) return false;
+                on_tag(name, score);
+            }
+        }
+        return p == end;
+    }
+
+private:
+    PackReader pack_;
+};
+
+// One category object of the tagger's JSON: key and (tag, score) pairs
+struct TagPackCategory {
+    std::string key;
+    std::vector<std::pair<std::string, float>> tags;
+};
+
+// Adds images to a new or existing tag pack, see PackWriter
+class TagPackWriter {
+public:
+    explicit TagPackWriter(const std::string& path) : pack_(path, tag_pack_format) {}
+
+    // False when the image is already packed with exactly these tags
+    bool add(const std::string& cg_id, uint32_t image, const std::vector<TagPackCategory>& categories) {
+        std::string bytes;
+        put_u32(bytes, static_cast<uint32_t>(categories.size()));
+        for (const auto& category : categories) {
+            put_u32(bytes, pack_.intern(category.key));
+            put_u32(bytes, static_cast<uint32_t>(category.tags.size()));
+            for (const auto& [name, score] : category.tags) {
+                put_u32(bytes, pack_.intern(name));
+                bytes.append(reinterpret_cast<const char*>(&score), sizeof(score));
+            }
+        }
+        if (pack_.unchanged(cg_id, image, bytes.data(), bytes.size())) return false;
+        pack_.add(cg_id, image, bytes.data(), bytes.size());
+        return true;
+    }
+
+    void commit() { pack_.commit(false); }
+
+    size_t size() const { return pack_.size(); }
+
+private:
+    static void put_u32(std::string& bytes, uint32_t value) {
+        bytes.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    PackWriter pack_;
+};
@@ -0,0 +1,203 @@
+#pragma once
+// Builds the tag store and inverted index of a base segment on disk for
+// out-of-core mode, so neither is ever held in memory whole: not at the first
+// start, when the tags are loaded, and not in a compaction. Images are
+// appended in row order as to a TagStore. Their offsets, entries and flags go
+// straight to spill files next to the segment file. Their postings collect per
+// tag until run_postings of them are pending, and are then spilled as one run.
+//
+// write() emits exactly the sections TagStore::save and TagIndex::save would,
+// with postings placed by queries the same way (tag_index.h). The CSR arrays
+// are copied from their spill files, and each tag's postings are merged from
+// the runs, so only one tag's postings are in memory at a time. Throws
+// std::runtime_error on I/O errors; the spill files go with the writer.
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bitmap.h"
+#include "mapped_file.h"
+#include "tag_index.h"
+#include "tag_store.h"
+
+class TagSegmentWriter {
+public:
+    // Postings pending before a run is spilled, 32 MB of them
+    static constexpr size_t run_postings = size_t(1) << 22;
+
+    // path is where the caller writes the segment; the spill files are named after it
+    TagSegmentWriter(const std::string& path, size_t tag_count, bool with_index)
+        : path_(path), with_index_(with_index), pending_(with_index ? tag_count : 0), posting_counts_(pending_.size()) {
+        for (const char* suffix : spill_suffixes) {
+            spills_.emplace_back(path_ + suffix, std::ios::binary | std::ios::trunc);
+            if (!spills_.back()) throw std::runtime_error("Unable to create " + path_ + suffix);
+        }
+        uint32_t first_offset = 0;
+        write_spill(offsets_spill, &first_offset, sizeof(first_offset));
+    }
+
+    TagSegmentWriter(const TagSegmentWriter&) = delete;
+    TagSegmentWriter& operator=(const TagSegmentWriter&) = delete;
+
+    ~TagSegmentWriter() {
+        spills_.clear();
+        std::error_code ec;
+        for (const char* suffix : spill_suffixes) std::filesystem::remove(path_ + suffix, ec);
+    }
+
+    const std::string& path() const { return path_; }
+    size_t image_count() const { return image_count_; }
+
+    // Append image of store as the next row, like TagStore::append_image
+    void append_image(const TagStore& store, uint32_t image) {
+        auto [first, last] = store.tags(image);
+        const uint32_t row = static_cast<uint32_t>(image_count_++);
+        write_spill(entries_spill, first, static_cast<size_t>(last - first) * sizeof(TagEntry));
+        entry_count_ += static_cast<size_t>(last - first);
+        uint32_t offset = static_cast<uint32_t>(entry_count_);
+        write_spill(offsets_spill, &offset, sizeof(offset));
+        uint8_t flags = store.flags(image);
+        write_spill(flags_spill, &flags, sizeof(flags));
+        if (!with_index_ || !store.has_tags(image)) return;
+
+        // As build_tag_index does; the key orders a tag's postings by score, then row
+        all_images_.add(row);
+        image_slots_ = row + size_t(1);
+        for (const TagEntry* e = first; e != last; ++e) {
+            pending_[e->tag_id].push_back(uint64_t(e->score) << 32 | row);
+            posting_counts_[e->tag_id]++;
+        }
+        pending_count_ += static_cast<size_t>(last - first);
+        if (pending_count_ >= run_postings) spill_run();
+    }
+
+    // Append every image of store, e.g. a part loaded by tag_loader.h
+    void append(const TagStore& store) {
+        for (uint32_t i = 0; i < store.image_count(); ++i) append_image(store, i);
+    }
+
+    // Write the tag store, whether there is an index, and the index; postings
+    // are written in descending order of queries[tag id] (may be empty), then
+    // of posting count. pace() is called once per tag.
+    template <typename Writer, typename Pace>
+    void write(Writer& out, const std::vector<uint64_t>& queries, Pace&& pace) {
+        if (pending_count_ > 0) spill_run();
+        for (auto& spill : spills_) {
+            spill.flush();
+            if (!spill) throw std::runtime_error("Unable to write spill files of " + path_);
+        }
+        MappedFile offsets, entries, flags, postings;
+        // MappedFile refuses empty files; those arrays are empty anyway
+        offsets.open(path_ + spill_suffixes[offsets_spill]);
+        entries.open(path_ + spill_suffixes[entries_spill]);
+        flags.open(path_ + spill_suffixes[flags_spill]);
+        postings.open(path_ + spill_suffixes[postings_spill]);
+        if (!offsets.data() || (entry_count_ > 0 && !entries.data()) || (image_count_ > 0 && !flags.data()) ||
+            (!run_starts_.empty() && run_starts_.back().back() > 0 && !postings.data())) {
+            throw std::runtime_error("Unable to map spill files of " + path_);
+        }
+
+        out.write_array(reinterpret_cast<const uint32_t*>(offsets.data()), image_count_ + 1);
+        out.write_array(reinterpret_cast<const TagEntry*>(entries.data()), entry_count_);
+        out.write_array(flags.data(), image_count_);
+        out.template write_pod<uint8_t>(with_index_);
+        if (!with_index_) return;
+
+        Bitmap all_images = all_images_;
+        all_images.shrink_to_fit();
+        all_images.save(out);
+        out.template write_pod<uint64_t>(image_slots_);
+        out.template write_pod<uint64_t>(pending_.size());
+        std::vector<uint32_t> order(pending_.size());
+        std::iota(order.begin(), order.end(), 0);
+        auto queried = [&](uint32_t tag) { return tag < queries.size() ? queries[tag] : 0; };
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            if (queried(a) != queried(b)) return queried(a) > queried(b);
+            return posting_counts_[a] > posting_counts_[b];
+        });
+
+        const uint64_t* runs = reinterpret_cast<const uint64_t*>(postings.data());
+        std::vector<uint64_t> keys;
+        std::vector<uint16_t> scores, dense_scores;
+        std::vector<uint32_t> ids;
+        for (uint32_t tag : order) {
+            pace();
+            // Runs hold ascending rows, so their slices of the tag chain into the presence bitmap
+            keys.clear();
+            keys.reserve(posting_counts_[tag]);
+            Bitmap presence;
+            for (const auto& starts : run_starts_) {
+                for (uint64_t k = starts[tag]; k < starts[tag + 1]; ++k) {
+                    presence.add(static_cast<uint32_t>(runs[k]));
+                    keys.push_back(runs[k]);
+                }
+            }
+            presence.shrink_to_fit();
+            std::sort(keys.begin(), keys.end());
+            scores.resize(keys.size());
+            ids.resize(keys.size());
+            for (size_t k = 0; k < keys.size(); ++k) {
+                scores[k] = static_cast<uint16_t>(keys[k] >> 32);
+                ids[k] = static_cast<uint32_t>(keys[k]);
+            }
+            dense_scores.clear();
+            if (!ids.empty() && ids.size() * TagIndex::dense_score_ratio >= image_slots_) {
+                dense_scores.assign((image_slots_ + 63) / 64 * 64, 0);
+                for (size_t k = 0; k < ids.size(); ++k) dense_scores[ids[k]] = scores[k];
+            }
+            out.write_pod(tag);
+            presence.save(out);
+            out.write_vector(scores);
+            out.write_vector(ids);
+            out.write_vector(dense_scores);
+        }
+    }
+
+    template <typename Writer>
+    void write(Writer& out, const std::vector<uint64_t>& queries = {}) {
+        write(out, queries, [] {});
+    }
+
+private:
+    enum Spill { offsets_spill, entries_spill, flags_spill, postings_spill };
+    static constexpr const char* spill_suffixes[] = {".offsets", ".entries", ".flags", ".postings"};
+
+    void write_spill(Spill spill, const void* data, size_t bytes) {
+        if (bytes == 0) return;
+        spills_[spill].write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+        if (!spills_[spill]) throw std::runtime_error("Unable to write " + path_ + spill_suffixes[spill]);
+    }
+
+    // Every tag's pending postings, in tag order; run_starts_ records where each begins
+    void spill_run() {
+        std::vector<uint64_t> starts(pending_.size() + 1);
+        uint64_t position = run_starts_.empty() ? 0 : run_starts_.back().back();
+        for (size_t tag = 0; tag < pending_.size(); ++tag) {
+            starts[tag] = position;
+            write_spill(postings_spill, pending_[tag].data(), pending_[tag].size() * sizeof(uint64_t));
+            position += pending_[tag].size();
+            pending_[tag].clear();
+        }
+        starts.back() = position;
+        run_starts_.push_back(std::move(starts));
+        pending_count_ = 0;
+    }
+
+    std::string path_;
+    bool with_index_;
+    std::vector<std::ofstream> spills_; // Indexed by Spill
+    size_t image_count_ = 0;
+    size_t entry_count_ = 0;
+
+    Bitmap all_images_;
+    size_t image_slots_ = 0; // Highest row with tags + 1
+    std::vector<std::vector<uint64_t>> pending_; // Indexed by tag id: score << 32 | row
+    std::vector<uint64_t> posting_counts_;       // Indexed by tag id, over all runs
+    size_t pending_count_ = 0;
+    std::vector<std::vector<uint64_t>> run_starts_; // Per run, where each tag's postings start, and the run's end
+};
@@ -0,0 +1,175 @@
+#pragma once
+// Compact in-memory copy of every cached image's tags, replacing one JSON DOM
+// per image. Laid out as CSR: offsets_[i] .. offsets_[i + 1] delimit image i's
+// entries in a single flat array of (tag id, quantized score) pairs. Tag ids
+// come from the TagDictionary. Entries of an image are grouped by category
+// (general 0, character 4, rating 9) and sorted by tag name inside a group,
+// the same order print_tags used to walk the JSON objects in. In out-of-core
+// mode the three arrays are views into a mapped segment file (column.h).
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "column.h"
+
+// Scores are stored as 16-bit fixed point over [0, 1]
+constexpr float score_scale = 65535.0f;
+
+inline uint16_t quantize_score(float score) {
+    if (!(score > 0.0f)) return 0;
+    if (score >= 1.0f) return 65535;
+    return static_cast<uint16_t>(score * score_scale + 0.5f);
+}
+
+inline float dequantize_score(uint16_t q) { return q / score_scale; }
+
+// Smallest quantized score whose value is at least score, for lower bounds
+inline uint16_t quantize_score_ceil(float score) {
+    if (!(score > 0.0f)) return 0;
+    if (score >= 1.0f) return 65535;
+    return static_cast<uint16_t>(std::ceil(static_cast<double>(score) * score_scale));
+}
+
+// Largest quantized score whose value is at most score, for upper bounds
+inline uint16_t quantize_score_floor(float score) {
+    if (!(score > 0.0f)) return 0;
+    if (score >= 1.0f) return 65535;
+    return static_cast<uint16_t>(std::floor(static_cast<double>(score) * score_scale));
+}
+
+struct TagEntry {
+    uint16_t tag_id;
+    uint16_t score; // quantize_score()
+};
+
+class TagStore {
+public:
+    // Category keys used by the tagger's JSON output
+    static constexpr uint8_t category_general = 0;
+    static constexpr uint8_t category_character = 4;
+    static constexpr uint8_t category_rating = 9;
+
+    TagStore() : offsets_{0} {}
+
+    // Images are appended in CG list order
+    void add_missing_image() {
+        offsets_.push_back(static_cast<uint32_t>(entries_.size()));
+        flags_.push_back(0);
+    }
+
+    // entries must already be in TagDictionary::entry_before order; categories
+    // lists the category keys the image's JSON had, even empty ones
+    void add_image(const std::vector<TagEntry>& entries, const std::vector<uint8_t>& categories) {
+        entries_.insert(entries_.end(), entries.begin(), entries.end());
+        offsets_.push_back(static_cast<uint32_t>(entries_.size()));
+        uint8_t flags = has_tags_flag;
+        for (uint8_t category : categories) flags |= category_flag(category);
+        flags_.push_back(flags);
+    }
+
+    // Append image of other, e.g. a row a compaction keeps
+    void append_image(const TagStore& other, uint32_t image) {
+        auto [first, last] = other.tags(image);
+        entries_.insert(entries_.end(), first, last);
+        offsets_.push_back(static_cast<uint32_t>(entries_.size()));
+        flags_.push_back(other.flags_[image]);
+    }
+
+    // Append every image of other, e.g. a part loaded by another thread
+    void append(const TagStore& other) {
+        uint32_t base = static_cast<uint32_t>(entries_.size());
+        entries_.insert(entries_.end(), other.entries_.begin(), other.entries_.end());
+        for (size_t i = 1; i < other.offsets_.size(); ++i) offsets_.push_back(base + other.offsets_[i]);
+        flags_.insert(flags_.end(), other.flags_.begin(), other.flags_.end());
+    }
+
+    // Snapshot section, see snapshot.h
+    template <typename Writer>
+    void save(Writer& out) const {
+        out.write_column(offsets_);
+        out.write_column(entries_);
+        out.write_column(flags_);
+    }
+
+    template <typename Reader>
+    static TagStore load(Reader& in) {
+        TagStore store;
+        in.read_column(store.offsets_);
+        in.read_column(store.entries_);
+        in.read_column(store.flags_);
+        return store;
+    }
+
+    void shrink_to_fit() {
+        offsets_.shrink_to_fit();
+        entries_.shrink_to_fit();
+        flags_.shrink_to_fit();
+    }
+
+    size_t image_count() const { return flags_.size(); }
+    size_t entry_count() const { return entries_.size(); }
+
+    // False for images whose JSON was missing or unreadable
+    bool has_tags(uint32_t image) const { return flags_[image] & has_tags_flag; }
+
+    // Whether the image's JSON had an object for the category (0, 4 or 9)
+    bool has_category(uint32_t image, uint8_t category) const {
+        return flags_[image] & category_flag(category);
+    }
+
+    // The image's flag byte as saved, e.g. to copy it into a segment file (tag_segment.h)
+    uint8_t flags(uint32_t image) const { return flags_[image]; }
+
+    std::pair<const TagEntry*, const TagEntry*> tags(uint32_t image) const {
+        return {entries_.data() + offsets_[image], entries_.data() + offsets_[image + 1]};
+    }
+
+    // Whether image has the same tags, scores and categories as other_image of other
+    bool same_tags(uint32_t image, const TagStore& other, uint32_t other_image) const {
+        auto [first, last] = tags(image);
+        auto [other_first, other_last] = other.tags(other_image);
+        return flags_[image] == other.flags_[other_image] && last - first == other_last - other_first &&
+               std::equal(first, last, other_first, [](const TagEntry& a, const TagEntry& b) {
+                   return a.tag_id == b.tag_id && a.score == b.score;
+               });
+    }
+
+    std::optional<float> score(uint32_t image, uint16_t tag_id) const {
+        auto [first, last] = tags(image);
+        for (const TagEntry* e = first; e != last; ++e) {
+            if (e->tag_id == tag_id) return dequantize_score(e->score);
+        }
+        return std::nullopt;
+    }
+
+    size_t size_in_bytes() const {
+        return offsets_.capacity() * sizeof(uint32_t) + entries_.capacity() * sizeof(TagEntry) + flags_.capacity();
+    }
+
+    // Visit the (data, bytes) of the three arrays, e.g. to give paging hints
+    template <typename F>
+    void for_each_column(F&& f) const {
+        f(offsets_.data(), offsets_.size_in_bytes());
+        f(entries_.data(), entries_.size_in_bytes());
+        f(flags_.data(), flags_.size_in_bytes());
+    }
+
+private:
+    static constexpr uint8_t has_tags_flag = 0x80;
+
+    static uint8_t category_flag(uint8_t category) {
+        switch (category) {
+        case category_general: return 0x01;
+        case category_character: return 0x02;
+        case category_rating: return 0x04;
+        default: return 0x08;
+        }
+    }
+
+    Column<uint32_t> offsets_;   // image_count() + 1 entries
+    Column<TagEntry> entries_;
+    Column<uint8_t> flags_;      // has_tags_flag plus one bit per category present
+};
@@ -0,0 +1,151 @@
+#pragma once
+// Watches the tag directory for tag JSON files the tagger finishes writing or
+// removes and hands them over in batches, so changes become searchable within
+// about a batch interval. Uses inotify, which only sees writes made
+// through this machine's kernel: files written by a tagger on another host of
+// a network mount have to be sent to POST /ingest instead. Every
+// subdirectory is watched; a directory created later is watched as soon as it
+// appears and the files already in it are reported. When the kernel's event
+// queue overflows, every tag file is reported again.
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <set>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+class TagWatcher {
+public:
+    // Paths relative to the watched directory
+    using Handler = std::function<void(const std::vector<std::string>&)>;
+
+    // Watch root unless batch_interval is 0 or less
+    TagWatcher(const std::string& root, std::chrono::milliseconds batch_interval, Handler handler)
+        : root_(root), interval_(batch_interval), handler_(std::move(handler)) {
+        if (interval_.count() <= 0) return;
+#ifdef __linux__
+        fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd_ < 0) {
+            std::cerr << "Warning: Unable to watch " << root_ << " for new tag files." << std::endl;
+            return;
+        }
+        std::set<std::string> ignored;
+        watch_tree(root_, ignored, false);
+        std::cout << "Watching " << watches_.size() << " directories under " << root_ << " for new tag files." << std::endl;
+        thread_ = std::thread([this] { run(); });
+#else
+        std::cerr << "Warning: Watching " << root_ << " for new tag files needs inotify; use POST /ingest." << std::endl;
+#endif
+    }
+
+    TagWatcher(const TagWatcher&) = delete;
+    TagWatcher& operator=(const TagWatcher&) = delete;
+
+    ~TagWatcher() {
+        stopping_ = true;
+        if (thread_.joinable()) thread_.join();
+#ifdef __linux__
+        if (fd_ >= 0) close(fd_);
+#endif
+    }
+
+private:
+#ifdef __linux__
+    static constexpr uint32_t watch_mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR;
+
+    // Watch dir and its subdirectories; with report, the .json files found are added to files
+    void watch_tree(const std::string& dir, std::set<std::string>& files, bool report) {
+        namespace fs = std::filesystem;
+        add_watch(dir);
+        std::error_code ec;
+        for (fs::recursive_directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+            if (it->is_directory(ec)) {
+                add_watch(it->path().string());
+            } else if (report && it->path().extension() == ".json") {
+                files.insert(fs::relative(it->path(), root_, ec).string());
+            }
+        }
+    }
+
+    void add_watch(const std::string& dir) {
+        int wd = inotify_add_watch(fd_, dir.c_str(), watch_mask);
+        if (wd < 0) {
+            std::cerr << "Warning: Unable to watch " << dir << " (raise fs.inotify.max_user_watches?)" << std::endl;
+            return;
+        }
+        watches_[wd] = dir;
+    }
+
+    void run() {
+        namespace fs = std::filesystem;
+        alignas(inotify_event) char buffer[64 * 1024];
+        std::set<std::string> pending; // Ordered, so batches follow file names
+        auto deadline = std::chrono::steady_clock::now();
+        while (!stopping_) {
+            pollfd p{fd_, POLLIN, 0};
+            // Wake up regularly to notice stopping_ and the end of a batch
+            if (poll(&p, 1, 200) > 0) {
+                ssize_t n;
+                while ((n = read(fd_, buffer, sizeof(buffer))) > 0) {
+                    for (char* at = buffer; at < buffer + n;) {
+                        auto* event = reinterpret_cast<inotify_event*>(at);
+                        at += sizeof(inotify_event) + event->len;
+                        if (event->mask & IN_Q_OVERFLOW) {
+                            // Events were lost, so every tag file is reported again; unchanged ones change nothing
+                            std::cerr << "Warning: Missed changes under " << root_ << ", checking every tag file again." << std::endl;
+                            if (pending.empty()) deadline = std::chrono::steady_clock::now() + interval_;
+                            watch_tree(root_, pending, true);
+                            continue;
+                        }
+                        if (event->mask & IN_IGNORED) {
+                            // The directory was deleted or unmounted and its watch is gone
+                            watches_.erase(event->wd);
+                            continue;
+                        }
+                        auto dir = watches_.find(event->wd);
+                        if (event->len == 0 || dir == watches_.end()) continue;
+                        std::string path = dir->second + "/" + event->name;
+                        if (pending.empty()) deadline = std::chrono::steady_clock::now() + interval_;
+                        if (event->mask & IN_ISDIR) {
+                            if (event->mask & (IN_CREATE | IN_MOVED_TO)) watch_tree(path, pending, true);
+                        } else if (!(event->mask & IN_CREATE) && fs::path(path).extension() == ".json") {
+                            std::error_code ec;
+                            pending.insert(fs::relative(path, root_, ec).string());
+                        }
+                    }
+                }
+            }
+            if (!pending.empty() && std::chrono::steady_clock::now() >= deadline) {
+                std::vector<std::string> batch(pending.begin(), pending.end());
+                pending.clear();
+                try {
+                    handler_(batch);
+                } catch (const std::exception& e) {
+                    std::cerr << "Warning: Ingesting " << batch.size() << " tag files failed: " << e.what() << std::endl;
+                }
+            }
+        }
+    }
+
+    int fd_ = -1;
+    std::unordered_map<int, std::string> watches_; // Watch descriptor -> directory
+#endif
+
+    std::string root_;
+    std::chrono::milliseconds interval_;
+    Handler handler_;
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+};